@@ -33,7 +33,9 @@ ASTIndexer::ASTIndexer(IndexerContext &indexerContext) :
     m_indexerContext(indexerContext),
     m_thisContext(0),
     m_childContext(0),
-    m_typeContext(RT_Reference)
+    m_typeContext(RT_Reference),
+    m_instantiationDepth(0),
+    m_skipRefs(false)
 {
 }
 
@@ -76,10 +78,113 @@ bool ASTIndexer::TraverseTypeLoc(clang::TypeLoc tl)
     return base::TraverseTypeLoc(tl);
 }
 
+static bool isTemplateInstantiation(clang::TemplateSpecializationKind kind)
+{
+    return kind == clang::TSK_ImplicitInstantiation ||
+            kind == clang::TSK_ExplicitInstantiationDeclaration ||
+            kind == clang::TSK_ExplicitInstantiationDefinition;
+}
+
+static bool isTemplateInstantiation(clang::Decl *d)
+{
+    if (clang::FunctionDecl *fd = llvm::dyn_cast<clang::FunctionDecl>(d))
+        return fd->isTemplateInstantiation();
+    if (clang::CXXRecordDecl *rd = llvm::dyn_cast<clang::CXXRecordDecl>(d))
+        return isTemplateInstantiation(rd->getTemplateSpecializationKind());
+    if (clang::VarDecl *vd = llvm::dyn_cast<clang::VarDecl>(d))
+        return isTemplateInstantiation(vd->getTemplateSpecializationKind());
+    return false;
+}
+
+static bool hasMemberTemplates(clang::DeclContext *dc)
+{
+    for (clang::Decl *member : dc->decls()) {
+        if (llvm::isa<clang::FunctionTemplateDecl>(member) ||
+                llvm::isa<clang::ClassTemplateDecl>(member) ||
+                llvm::isa<clang::VarTemplateDecl>(member))
+            return true;
+        if (clang::RecordDecl *rd = llvm::dyn_cast<clang::RecordDecl>(member)) {
+            if (hasMemberTemplates(rd))
+                return true;
+        }
+    }
+    return false;
+}
+
+// Whether a declaration loaded from a PCH file can be skipped.  Its refs are
+// merged from the index written along with the PCH file, except those in
+// template instantiations, which are visited along with their templates.
+static bool isSkippableDecl(clang::Decl *d)
+{
+    if (llvm::isa<clang::FunctionDecl>(d) || llvm::isa<clang::VarDecl>(d))
+        return !isTemplateInstantiation(d);
+    if (clang::RecordDecl *rd = llvm::dyn_cast<clang::RecordDecl>(d))
+        return !isTemplateInstantiation(d) && !hasMemberTemplates(rd);
+    return llvm::isa<clang::TypedefNameDecl>(d) ||
+            llvm::isa<clang::EnumDecl>(d);
+}
+
+// Whether the refs in a declaration may resolve differently in another
+// translation unit that preprocesses its header the same way.  Overload
+// resolution, argument-dependent lookup and the choice of a specialization
+// in a function body or an initializer depend on the declarations that
+// precede the header.
+static bool hasContextDependentRefs(clang::Decl *d)
+{
+    if (clang::FunctionDecl *fd = llvm::dyn_cast<clang::FunctionDecl>(d)) {
+        if (fd->doesThisDeclarationHaveABody())
+            return true;
+        for (unsigned int i = 0; i < fd->getNumParams(); ++i) {
+            if (fd->getParamDecl(i)->hasDefaultArg())
+                return true;
+        }
+        return false;
+    }
+    if (clang::VarDecl *vd = llvm::dyn_cast<clang::VarDecl>(d))
+        return vd->hasInit();
+    if (clang::FieldDecl *fd = llvm::dyn_cast<clang::FieldDecl>(d))
+        return fd->hasInClassInitializer();
+    if (clang::EnumConstantDecl *ecd =
+            llvm::dyn_cast<clang::EnumConstantDecl>(d))
+        return ecd->getInitExpr() != NULL;
+    return llvm::isa<clang::StaticAssertDecl>(d);
+}
+
+// Whether the declaration has nothing to visit once its refs are skipped.
+static bool isLeafDecl(clang::Decl *d)
+{
+    return llvm::isa<clang::TypedefNameDecl>(d) ||
+            llvm::isa<clang::FunctionDecl>(d) ||
+            llvm::isa<clang::VarDecl>(d) ||
+            llvm::isa<clang::FieldDecl>(d) ||
+            llvm::isa<clang::EnumConstantDecl>(d);
+}
+
+// Declarations loaded from a PCH file are skipped.  In a header that another
+// translation unit already indexed, the refs of namespaces, records,
+// typedefs, enums and function prototypes are not recorded again, but
+// function bodies, initializers and default arguments are still indexed,
+// along with template instantiations.
 bool ASTIndexer::TraverseDecl(clang::Decl *d)
 {
+    if (d == NULL)
+        return true;
+    if (m_instantiationDepth == 0 && d->isFromASTFile() && isSkippableDecl(d))
+        return true;
+    const bool isInstantiation = isTemplateInstantiation(d);
+    const bool skipRefs =
+            m_instantiationDepth == 0 && !isInstantiation &&
+            (m_skipRefs || d->getDeclContext() == NULL ||
+             d->getDeclContext()->getRedeclContext()->isFileContext()) &&
+            m_indexerContext.isAlreadyIndexed(d->getLocation()) &&
+            !hasContextDependentRefs(d);
+    if (skipRefs && isLeafDecl(d))
+        return true;
     Switcher<Context> sw1(m_thisContext, 0);
     Switcher<Context> sw2(m_childContext, 0);
+    Switcher<int> sw3(m_instantiationDepth,
+                      m_instantiationDepth + isInstantiation);
+    Switcher<bool> sw4(m_skipRefs, skipRefs);
     return base::TraverseDecl(d);
 }
 
@@ -701,6 +806,11 @@ void ASTIndexer::RecordDeclRef(
     if (isNamedDeclUnnamed(d))
         return;
 
+    // Another translation unit recorded the refs in this part of an
+    // already-indexed header.
+    if (m_skipRefs && m_indexerContext.isAlreadyIndexed(beginLoc))
+        return;
+
     beginLoc = m_indexerContext.sourceManager().getSpellingLoc(beginLoc);
     clang::FileID fileID;
     if (beginLoc.isValid())
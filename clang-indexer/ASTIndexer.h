@@ -42,6 +42,8 @@ private:
     Context m_thisContext;
     Context m_childContext;
     RefType m_typeContext;
+    int m_instantiationDepth;
+    bool m_skipRefs;
 
     // Misc routines
     bool shouldVisitTemplateInstantiations() const { return true; }
@@ -25,7 +25,7 @@ Daemon::Daemon()
 
 Daemon::~Daemon()
 {
-    fprintf(m_process->stdoutFile(), "\n");
+    // Closing the daemon's stdin stops it.
     delete m_process;
 }
 
@@ -34,27 +34,19 @@ int Daemon::run(
         const std::vector<std::string> &args)
 {
     // Send the job.
-    fprintf(m_process->stdinFile(), "%s\n", workingDirectory.c_str());
-    for (const std::string &arg : args) {
-        // TODO: What about embedded newlines in arguments?
-        fprintf(m_process->stdinFile(), "%s\n", arg.c_str());
-    }
-    fprintf(m_process->stdinFile(), "\n");
-    fflush(m_process->stdinFile());
-
-    // Wait for completion.
-    while (true) {
-        bool isEof;
-        std::string line = readLine(m_process->stdoutFile(), &isEof);
-        if (isEof) {
-            std::cerr << "ccb-clang-indexer: daemon exited unexpectedly"
-                      << std::endl;
-            return 1;
-        }
-        if (stringStartsWith(line, "DONE ")) {
-            return atoi(line.c_str() + 5);
-        }
+    std::vector<std::string> message;
+    message.push_back(workingDirectory);
+    message.insert(message.end(), args.begin(), args.end());
+    writeMessage(m_process->stdinFile(), message);
+
+    // Wait for completion.  The reply holds the status code.
+    if (!readMessage(m_process->stdoutFile(), message) ||
+            message.size() != 1) {
+        std::cerr << "ccb-clang-indexer: daemon exited unexpectedly"
+                  << std::endl;
+        return 1;
     }
+    return atoi(message[0].c_str());
 }
 
 
@@ -119,6 +119,14 @@ void IndexBuilder::populateIndexTables()
     }
 }
 
+// Declare the ReferenceIndex and SymbolTypeIndex tables as derived tables of
+// a streaming merge.  The column orders must match populateIndexTables.
+void IndexBuilder::addIndexTables(indexdb::IndexMerger &merger)
+{
+    merger.addDerivedTable("ReferenceIndex", "Reference", { 4, 5, 0, 1, 2, 3 });
+    merger.addDerivedTable("SymbolTypeIndex", "Symbol", { 1, 0 });
+}
+
 void IndexBuilder::recordRef(
         indexdb::ID symbolID,
         const Location &start,
@@ -138,7 +146,7 @@ void IndexBuilder::recordRef(
     }
 
     {
-        indexdb::Row row(6);
+        indexdb::FixedRow<6> row;
         row[0] = start.fileID;
         row[1] = start.line;
         row[2] = startColumn;
@@ -151,7 +159,7 @@ void IndexBuilder::recordRef(
     if (m_refIndexTable != NULL) {
         // XXX: This code is not currently being tested -- all refs are
         // recorded before the ReferenceIndex table is created.
-        indexdb::Row row(6);
+        indexdb::FixedRow<6> row;
         row[0] = symbolID;
         row[1] = refTypeID;
         row[2] = start.fileID;
@@ -166,7 +174,7 @@ void IndexBuilder::recordSymbol(
         indexdb::ID symbolID,
         indexdb::ID symbolTypeID)
 {
-    indexdb::Row row(2);
+    indexdb::FixedRow<2> row;
     row[0] = symbolID;
     row[1] = symbolTypeID;
     m_symbolTable->add(row);
@@ -174,7 +182,7 @@ void IndexBuilder::recordSymbol(
 
 void IndexBuilder::recordGlobalSymbol(indexdb::ID symbolID)
 {
-    indexdb::Row row(1);
+    indexdb::FixedRow<1> row;
     row[0] = symbolID;
     m_globalSymbolTable->add(row);
 }
@@ -2,6 +2,7 @@
 #define INDEXER_INDEXBUILDER_H
 
 #include "../libindexdb/IndexDb.h"
+#include "../libindexdb/IndexMerger.h"
 
 namespace indexer {
 
@@ -15,6 +16,7 @@ class IndexBuilder
 public:
     IndexBuilder(indexdb::Index &index, bool createIndexTables=true);
     void populateIndexTables();
+    static void addIndexTables(indexdb::IndexMerger &merger);
 
     void recordRef(
             indexdb::ID symbolID,
@@ -0,0 +1,54 @@
+#include "IndexedFileRegistry.h"
+
+#include <cstdio>
+
+#include <sha2.h>
+
+namespace indexer {
+
+IndexedFileRegistry::IndexedFileRegistry(const std::string &directory) :
+    m_directory(directory)
+{
+}
+
+// Each key is registered as an empty file named after the key's SHA-256 hash.
+std::string IndexedFileRegistry::keyPath(const std::string &key) const
+{
+    static const char kHexDigits[] = "0123456789abcdef";
+    unsigned char digest[SHA256_DIGEST_SIZE];
+    sha256(reinterpret_cast<const unsigned char*>(key.data()), key.size(),
+           digest);
+    std::string ret = m_directory + "/";
+    for (unsigned char ch : digest) {
+        ret.push_back(kHexDigits[ch >> 4]);
+        ret.push_back(kHexDigits[ch & 0xF]);
+    }
+    return ret;
+}
+
+bool IndexedFileRegistry::contains(const std::string &key) const
+{
+    FILE *fp = fopen(keyPath(key).c_str(), "rb");
+    if (fp == NULL)
+        return false;
+    fclose(fp);
+    return true;
+}
+
+// The key is registered by commit, once the archive is written.
+void IndexedFileRegistry::add(const std::string &key)
+{
+    m_addedKeys.push_back(key);
+}
+
+void IndexedFileRegistry::commit()
+{
+    for (const std::string &key : m_addedKeys) {
+        FILE *fp = fopen(keyPath(key).c_str(), "wb");
+        if (fp != NULL)
+            fclose(fp);
+    }
+    m_addedKeys.clear();
+}
+
+} // namespace indexer
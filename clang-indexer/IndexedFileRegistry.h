@@ -0,0 +1,32 @@
+#ifndef INDEXER_INDEXEDFILEREGISTRY_H
+#define INDEXER_INDEXEDFILEREGISTRY_H
+
+#include <string>
+#include <vector>
+
+namespace indexer {
+
+// The files already indexed by the translation units of one --index-project
+// run, shared by the indexer daemons through a directory.  A file is
+// registered under a key that also describes the macros it was preprocessed
+// with, and only after the archive holding its index entry was written, so a
+// translation unit that finds a key can leave the refs in that file's
+// declarations to the archive that registered it.
+class IndexedFileRegistry
+{
+public:
+    explicit IndexedFileRegistry(const std::string &directory);
+    bool contains(const std::string &key) const;
+    void add(const std::string &key);
+    void commit();
+
+private:
+    std::string keyPath(const std::string &key) const;
+
+    std::string m_directory;
+    std::vector<std::string> m_addedKeys;
+};
+
+} // namespace indexer
+
+#endif // INDEXER_INDEXEDFILEREGISTRY_H
@@ -1,11 +1,25 @@
 #include "IndexerContext.h"
 
 #include <clang/Basic/FileManager.h>
+#include <clang/Basic/LangOptions.h>
 #include <clang/Basic/SourceManager.h>
+#include <clang/Basic/TargetInfo.h>
+#include <clang/Basic/TargetOptions.h>
+#include <clang/Lex/HeaderSearch.h>
+#include <clang/Lex/HeaderSearchOptions.h>
+#include <clang/Lex/Lexer.h>
+#include <clang/Lex/MacroInfo.h>
+#include <clang/Lex/Preprocessor.h>
+#include <clang/Lex/PreprocessorOptions.h>
+#include <clang/Lex/Token.h>
+#include <llvm/Support/MD5.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <algorithm>
+#include <sstream>
 
 #include "../libindexdb/IndexDb.h"
 #include "../libindexdb/IndexArchiveBuilder.h"
-#include "NameGenerator.h"
+#include "IndexedFileRegistry.h"
 #include "Util.h"
 
 namespace indexer {
@@ -66,16 +80,60 @@ static_assert(sizeof(symbolTypeNames) / sizeof(symbolTypeNames[0]) == ST_Max,
 ///////////////////////////////////////////////////////////////////////////////
 // IndexerFileContext
 
+// The line starts are computed the way SourceManager computes them: a line
+// ends at a '\n' or '\r', or at a "\r\n" or "\n\r" pair.
+void IndexerFileContext::computeLineStarts()
+{
+    m_lineStartsComputed = true;
+    bool invalid = false;
+    const llvm::MemoryBuffer *buffer =
+            m_context.sourceManager().getBuffer(m_clangFileID, &invalid);
+    if (invalid || buffer == NULL)
+        return;
+    const char *const start = buffer->getBufferStart();
+    const char *const end = buffer->getBufferEnd();
+    m_lineStarts.push_back(0);
+    for (const char *p = start; p != end; ++p) {
+        if (*p != '\n' && *p != '\r')
+            continue;
+        if (p + 1 != end && (p[1] == '\n' || p[1] == '\r') && p[0] != p[1])
+            ++p;
+        m_lineStarts.push_back(p + 1 - start);
+    }
+}
+
+// References are mostly recorded in increasing order, so the line of the
+// previous location, or the line after it, is checked before searching.
 Location IndexerFileContext::location(clang::SourceLocation spellingLoc)
 {
     Location ret;
     ret.fileID = m_indexPathID;
     clang::SourceManager &sourceManager = m_context.sourceManager();
     unsigned int offset = sourceManager.getFileOffset(spellingLoc);
-    // TODO: The comment for getLineNumber says it's slow.  Is this going to
-    // be a problem?
-    ret.line = sourceManager.getLineNumber(m_clangFileID, offset);
-    ret.column = sourceManager.getColumnNumber(m_clangFileID, offset);
+    if (!m_lineStartsComputed)
+        computeLineStarts();
+    if (m_lineStarts.empty()) {
+        ret.line = sourceManager.getLineNumber(m_clangFileID, offset);
+        ret.column = sourceManager.getColumnNumber(m_clangFileID, offset);
+        return ret;
+    }
+
+    const size_t lineCount = m_lineStarts.size();
+    size_t line = m_lastLine;
+    if (offset < m_lineStarts[line] ||
+            (line + 1 < lineCount && offset >= m_lineStarts[line + 1])) {
+        if (line + 2 < lineCount && offset >= m_lineStarts[line + 1] &&
+                offset < m_lineStarts[line + 2]) {
+            line++;
+        } else {
+            line = std::upper_bound(m_lineStarts.begin(),
+                                    m_lineStarts.end(),
+                                    offset) - m_lineStarts.begin() - 1;
+        }
+        m_lastLine = line;
+    }
+    ret.line = line + 1;
+    ret.column = offset - m_lineStarts[line] + 1;
     return ret;
 }
 
@@ -87,9 +145,8 @@ indexdb::ID IndexerFileContext::getDeclSymbolID(clang::NamedDecl *decl)
     if (it != m_declNameCache.end()) {
         symbolID = it->second;
     } else {
-        m_tempSymbolName.clear();
-        getDeclName(decl, m_tempSymbolName);
-        symbolID = m_builder.insertSymbol(m_tempSymbolName.c_str());
+        symbolID = m_builder.insertSymbol(
+                    m_context.declName(decl).c_str());
         m_declNameCache[decl] = symbolID;
     }
     return symbolID;
@@ -103,7 +160,11 @@ IndexerFileContext::IndexerFileContext(
     m_clangFileID(fileID),
     m_index(new indexdb::Index),
     m_indexPathID(indexdb::kInvalidID),
-    m_builder(*m_index, /*createIndexTables=*/false)
+    m_builder(*m_index, /*createIndexTables=*/false),
+    m_lineStartsComputed(false),
+    m_lastLine(0),
+    m_registryFile(NULL),
+    m_entered(false)
 {
     std::fill(&m_refTypeIDs[0],
               &m_refTypeIDs[RT_Max],
@@ -131,13 +192,29 @@ indexdb::ID IndexerFileContext::createSymbolTypeID(SymbolType symbolType)
 ///////////////////////////////////////////////////////////////////////////////
 // IndexerContext
 
+// Returns the 128-bit MD5 digest of the data, for use in registry keys.
+static std::string keyDigest(llvm::StringRef data)
+{
+    llvm::MD5 md5;
+    md5.update(data);
+    llvm::MD5::MD5Result result;
+    md5.final(result);
+    std::string ret;
+    for (int i = 0; i < 16; ++i)
+        ret.push_back(static_cast<char>(result[i]));
+    return ret;
+}
+
 IndexerContext::IndexerContext(
         clang::SourceManager &sourceManager,
         clang::Preprocessor &preprocessor,
-        indexdb::IndexArchiveBuilder &archive) :
+        indexdb::IndexArchiveBuilder &archive,
+        IndexedFileRegistry *registry) :
     m_sourceManager(sourceManager),
     m_preprocessor(preprocessor),
-    m_archive(archive)
+    m_archive(archive),
+    m_registry(registry),
+    m_filesClaimed(false)
 {
 }
 
@@ -187,12 +264,262 @@ IndexerFileContext &IndexerContext::fileContext(clang::FileID fileID)
         m_fileContextSet.insert(ret);
         assert(pathSymbolName[0] == '@');
         m_archive.insert(pathSymbolName.substr(1), ret->index());
+
+        // Only the headers parsed by this translation unit can be registered.
+        // The main file and the files loaded from a PCH file cannot.
+        const clang::FileEntry *pFE =
+                m_sourceManager.getFileEntryForID(fileID);
+        if (m_registry != NULL && !m_filesClaimed && pFE != NULL &&
+                fileID != m_sourceManager.getMainFileID() &&
+                !m_sourceManager.isLoadedFileID(fileID)) {
+            std::stringstream key;
+            key << invocationDigest() << pathSymbolName << '\0'
+                << pFE->getSize() << '\0'
+                << pFE->getModificationTime() << '\0';
+            ret->m_registryFile = pFE;
+            ret->m_registryKey = key.str();
+        }
     }
 
     m_fileIDMap[fileID] = ret;
     return *ret;
 }
 
+// Returns the registrable file context of the file a macro event occurred in.
+// A macro event is attributed to the file where its macro expansion began, so
+// a header's key also describes the macros that the header's macros expand.
+IndexerFileContext *IndexerContext::registryFileContext(
+        clang::SourceLocation loc)
+{
+    if (m_registry == NULL || m_filesClaimed || loc.isInvalid())
+        return NULL;
+    IndexerFileContext &ret = fileContext(
+                m_sourceManager.getFileID(
+                    m_sourceManager.getExpansionLoc(loc)));
+    return (ret.m_registryFile != NULL) ? &ret : NULL;
+}
+
+// Returns a digest of the options that change how any header of the
+// translation unit is parsed: the language and target options, the
+// predefined macros (which include the -D and -U options), the header search
+// paths, and the PCH file.  The results of __has_feature and __has_builtin
+// follow from the language and target, and those of __has_include from the
+// search paths.
+const std::string &IndexerContext::invocationDigest()
+{
+    if (!m_invocationDigest.empty())
+        return m_invocationDigest;
+
+    std::stringstream text;
+    const clang::LangOptions &langOpts = m_preprocessor.getLangOpts();
+#define LANGOPT(Name, Bits, Default, Description) \
+    text << #Name << '=' << langOpts.Name << '\n';
+#define ENUM_LANGOPT(Name, Type, Bits, Default, Description) \
+    text << #Name << '=' << static_cast<unsigned>(langOpts.get##Name()) << '\n';
+#include <clang/Basic/LangOptions.def>
+
+    const clang::TargetOptions &targetOpts =
+            m_preprocessor.getTargetInfo().getTargetOpts();
+    text << targetOpts.Triple << '\0' << targetOpts.CPU << '\0'
+         << targetOpts.ABI << '\0';
+    for (const std::string &feature : targetOpts.FeaturesAsWritten)
+        text << feature << '\0';
+
+    text << m_preprocessor.getPredefines() << '\0';
+
+    const clang::HeaderSearchOptions &searchOpts =
+            m_preprocessor.getHeaderSearchInfo().getHeaderSearchOpts();
+    text << searchOpts.Sysroot << '\0' << searchOpts.ResourceDir << '\0';
+    for (const auto &entry : searchOpts.UserEntries) {
+        text << entry.Path << '\0' << static_cast<int>(entry.Group) << '\0'
+             << entry.IsFramework << '\0';
+    }
+    text << m_preprocessor.getPreprocessorOpts().ImplicitPCHInclude << '\0';
+
+    m_invocationDigest = keyDigest(text.str());
+    return m_invocationDigest;
+}
+
+// Returns a 128-bit digest of a macro's definition.
+const std::string &IndexerContext::macroDefinitionDigest(
+        const clang::MacroInfo *macroInfo)
+{
+    auto it = m_macroDefinitionDigests.find(macroInfo);
+    if (it != m_macroDefinitionDigests.end())
+        return it->second;
+
+    std::string definition;
+    if (macroInfo->isFunctionLike()) {
+        definition.push_back('(');
+        for (auto arg = macroInfo->arg_begin(), argEnd = macroInfo->arg_end();
+                arg != argEnd; ++arg) {
+            definition += (*arg)->getName();
+            definition.push_back(',');
+        }
+        if (macroInfo->isVariadic())
+            definition += "...";
+        definition.push_back(')');
+    }
+    for (auto tok = macroInfo->tokens_begin(),
+            tokEnd = macroInfo->tokens_end(); tok != tokEnd; ++tok) {
+        definition.push_back(' ');
+        definition += m_preprocessor.getSpelling(*tok);
+    }
+    std::string &ret = m_macroDefinitionDigests[macroInfo];
+    ret = keyDigest(definition);
+    return ret;
+}
+
+// Record a macro expansion or test in the key of the file where it occurred.
+// The macro info is NULL if the macro was not defined.
+void IndexerContext::recordMacroEvent(
+        char kind,
+        const clang::Token &macroNameToken,
+        const clang::MacroInfo *macroInfo)
+{
+    IndexerFileContext *fileContext =
+            registryFileContext(macroNameToken.getLocation());
+    if (fileContext == NULL)
+        return;
+    std::string &key = fileContext->m_registryKey;
+    const llvm::StringRef name = macroNameToken.getIdentifierInfo()->getName();
+    key.push_back(kind);
+    key.append(name.data(), name.size());
+    if (macroInfo != NULL) {
+        key.push_back('\1');
+        key += macroDefinitionDigest(macroInfo);
+    } else {
+        key.push_back('\0');
+    }
+}
+
+// Record the file an #include directive found in the key of the file holding
+// the directive.
+void IndexerContext::recordIncludeEvent(
+        clang::SourceLocation hashLoc,
+        llvm::StringRef fileName,
+        const clang::FileEntry *file)
+{
+    IndexerFileContext *fileContext = registryFileContext(hashLoc);
+    if (fileContext == NULL)
+        return;
+    std::string &key = fileContext->m_registryKey;
+    key.push_back('I');
+    if (file != NULL) {
+        key.push_back('\1');
+        key += file->getName();
+    } else {
+        key.push_back('\0');
+        key += fileName;
+    }
+    key.push_back('\0');
+}
+
+// Record the first entry of each registrable file, in order.  The files
+// entered before a header, and the main file's tokens before the #include
+// that led to it, declare everything its refs can resolve to, so they are
+// part of its key.
+void IndexerContext::recordFileEntry(clang::SourceLocation loc)
+{
+    if (m_registry == NULL || m_filesClaimed || loc.isInvalid())
+        return;
+    const clang::FileID fileID = m_sourceManager.getFileID(loc);
+    IndexerFileContext &entered = fileContext(fileID);
+    if (entered.m_registryFile == NULL || entered.m_entered)
+        return;
+    entered.m_entered = true;
+    entered.m_mainFilePrefixDigest = mainFilePrefixDigest(fileID);
+    m_enteredFiles.push_back(&entered);
+}
+
+// Returns a digest of the main file's tokens before the #include that led to
+// the given file.  Comments and whitespace are not part of it.  The digest is
+// empty if the file was not included from the main file, e.g. if it was
+// included by a -include option.
+const std::string &IndexerContext::mainFilePrefixDigest(clang::FileID fileID)
+{
+    static const std::string empty;
+    const clang::FileID mainFileID = m_sourceManager.getMainFileID();
+    clang::SourceLocation includeLoc;
+    for (;;) {
+        includeLoc = m_sourceManager.getIncludeLoc(fileID);
+        if (includeLoc.isInvalid())
+            return empty;
+        const clang::FileID includerID = m_sourceManager.getFileID(includeLoc);
+        if (includerID == mainFileID)
+            break;
+        fileID = includerID;
+    }
+
+    const unsigned int prefixSize = m_sourceManager.getFileOffset(includeLoc);
+    auto it = m_mainFilePrefixDigests.find(prefixSize);
+    if (it != m_mainFilePrefixDigests.end())
+        return it->second;
+
+    std::string tokens;
+    bool invalid = false;
+    const llvm::MemoryBuffer *buffer =
+            m_sourceManager.getBuffer(mainFileID, &invalid);
+    if (!invalid && buffer != NULL) {
+        const char *const start = buffer->getBufferStart();
+        clang::Lexer lexer(m_sourceManager.getLocForStartOfFile(mainFileID),
+                           m_preprocessor.getLangOpts(),
+                           start, start, buffer->getBufferEnd());
+        clang::Token token;
+        for (;;) {
+            const bool atEnd = lexer.LexFromRawLexer(token);
+            if (token.is(clang::tok::eof))
+                break;
+            const unsigned int offset =
+                    m_sourceManager.getFileOffset(token.getLocation());
+            if (offset >= prefixSize)
+                break;
+            tokens.append(start + offset, token.getLength());
+            tokens.push_back('\0');
+            if (atEnd)
+                break;
+        }
+    }
+    std::string &ret = m_mainFilePrefixDigests[prefixSize];
+    ret = keyDigest(tokens);
+    return ret;
+}
+
+// Once the translation unit is preprocessed, look up each header's key in the
+// registry.  The key used is the header's own key followed by a digest of the
+// keys of the files entered before it, and of the main file's tokens before
+// it.  A header found there was indexed by another translation unit with the
+// same options and macros, after the same headers and declarations, so its
+// refs resolve the same way.  The refs in its declarations are not recorded
+// again, but its function bodies, initializers, default arguments and
+// template instantiations are still indexed.  The other headers are
+// registered.
+//
+// Only headers with an include guard are considered.  Headers without one,
+// like .def files, may be included within a declaration, and their refs then
+// depend on the enclosing header.
+void IndexerContext::claimIndexedFiles()
+{
+    if (m_registry == NULL || m_filesClaimed)
+        return;
+    m_filesClaimed = true;
+    clang::HeaderSearch &headerSearch = m_preprocessor.getHeaderSearchInfo();
+    std::string precedingDigest;
+    for (IndexerFileContext *fileContext : m_enteredFiles) {
+        const clang::FileEntry *file = fileContext->m_registryFile;
+        const std::string key = fileContext->m_registryKey + '\0' +
+                precedingDigest + fileContext->m_mainFilePrefixDigest;
+        precedingDigest = keyDigest(
+                    precedingDigest + keyDigest(fileContext->m_registryKey));
+        if (!headerSearch.isFileMultipleIncludeGuarded(file))
+            continue;
+        if (m_registry->contains(key))
+            m_alreadyIndexedFiles.insert(file);
+        else
+            m_registry->add(key);
+    }
+}
+
 IndexerContext::~IndexerContext()
 {
     for (IndexerFileContext *fileContext : m_fileContextSet)
@@ -4,6 +4,7 @@
 #include <string>
 #include <unordered_map>
 #include <unordered_set>
+#include <vector>
 
 #include <clang/Basic/FileManager.h>
 #include <clang/Basic/SourceManager.h>
@@ -12,15 +13,19 @@
 #include "../libindexdb/IndexArchiveBuilder.h"
 #include "Location.h"
 #include "IndexBuilder.h"
+#include "NameGenerator.h"
 
 namespace clang {
+    class MacroInfo;
     class NamedDecl;
     class Preprocessor;
     class SourceManager;
+    class Token;
 }
 
 namespace indexer {
 
+class IndexedFileRegistry;
 class IndexerContext;
 
 
@@ -110,6 +115,7 @@ private:
             const std::string &pathSymbolName);
     indexdb::ID createRefTypeID(RefType refType);
     indexdb::ID createSymbolTypeID(SymbolType symbolType);
+    void computeLineStarts();
 
     IndexerContext &m_context;
     clang::FileID m_clangFileID;
@@ -117,7 +123,25 @@ private:
     indexdb::ID m_indexPathID;
     IndexBuilder m_builder;
 
-    std::string m_tempSymbolName;
+    // The offset of each line in the file, computed on first use, and the
+    // 0-based line of the last location.  The table is empty if the file's
+    // buffer is unavailable.
+    bool m_lineStartsComputed;
+    std::vector<unsigned int> m_lineStarts;
+    size_t m_lastLine;
+
+    // With a registry, the file's registry key: a digest of the compiler
+    // invocation, the file's path, size and modification time, followed by
+    // the macro and #include events preprocessed in it.
+    // The file entry is NULL if the file cannot be registered.
+    const clang::FileEntry *m_registryFile;
+    std::string m_registryKey;
+
+    // Whether the file was entered, and a digest of the main file's tokens
+    // before the #include that led to it.
+    bool m_entered;
+    std::string m_mainFilePrefixDigest;
+
     std::unordered_map<clang::NamedDecl*, indexdb::ID> m_declNameCache;
     indexdb::ID m_refTypeIDs[RT_Max];
     indexdb::ID m_symbolTypeIDs[ST_Max];
@@ -133,12 +157,36 @@ public:
     IndexerContext(
             clang::SourceManager &sourceManager,
             clang::Preprocessor &preprocessor,
-            indexdb::IndexArchiveBuilder &archive);
+            indexdb::IndexArchiveBuilder &archive,
+            IndexedFileRegistry *registry=NULL);
     ~IndexerContext();
     clang::SourceManager &sourceManager() { return m_sourceManager; }
     clang::Preprocessor &preprocessor() { return m_preprocessor; }
     indexdb::IndexArchiveBuilder &archive() { return m_archive; }
     IndexerFileContext &fileContext(clang::FileID fileID);
+    const std::string &declName(clang::NamedDecl *decl) {
+        return m_declNames.name(decl);
+    }
+
+    // Files already indexed by another translation unit.
+    void recordMacroEvent(
+            char kind,
+            const clang::Token &macroNameToken,
+            const clang::MacroInfo *macroInfo);
+    void recordIncludeEvent(
+            clang::SourceLocation hashLoc,
+            llvm::StringRef fileName,
+            const clang::FileEntry *file);
+    void recordFileEntry(clang::SourceLocation loc);
+    void claimIndexedFiles();
+    bool isAlreadyIndexed(clang::SourceLocation loc) {
+        if (m_alreadyIndexedFiles.empty() || loc.isInvalid())
+            return false;
+        const clang::FileID fileID =
+                m_sourceManager.getFileID(m_sourceManager.getExpansionLoc(loc));
+        return m_alreadyIndexedFiles.count(
+                    m_sourceManager.getFileEntryForID(fileID)) != 0;
+    }
 
     // Disallow copying of this class.
     IndexerContext(IndexerContext &other) = delete;
@@ -151,12 +199,26 @@ private:
         }
     };
 
+    IndexerFileContext *registryFileContext(clang::SourceLocation loc);
+    const std::string &invocationDigest();
+    const std::string &mainFilePrefixDigest(clang::FileID fileID);
+    const std::string &macroDefinitionDigest(const clang::MacroInfo *macroInfo);
+
     clang::SourceManager &m_sourceManager;
     clang::Preprocessor &m_preprocessor;
     indexdb::IndexArchiveBuilder &m_archive;
     std::unordered_map<clang::FileID, IndexerFileContext*, FileIDHash> m_fileIDMap;
     std::unordered_map<std::string, IndexerFileContext*> m_fileNameMap;
     std::unordered_set<IndexerFileContext*> m_fileContextSet;
+    DeclNameCache m_declNames;
+
+    IndexedFileRegistry *m_registry;
+    bool m_filesClaimed;
+    std::unordered_set<const clang::FileEntry*> m_alreadyIndexedFiles;
+    std::string m_invocationDigest;
+    std::vector<IndexerFileContext*> m_enteredFiles;
+    std::unordered_map<unsigned int, std::string> m_mainFilePrefixDigests;
+    std::unordered_map<const clang::MacroInfo*, std::string> m_macroDefinitionDigests;
 };
 
 } // namespace indexer
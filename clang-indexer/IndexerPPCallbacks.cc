@@ -27,6 +27,8 @@ void IndexerPPCallbacks::InclusionDirective(
         llvm::StringRef relativePath,
         const clang::Module *imported)
 {
+    m_context.recordIncludeEvent(hashLoc, fileName, file);
+
     if (file == NULL) {
         // The file can be NULL, in which case there is nothing for the indexer
         // to record.  (For example, the target of an #include might not be
@@ -85,12 +87,23 @@ IndexerPPCallbacks::getIncludeFilenameLoc(
                            fileContext.location(endLoc));
 }
 
+void IndexerPPCallbacks::FileChanged(
+        clang::SourceLocation loc,
+        FileChangeReason reason,
+        clang::SrcMgr::CharacteristicKind fileType,
+        clang::FileID prevFID)
+{
+    if (reason == EnterFile)
+        m_context.recordFileEntry(loc);
+}
+
 void IndexerPPCallbacks::MacroExpands(
         const clang::Token &macroNameToken,
         const clang::MacroDefinition &md,
         clang::SourceRange range,
         const clang::MacroArgs *args)
 {
+    m_context.recordMacroEvent('E', macroNameToken, md.getMacroInfo());
     recordReference(macroNameToken, RT_Expansion);
 }
 
@@ -113,6 +126,7 @@ void IndexerPPCallbacks::Defined(
         const clang::MacroDefinition &md,
         clang::SourceRange range)
 {
+    m_context.recordMacroEvent('D', macroNameToken, md.getMacroInfo());
     recordReference(macroNameToken, RT_DefinedTest);
 }
 
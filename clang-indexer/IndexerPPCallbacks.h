@@ -37,6 +37,11 @@ private:
     std::tuple<IndexerFileContext*, Location, Location>
     getIncludeFilenameLoc(clang::CharSourceRange filenameRange);
 
+    virtual void FileChanged(clang::SourceLocation loc,
+                             FileChangeReason reason,
+                             clang::SrcMgr::CharacteristicKind fileType,
+                             clang::FileID prevFID) override;
+
     virtual void MacroExpands(const clang::Token &macroNameToken,
                               const clang::MacroDefinition &md,
                               clang::SourceRange range,
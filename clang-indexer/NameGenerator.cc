@@ -7,7 +7,6 @@
 #include <llvm/Support/raw_ostream.h>
 #include <string>
 
-#include "Switcher.h"
 #include "Util.h"
 
 namespace indexer {
@@ -19,8 +18,13 @@ namespace indexer {
 class NameGenerator : public clang::DeclVisitor<NameGenerator>
 {
 public:
-    NameGenerator(clang::NamedDecl *originalDecl, std::string &output);
-    bool error() { return m_error; }
+    NameGenerator(
+            DeclNameCache &cache,
+            clang::NamedDecl *originalDecl,
+            std::string &output);
+    void generateContextName(
+            clang::NamedDecl *decl,
+            DeclNameCache::ContextName &output);
     void VisitDeclContext(clang::DeclContext *context);
     void VisitNamespaceDecl(clang::NamespaceDecl *decl);
     void VisitClassTemplateSpecializationDecl(
@@ -32,11 +36,12 @@ public:
 
 private:
     void outputSeparator();
+    void outputFilePrefix();
     void outputFunctionIdentifier(clang::DeclarationName name);
 
 private:
+    DeclNameCache &m_cache;
     clang::NamedDecl *m_originalDecl;
-    bool m_error;
     bool m_needSeparator;
     bool m_needFilePrefix;
     bool m_needOffsetPrefix;
@@ -48,17 +53,42 @@ private:
 ///////////////////////////////////////////////////////////////////////////////
 // NameGenerator implementation
 
-NameGenerator::NameGenerator(clang::NamedDecl *originalDecl, std::string &output) :
+// If originalDecl is NULL, the generator names a declaration context, and it
+// leaves out the filename prefix.
+NameGenerator::NameGenerator(
+        DeclNameCache &cache,
+        clang::NamedDecl *originalDecl,
+        std::string &output) :
+    m_cache(cache),
     m_originalDecl(originalDecl),
-    m_error(false),
     m_needSeparator(false),
     m_needFilePrefix(false),
     m_needOffsetPrefix(false),
-    m_inDeclContext(false),
+    m_inDeclContext(originalDecl == NULL),
     m_out(output)
 {
 }
 
+void NameGenerator::generateContextName(
+        clang::NamedDecl *decl,
+        DeclNameCache::ContextName &output)
+{
+    if (clang::FunctionDecl *funcDecl =
+            llvm::dyn_cast<clang::FunctionDecl>(decl)) {
+        if (funcDecl->isThisDeclarationADefinition()) {
+            // For declarations inside a function body, prefix both a
+            // filename and a file offset.
+            m_needFilePrefix = true;
+            m_needOffsetPrefix = true;
+        }
+    }
+    Visit(decl);
+    m_out.flush();
+    output.needFilePrefix = m_needFilePrefix;
+    output.needOffsetPrefix = m_needOffsetPrefix;
+    output.needSeparator = m_needSeparator;
+}
+
 void NameGenerator::outputSeparator()
 {
     if (!m_needSeparator)
@@ -71,21 +101,25 @@ void NameGenerator::VisitDeclContext(clang::DeclContext *context)
 {
     if (clang::NamedDecl *decl =
             llvm::dyn_cast_or_null<clang::NamedDecl>(context)) {
-        if (clang::FunctionDecl *funcDecl =
-                llvm::dyn_cast<clang::FunctionDecl>(decl)) {
-            if (funcDecl->isThisDeclarationADefinition()) {
-                // For declarations inside a function body, prefix both a
-                // filename and a file offset.
-                m_needFilePrefix = true;
-                m_needOffsetPrefix = true;
-            }
-        }
-        Switcher<bool> sw1(m_inDeclContext, true);
-        Visit(decl);
+        const DeclNameCache::ContextName &contextName =
+                m_cache.contextName(decl);
+        m_needFilePrefix = m_needFilePrefix || contextName.needFilePrefix;
+        m_needOffsetPrefix =
+                m_needOffsetPrefix || contextName.needOffsetPrefix;
+        outputFilePrefix();
+        m_out << contextName.name;
+        m_needSeparator = contextName.needSeparator;
         return;
     }
 
-    if (!m_needFilePrefix)
+    outputFilePrefix();
+}
+
+// The filename prefix starts the name, so it is written once the flags of
+// every enclosing context are known.
+void NameGenerator::outputFilePrefix()
+{
+    if (m_originalDecl == NULL || !m_needFilePrefix)
         return;
 
     // The symbol has internal linkage, so prepend a filename to the symbol
@@ -314,13 +348,31 @@ void NameGenerator::VisitNamedDecl(clang::NamedDecl *decl)
 
 
 ///////////////////////////////////////////////////////////////////////////////
-// getDeclName
+// DeclNameCache
 
-bool getDeclName(clang::NamedDecl *decl, std::string &output)
+const std::string &DeclNameCache::name(clang::NamedDecl *decl)
 {
-    NameGenerator generator(decl, output);
+    auto it = m_declNames.find(decl);
+    if (it != m_declNames.end())
+        return it->second;
+    std::string &output = m_declNames[decl];
+    NameGenerator generator(*this, decl, output);
     generator.Visit(decl);
-    return !generator.error();
+    return output;
+}
+
+const DeclNameCache::ContextName &DeclNameCache::contextName(
+        clang::NamedDecl *decl)
+{
+    auto it = m_contextNames.find(decl);
+    if (it != m_contextNames.end())
+        return it->second;
+    ContextName contextName;
+    {
+        NameGenerator generator(*this, NULL, contextName.name);
+        generator.generateContextName(decl, contextName);
+    }
+    return m_contextNames[decl] = std::move(contextName);
 }
 
 } // namespace indexer
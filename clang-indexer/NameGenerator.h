@@ -1,12 +1,40 @@
 #ifndef INDEXER_NAMEGENERATOR_H
 #define INDEXER_NAMEGENERATOR_H
 
+#include <string>
+#include <unordered_map>
+
 #include <clang/AST/Decl.h>
 
 namespace indexer {
 
-// Returns true on success.
-bool getDeclName(clang::NamedDecl *decl, std::string &output);
+// Generates the symbol names of declarations.  A name is built by appending
+// one component to the cached name of the enclosing declaration context, and
+// the name of each declaration is generated at most once, so one cache should
+// be shared by a whole translation unit.
+class DeclNameCache
+{
+public:
+    const std::string &name(clang::NamedDecl *decl);
+
+private:
+    friend class NameGenerator;
+
+    // The qualified name of a declaration used as a context, without the
+    // filename prefix, which depends on the declaration being named.  The
+    // flags record whether the context requires that prefix.
+    struct ContextName {
+        std::string name;
+        bool needFilePrefix;
+        bool needOffsetPrefix;
+        bool needSeparator;
+    };
+
+    const ContextName &contextName(clang::NamedDecl *decl);
+
+    std::unordered_map<clang::NamedDecl*, std::string> m_declNames;
+    std::unordered_map<clang::NamedDecl*, ContextName> m_contextNames;
+};
 
 } // namespace indexer
 
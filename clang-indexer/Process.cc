@@ -207,13 +207,13 @@ Process::Process(
     // (i.e. Ownership of the HANDLE is transferred.  See the _open_osfhandle
     // MSDN page.)
     int stdinFd = _open_osfhandle(reinterpret_cast<intptr_t>(hStdinWrite),
-                                  _O_TEXT | _O_RDWR);
+                                  _O_BINARY | _O_RDWR);
     int stdoutFd = _open_osfhandle(reinterpret_cast<intptr_t>(hStdoutRead),
-                                   _O_TEXT | _O_RDONLY);
+                                   _O_BINARY | _O_RDONLY);
     assert(stdinFd != -1);
     assert(stdoutFd != -1);
-    m_stdinFile = _fdopen(stdinFd, "wt");
-    m_stdoutFile = _fdopen(stdoutFd, "rt");
+    m_stdinFile = _fdopen(stdinFd, "wb");
+    m_stdoutFile = _fdopen(stdoutFd, "rb");
     assert(m_stdinFile != NULL);
     assert(m_stdoutFile != NULL);
 #else
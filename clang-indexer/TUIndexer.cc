@@ -10,9 +10,14 @@
 #include <clang/Basic/SourceManager.h>
 #include <clang/Frontend/CompilerInstance.h>
 #include <clang/Frontend/FrontendAction.h>
+#include <clang/Frontend/FrontendActions.h>
+#include <clang/Frontend/MultiplexConsumer.h>
 #include <clang/Lex/Preprocessor.h>
+#include <clang/Lex/PreprocessorOptions.h>
 #include <clang/Tooling/Tooling.h>
 #include <llvm/ADT/StringRef.h>
+#include <cstdlib>
+#include <fstream>
 #include <iostream>
 #include <memory>
 #include <string>
@@ -20,10 +25,12 @@
 
 #include "../libindexdb/IndexDb.h"
 #include "../libindexdb/IndexArchiveBuilder.h"
+#include "../libindexdb/IndexArchiveReader.h"
 #include "ASTIndexer.h"
 #include "IndexBuilder.h"
 #include "IndexerContext.h"
 #include "IndexerPPCallbacks.h"
+#include "Util.h"
 
 namespace indexer {
 
@@ -43,70 +50,258 @@ private:
 
 void IndexerASTConsumer::HandleTranslationUnit(clang::ASTContext &ctx)
 {
+    m_context.claimIndexedFiles();
     ASTIndexer iv(m_context);
     iv.indexDecl(ctx.getTranslationUnitDecl());
 }
 
 
 ///////////////////////////////////////////////////////////////////////////////
-// IndexerAction
+// IndexerActionHooks
 
-class IndexerAction : public clang::ASTFrontendAction {
+// The parts of indexing a translation unit that are shared by the frontend
+// actions below.
+class IndexerActionHooks {
 public:
-    IndexerAction(indexdb::IndexArchiveBuilder &archive) :
-        m_archive(archive), m_context(NULL)
+    IndexerActionHooks(
+            indexdb::IndexArchiveBuilder &archive,
+            IndexedFileRegistry *registry) :
+        m_archive(archive), m_registry(registry), m_context(NULL)
     {
     }
 
-    ~IndexerAction()
+    ~IndexerActionHooks()
     {
         delete m_context;
     }
 
+    std::unique_ptr<clang::ASTConsumer> createASTConsumer(
+            clang::CompilerInstance &ci) {
+        return std::unique_ptr<clang::ASTConsumer>(
+            new IndexerASTConsumer(getContext(ci)));
+    }
+
+    void beginSourceFile(clang::CompilerInstance &ci) {
+        ci.getDiagnostics().setClient(new clang::IgnoringDiagConsumer);
+        ci.getPreprocessor().addPPCallbacks(
+            std::unique_ptr<clang::PPCallbacks>(
+                new IndexerPPCallbacks(getContext(ci))));
+    }
+
 private:
     IndexerContext &getContext(clang::CompilerInstance &ci) {
         if (m_context == NULL) {
             m_context = new IndexerContext(
                         ci.getSourceManager(),
                         ci.getPreprocessor(),
-                        m_archive);
+                        m_archive,
+                        m_registry);
         }
         return *m_context;
     }
 
+    indexdb::IndexArchiveBuilder &m_archive;
+    IndexedFileRegistry *m_registry;
+    IndexerContext *m_context;
+};
+
+
+///////////////////////////////////////////////////////////////////////////////
+// IndexerAction
+
+class IndexerAction : public clang::ASTFrontendAction {
+public:
+    IndexerAction(
+            indexdb::IndexArchiveBuilder &archive,
+            IndexedFileRegistry *registry) :
+        m_hooks(archive, registry)
+    {
+    }
+
+private:
     virtual std::unique_ptr<clang::ASTConsumer> CreateASTConsumer(
             clang::CompilerInstance &ci,
             llvm::StringRef inFile) {
-        return std::unique_ptr<clang::ASTConsumer>(
-            new IndexerASTConsumer(getContext(ci)));
+        return m_hooks.createASTConsumer(ci);
     }
 
     virtual bool BeginSourceFileAction(clang::CompilerInstance &ci,
                                        llvm::StringRef filename) {
-        ci.getDiagnostics().setClient(new clang::IgnoringDiagConsumer);
-        ci.getPreprocessor().addPPCallbacks(
-            std::unique_ptr<clang::PPCallbacks>(
-                new IndexerPPCallbacks(getContext(ci))));
+        m_hooks.beginSourceFile(ci);
         return true;
     }
 
-    indexdb::IndexArchiveBuilder &m_archive;
-    IndexerContext *m_context;
+    IndexerActionHooks m_hooks;
+};
+
+
+///////////////////////////////////////////////////////////////////////////////
+// PrecompileAction
+
+// Write a PCH file holding the prefix headers (the -include options), and
+// index the prefix headers while they are parsed.  The translation units that
+// load the PCH file do not see the prefix headers' preprocessor events, so
+// their index entries come from this action instead.
+class PrecompileAction : public clang::WrapperFrontendAction {
+public:
+    PrecompileAction(
+            indexdb::IndexArchiveBuilder &archive,
+            const std::string &pchPath) :
+        clang::WrapperFrontendAction(new clang::GeneratePCHAction),
+        m_pchPath(pchPath),
+        m_hooks(archive, NULL)
+    {
+    }
+
+private:
+    virtual bool BeginInvocation(clang::CompilerInstance &ci) {
+        ci.getFrontendOpts().OutputFile = m_pchPath;
+        // The dependency file options belong to the translation unit whose
+        // flags were used.
+        ci.getDependencyOutputOpts().OutputFile.clear();
+        return clang::WrapperFrontendAction::BeginInvocation(ci);
+    }
+
+    virtual std::unique_ptr<clang::ASTConsumer> CreateASTConsumer(
+            clang::CompilerInstance &ci,
+            llvm::StringRef inFile) {
+        std::unique_ptr<clang::ASTConsumer> pchConsumer =
+                clang::WrapperFrontendAction::CreateASTConsumer(ci, inFile);
+        if (!pchConsumer)
+            return std::unique_ptr<clang::ASTConsumer>();
+        std::vector<std::unique_ptr<clang::ASTConsumer> > consumers;
+        consumers.push_back(std::move(pchConsumer));
+        consumers.push_back(m_hooks.createASTConsumer(ci));
+        return std::unique_ptr<clang::ASTConsumer>(
+            new clang::MultiplexConsumer(std::move(consumers)));
+    }
+
+    virtual bool BeginSourceFileAction(clang::CompilerInstance &ci,
+                                       llvm::StringRef filename) {
+        m_hooks.beginSourceFile(ci);
+        return clang::WrapperFrontendAction::BeginSourceFileAction(
+                    ci, filename);
+    }
+
+    const std::string m_pchPath;
+    IndexerActionHooks m_hooks;
 };
 
 
 ///////////////////////////////////////////////////////////////////////////////
 // indexTranslationUnit
 
+static std::string pchInputPath(const std::string &pchPath)
+{
+    return pchPath + ".h";
+}
+
+static std::string pchIndexPath(const std::string &pchPath)
+{
+    return pchPath + ".idx";
+}
+
+// Add the prefix headers' index entries, written when the PCH file was built,
+// to a translation unit's archive.  The archive stays self-contained, so it
+// can be reused and merged like any other.
+static void addPrefixIndex(
+        const std::string &pchPath,
+        indexdb::IndexArchiveBuilder &archive)
+{
+    std::string inputPath;
+    char *realInputPath = portableRealPath(pchInputPath(pchPath).c_str());
+    if (realInputPath != NULL) {
+        inputPath = realInputPath;
+        free(realInputPath);
+    }
+
+    indexdb::IndexArchiveReader prefixArchive(pchIndexPath(pchPath));
+    for (int i = 0; i < prefixArchive.size(); ++i) {
+        const std::string &name = prefixArchive.entry(i).name;
+        if (name == inputPath)
+            continue;
+        indexdb::Index *index = archive.lookup(name);
+        if (index == NULL) {
+            index = new indexdb::Index;
+            archive.insert(name, index);
+        }
+        indexdb::Index *prefixIndex = prefixArchive.openEntry(i);
+        index->merge(*prefixIndex);
+        delete prefixIndex;
+    }
+}
+
+// Returns argv without its -include options, which a PCH file replaces.
+static std::vector<std::string> stripPrefixHeaders(
+        const std::vector<std::string> &argv)
+{
+    std::vector<std::string> ret;
+    for (size_t i = 0; i < argv.size(); ++i) {
+        const std::string &arg = argv[i];
+        if (arg == "-include") {
+            ++i;
+            continue;
+        }
+        if (arg.compare(0, 8, "-include") == 0 && arg != "-include-pch")
+            continue;
+        ret.push_back(arg);
+    }
+    return ret;
+}
+
+// If pchPath is not empty, the translation unit's prefix headers are loaded
+// from that PCH file, which precompilePrefixHeaders wrote, instead of being
+// included again.  If registry is not NULL, the headers found in it are not
+// indexed again, and the others are added to it.  The caller commits the
+// registry once the archive is written.
 void indexTranslationUnit(
         const std::vector<std::string> &argv,
+        const std::string &pchPath,
+        IndexedFileRegistry *registry,
         indexdb::IndexArchiveBuilder &archive)
 {
+    std::vector<std::string> tuArgv = argv;
+    if (!pchPath.empty()) {
+        tuArgv = stripPrefixHeaders(argv);
+        const std::string pchArgs[] = { "-include-pch", pchPath };
+        tuArgv.insert(tuArgv.begin() + 1, &pchArgs[0], &pchArgs[2]);
+    }
+
     llvm::IntrusiveRefCntPtr<clang::FileManager> fm(
         new clang::FileManager(clang::FileSystemOptions()));
-    std::unique_ptr<IndexerAction> action(new IndexerAction(archive));
-    clang::tooling::ToolInvocation ti(argv, action.release(), fm.get());
+    std::unique_ptr<IndexerAction> action(
+                new IndexerAction(archive, registry));
+    clang::tooling::ToolInvocation ti(tuArgv, action.release(), fm.get());
     ti.run();
+    if (!pchPath.empty())
+        addPrefixIndex(pchPath, archive);
+}
+
+// Precompile the -include options of argv, which holds a translation unit's
+// flags without its source file.  The PCH file is parsed from an empty header
+// named after it, whose language is given in argv (e.g. -x c++-header).  The
+// prefix headers' index entries are written next to it.
+bool precompilePrefixHeaders(
+        const std::vector<std::string> &argv,
+        const std::string &pchPath)
+{
+    const std::string inputPath = pchInputPath(pchPath);
+    std::ofstream(inputPath.c_str());
+
+    std::vector<std::string> pchArgv = argv;
+    pchArgv.push_back(inputPath);
+
+    indexdb::IndexArchiveBuilder archive;
+    llvm::IntrusiveRefCntPtr<clang::FileManager> fm(
+        new clang::FileManager(clang::FileSystemOptions()));
+    std::unique_ptr<PrecompileAction> action(
+                new PrecompileAction(archive, pchPath));
+    clang::tooling::ToolInvocation ti(pchArgv, action.release(), fm.get());
+    if (!ti.run())
+        return false;
+    archive.finalize();
+    archive.write(pchIndexPath(pchPath), /*compressed=*/true);
+    return true;
 }
 
 } // namespace indexer
@@ -10,10 +10,18 @@ namespace indexdb {
 
 namespace indexer {
 
+class IndexedFileRegistry;
+
 void indexTranslationUnit(
         const std::vector<std::string> &argv,
+        const std::string &pchPath,
+        IndexedFileRegistry *registry,
         indexdb::IndexArchiveBuilder &archive);
 
+bool precompilePrefixHeaders(
+        const std::vector<std::string> &argv,
+        const std::string &pchPath);
+
 } // namespace indexer
 
 #endif // INDEXER_TUINDEXER_H
@@ -3,9 +3,11 @@
 
 #include <cerrno>
 #include <climits>
+#include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <iostream>
+#include <stdint.h>
 
 #if defined(CXXCODEBROWSER_UNIX)
 #include <sys/types.h>
@@ -13,6 +15,13 @@
 #include <unistd.h>
 #endif
 
+#if defined(__linux__)
+#include <sys/syscall.h>
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#endif
+#endif
+
 #if defined(_WIN32)
 #ifndef NOMINMAX
 #define NOMINMAX 1
@@ -132,4 +141,86 @@ std::string readLine(FILE *fp, bool *isEof)
     return result;
 }
 
+static void writeUInt32(FILE *fp, uint32_t value)
+{
+    unsigned char bytes[4];
+    for (int i = 0; i < 4; ++i)
+        bytes[i] = (value >> (i * 8)) & 0xFF;
+    fwrite(bytes, 1, sizeof(bytes), fp);
+}
+
+static bool readUInt32(FILE *fp, uint32_t &value)
+{
+    unsigned char bytes[4];
+    if (fread(bytes, 1, sizeof(bytes), fp) != sizeof(bytes))
+        return false;
+    value = 0;
+    for (int i = 0; i < 4; ++i)
+        value |= static_cast<uint32_t>(bytes[i]) << (i * 8);
+    return true;
+}
+
+void writeMessage(FILE *fp, const std::vector<std::string> &fields)
+{
+    writeUInt32(fp, fields.size());
+    for (const std::string &field : fields) {
+        writeUInt32(fp, field.size());
+        fwrite(field.data(), 1, field.size(), fp);
+    }
+    fflush(fp);
+}
+
+// Returns false at the end of the stream, or if the message is truncated.
+bool readMessage(FILE *fp, std::vector<std::string> &fields)
+{
+    fields.clear();
+    uint32_t fieldCount;
+    if (!readUInt32(fp, fieldCount))
+        return false;
+    for (uint32_t i = 0; i < fieldCount; ++i) {
+        uint32_t size;
+        if (!readUInt32(fp, size))
+            return false;
+        std::string field(size, '\0');
+        if (size > 0 && fread(&field[0], 1, size, fp) != size)
+            return false;
+        fields.push_back(std::move(field));
+    }
+    return true;
+}
+
+// Rename a file over another one.  On POSIX, the rename replaces the target
+// atomically, so a failure leaves the old file in place.  On failure, returns
+// false with errno set.
+bool renameOverFile(const std::string &from, const std::string &to)
+{
+#if defined(_WIN32)
+    if (MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING))
+        return true;
+    errno = EACCES; // MoveFileEx does not set errno.
+    return false;
+#else
+    return rename(from.c_str(), to.c_str()) == 0;
+#endif
+}
+
+int createMemoryFile(const char *name)
+{
+#if defined(__linux__) && defined(SYS_memfd_create)
+    return EINTR_LOOP(static_cast<int>(
+            syscall(SYS_memfd_create, name, MFD_CLOEXEC)));
+#else
+    return -1;
+#endif
+}
+
+void closeMemoryFile(int fd)
+{
+#if defined(__linux__)
+    close(fd);
+#else
+    (void)fd;
+#endif
+}
+
 } // namespace indexer
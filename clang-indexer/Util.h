@@ -6,6 +6,7 @@
 #include <cstdio>
 #include <ctime>
 #include <string>
+#include <vector>
 
 namespace indexer {
 
@@ -29,6 +30,19 @@ bool stringStartsWith(const std::string &str, const std::string &suffix);
 bool stringEndsWith(const std::string &str, const std::string &suffix);
 std::string readLine(FILE *fp, bool *isEof = NULL);
 
+// A message of the daemon protocol is a field count followed by the fields,
+// each a length followed by its bytes.  The counts and lengths are 32-bit
+// little-endian integers, so a field can hold any bytes.
+void writeMessage(FILE *fp, const std::vector<std::string> &fields);
+bool readMessage(FILE *fp, std::vector<std::string> &fields);
+
+bool renameOverFile(const std::string &from, const std::string &to);
+
+// Create an anonymous file held in memory, and return its descriptor, or -1
+// if the OS does not support it.
+int createMemoryFile(const char *name);
+void closeMemoryFile(int fd);
+
 } // namespace indexer
 
 #endif // INDEXER_UTIL_H
@@ -14,6 +14,7 @@ SOURCES += \
     ASTIndexer.cc \
     DaemonPool.cc \
     IndexBuilder.cc \
+    IndexedFileRegistry.cc \
     IndexerContext.cc \
     IndexerPPCallbacks.cc \
     Mutex.cc \
@@ -27,6 +28,7 @@ HEADERS += \
     ASTIndexer.h \
     DaemonPool.h \
     IndexBuilder.h \
+    IndexedFileRegistry.h \
     IndexerContext.h \
     IndexerPPCallbacks.h \
     Location.h \
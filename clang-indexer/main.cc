@@ -1,6 +1,7 @@
 #include "../shared_headers/host.h"
 
 #include <QCoreApplication>
+#include <QCryptographicHash>
 #include <QDir>
 #include <QFile>
 #include <QFileInfo>
@@ -8,11 +9,15 @@
 #include <QtConcurrentRun>
 #include <QtCore>
 #include <QtDebug>
+#include <algorithm>
 #include <cassert>
+#include <cerrno>
 #include <cstdlib>
 #include <cstring>
+#include <deque>
 #include <fstream>
 #include <iostream>
+#include <map>
 #include <memory>
 #include <sstream>
 #include <string>
@@ -24,15 +29,23 @@
 #include <unistd.h>
 #elif defined(_WIN32)
 #include <direct.h>
+#include <fcntl.h>
+#include <io.h>
 #endif
 
 #include <clang/Tooling/CompilationDatabase.h>
 
+#include "../libindexdb/Arena.h"
 #include "../libindexdb/IndexArchiveBuilder.h"
 #include "../libindexdb/IndexArchiveReader.h"
 #include "../libindexdb/IndexDb.h"
+#include "../libindexdb/IndexMergeCache.h"
+#include "../libindexdb/IndexMerger.h"
+#include "../libindexdb/Parallel.h"
 #include "DaemonPool.h"
+#include "IndexedFileRegistry.h"
 #include "IndexBuilder.h"
+#include "Mutex.h"
 #include "TUIndexer.h"
 #include "Util.h"
 
@@ -45,11 +58,35 @@ namespace indexer {
 // which are at ../lib/clang/<VERSION>/include from the bin directory.
 const char kDriverPath[] = XSTRINGIFY(INDEXER_CLANG_DIR) "/bin/clang";
 
+// The number of temporary index files per thread that may be waiting to be
+// merged.
+const int kTempIndexFilesPerThread = 4;
+
+// The merge cache used by incremental --index-project runs.
+const char kMergeCachePath[] = "index.cache";
+
+// The owner counts and the entry list of an updatable index.
+const char kIndexOwnersPath[] = "index.owners";
+const char kIndexEntriesPath[] = "index.entries";
+
+// The directory holding the precompiled prefix headers while a project is
+// indexed.
+const char kPrefixPCHDirectory[] = "index.pch";
+
+// The directory of the headers already indexed during a run.  See
+// IndexedFileRegistry.
+const char kIndexedFilesDirectory[] = "index.indexed";
+
+// The indexing time and index file size of each translation unit, measured by
+// previous runs.  See IndexScheduler.
+const char kIndexCostsPath[] = "index.costs";
+
 struct SourceFileInfo {
     std::string sourceFilePath;
     std::string workingDirectory;
     std::string indexFilePath;
     std::vector<std::string> clangArgv;
+    std::string pchPath;
 };
 
 static std::vector<SourceFileInfo> readSourcesJson()
@@ -173,18 +210,191 @@ static bool canReuseExistingIndexFile(
     return true;
 }
 
-static std::string indexProjectFile(
+// Translation units whose index files are ready to merge, in the order they
+// finished indexing.  Merging in completion order means that a slow
+// translation unit does not hold up the merging of the ones indexed after it.
+//
+// The queue also bounds the number of temporary index files that exist at
+// once, so the indexers cannot get arbitrarily far ahead of the merge.  A
+// translation unit takes a slot before it is indexed into a temporary file,
+// and the slot is released once the file has been merged and removed.  Any
+// finished file can be merged, so an indexer waiting for a slot always
+// waits on progress that can be made.
+class MergeQueue {
+public:
+    struct Item {
+        std::string sourceFilePath;
+        std::string indexFilePath;
+        bool isTempFile;
+        int memoryFd;   // -1 unless the temporary file is a memory file
+    };
+
+    MergeQueue(size_t itemCount, int tempFileSlots) :
+        m_unpoppedCount(itemCount), m_tempFileSlots(tempFileSlots) {}
+
+    void acquireTempFileSlot() { m_tempFileSlots.acquire(); }
+    void releaseTempFileSlot() { m_tempFileSlots.release(); }
+
+    void push(const Item &item) {
+        QMutexLocker locker(&m_mutex);
+        m_items.push_back(item);
+        m_itemReady.wakeOne();
+    }
+
+    // Wait for the next finished translation unit.  Returns false once every
+    // translation unit has been popped.
+    bool pop(Item &item) {
+        QMutexLocker locker(&m_mutex);
+        if (m_unpoppedCount == 0)
+            return false;
+        m_unpoppedCount--;
+        while (m_items.empty())
+            m_itemReady.wait(&m_mutex);
+        item = m_items.front();
+        m_items.pop_front();
+        return true;
+    }
+
+private:
+    QMutex m_mutex;
+    QWaitCondition m_itemReady;
+    std::deque<Item> m_items;
+    size_t m_unpoppedCount;
+    QSemaphore m_tempFileSlots;
+};
+
+// The cost of indexing a translation unit.
+struct IndexCost {
+    uint64_t millis;
+    uint64_t indexFileSize;
+};
+
+const uint64_t kUnknownCost = static_cast<uint64_t>(-1);
+
+// Hands out the translation units to index, longest expected first, so the
+// largest ones do not start last and lengthen the run.  The expected cost of a
+// translation unit is the one measured by the previous run.  Translation units
+// without a measured cost are handed out first, in their original order.
+class IndexScheduler {
+public:
+    IndexScheduler(const std::vector<SourceFileInfo*> &sourceFiles) :
+        m_sourceFiles(sourceFiles), m_next(0)
+    {
+        readCosts();
+        std::stable_sort(m_sourceFiles.begin(), m_sourceFiles.end(),
+                         [this](SourceFileInfo *x, SourceFileInfo *y) {
+            return expectedCost(x) > expectedCost(y);
+        });
+    }
+
+    // Returns NULL once every translation unit has been handed out.
+    SourceFileInfo *next() {
+        LockGuard<Mutex> lock(m_mutex);
+        if (m_next == m_sourceFiles.size())
+            return NULL;
+        return m_sourceFiles[m_next++];
+    }
+
+    void recordCost(const SourceFileInfo &sfi, const IndexCost &cost) {
+        LockGuard<Mutex> lock(m_mutex);
+        m_costs[sfi.sourceFilePath] = cost;
+    }
+
+    // Write the costs of the project's translation units.  Those that were
+    // not indexed keep their previous costs.
+    void writeCosts(const std::vector<SourceFileInfo> &sourceFiles);
+
+private:
+    void readCosts();
+
+    std::pair<uint64_t, uint64_t> expectedCost(SourceFileInfo *sfi) const {
+        auto it = m_costs.find(sfi->sourceFilePath);
+        if (it == m_costs.end())
+            return std::make_pair(kUnknownCost, kUnknownCost);
+        return std::make_pair(it->second.millis, it->second.indexFileSize);
+    }
+
+    Mutex m_mutex;
+    std::vector<SourceFileInfo*> m_sourceFiles;
+    size_t m_next;
+    std::unordered_map<std::string, IndexCost> m_costs;
+};
+
+// Each line of the cost file holds a translation unit's indexing time in
+// milliseconds, its index file size, and its source path, separated by tabs.
+void IndexScheduler::readCosts()
+{
+    std::ifstream file(kIndexCostsPath);
+    std::string line;
+    while (std::getline(file, line)) {
+        const size_t tab1 = line.find('\t');
+        const size_t tab2 = (tab1 != std::string::npos) ?
+                    line.find('\t', tab1 + 1) : std::string::npos;
+        if (tab2 == std::string::npos)
+            continue;
+        IndexCost cost;
+        cost.millis = strtoull(line.c_str(), NULL, 10);
+        cost.indexFileSize = strtoull(line.c_str() + tab1 + 1, NULL, 10);
+        m_costs[line.substr(tab2 + 1)] = cost;
+    }
+}
+
+void IndexScheduler::writeCosts(const std::vector<SourceFileInfo> &sourceFiles)
+{
+    const std::string tempPath = std::string(kIndexCostsPath) + ".tmp";
+    std::ofstream file(tempPath.c_str());
+    for (const SourceFileInfo &sfi : sourceFiles) {
+        auto it = m_costs.find(sfi.sourceFilePath);
+        if (it == m_costs.end())
+            continue;
+        file << it->second.millis << '\t' << it->second.indexFileSize << '\t'
+             << sfi.sourceFilePath << '\n';
+        m_costs.erase(it);
+    }
+    file.close();
+    if (!file) {
+        QFile::remove(QString::fromStdString(tempPath));
+        return;
+    }
+    QFile::remove(kIndexCostsPath);
+    QFile::rename(QString::fromStdString(tempPath), kIndexCostsPath);
+}
+
+// The options of the translation units' indexing jobs.
+//
+// With sharedMemory, a temporary index file is a memory file, which the daemon
+// writes through its /proc path, and the merge reads without touching the
+// disk.  If memory files are unsupported, a temporary file is used instead.
+//
+// Each daemon finalizes and writes its archive with archiveThreads threads,
+// and hashes its entries with entryHash.
+struct IndexFileOptions {
+    std::string indexedFilesPath;
+    bool sharedMemory;
+    int archiveThreads;
+    indexdb::ArchiveHash entryHash;
+};
+
+static void indexProjectFile(
         DaemonPool *daemonPool,
+        MergeQueue *mergeQueue,
+        IndexScheduler *scheduler,
+        const IndexFileOptions &options,
         SourceFileInfo *sfi)
 {
-    if (sfi->indexFilePath.empty()) {
-        // TODO: In theory, these temporary files could take up an arbitrarily
-        // large amount of disk space, if the indexer were to get ahead of the
-        // merging step.  I'd like to enforce a cap on the number of temp files
-        // existing at a given time, but I'd have to be careful not to cause a
-        // deadlock considering that the merging happens in a deterministic
-        // order, so progress must always be possible on the next file to
-        // merge.  The indexing seems to be much slower than the merging step.
+    const bool isTempFile = sfi->indexFilePath.empty();
+    int memoryFd = -1;
+    if (isTempFile) {
+        mergeQueue->acquireTempFileSlot();
+        if (options.sharedMemory)
+            memoryFd = createMemoryFile("ccb-index");
+    }
+    if (memoryFd != -1) {
+        std::stringstream path;
+        path << "/proc/" << QCoreApplication::applicationPid()
+             << "/fd/" << memoryFd;
+        sfi->indexFilePath = path.str();
+    } else if (isTempFile) {
         QTemporaryFile tempFile;
         tempFile.setAutoRemove(false);
         // TODO: Is this temporary file opened O_CLOEXEC?
@@ -197,16 +407,52 @@ static std::string indexProjectFile(
     std::vector<std::string> args;
     args.push_back("--index-file");
     args.push_back(sfi->indexFilePath);
+    if (!sfi->pchPath.empty()) {
+        args.push_back("--pch");
+        args.push_back(sfi->pchPath);
+    }
+    if (!options.indexedFilesPath.empty()) {
+        args.push_back("--indexed-files");
+        args.push_back(options.indexedFilesPath);
+    }
+    if (options.archiveThreads > 1) {
+        args.push_back("--threads");
+        args.push_back(std::to_string(options.archiveThreads));
+    }
+    if (options.entryHash == indexdb::ArchiveHashSha256)
+        args.push_back("--sha256");
+    else if (options.entryHash == indexdb::ArchiveHashFingerprint)
+        args.push_back("--fingerprint");
     args.push_back("--");
     args.insert(args.end(), sfi->clangArgv.begin(), sfi->clangArgv.end());
+    QElapsedTimer timer;
+    timer.start();
     daemon->run(sfi->workingDirectory, args);
     daemonPool->release(daemon);
-    return sfi->indexFilePath;
+
+    IndexCost cost;
+    cost.millis = timer.elapsed();
+    cost.indexFileSize = QFileInfo(QString::fromStdString(
+                                       sfi->indexFilePath)).size();
+    scheduler->recordCost(*sfi, cost);
+
+    MergeQueue::Item item;
+    item.sourceFilePath = sfi->sourceFilePath;
+    item.indexFilePath = sfi->indexFilePath;
+    item.isTempFile = isTempFile;
+    item.memoryFd = memoryFd;
+    mergeQueue->push(item);
 }
 
-static std::string identityString(std::string str)
+// Each indexing worker drives one daemon at a time.
+static void runIndexWorker(
+        DaemonPool *daemonPool,
+        MergeQueue *mergeQueue,
+        IndexScheduler *scheduler,
+        const IndexFileOptions *options)
 {
-    return str;
+    while (SourceFileInfo *sfi = scheduler->next())
+        indexProjectFile(daemonPool, mergeQueue, scheduler, *options, sfi);
 }
 
 // Strip -include options that try to include precompiled headers.
@@ -286,83 +532,709 @@ void stripPCHIncludes(std::vector<SourceFileInfo> &sourceFiles)
     }
 }
 
-static int indexProject(const std::string &argv0, bool incremental)
+// Translation units with the same flags and prefix headers (-include options)
+// form a group.  The prefix headers of a group with several translation units
+// to index are precompiled once, by one of the daemons, and each translation
+// unit loads them from the PCH file instead of parsing them again.
+struct PrefixHeaderGroup {
+    std::string workingDirectory;
+    std::vector<std::string> pchArgv;
+    std::string pchPath;
+    std::vector<SourceFileInfo*> sourceFiles;
+};
+
+static const char *prefixHeaderLanguage(const SourceFileInfo &sfi)
+{
+    if (stringEndsWith(sfi.sourceFilePath, ".m"))
+        return "objective-c-header";
+    if (stringEndsWith(sfi.sourceFilePath, ".mm"))
+        return "objective-c++-header";
+    if (stringEndsWith(sfi.sourceFilePath, ".c") &&
+            !stringEndsWith(sfi.clangArgv[0], "++"))
+        return "c-header";
+    return "c++-header";
+}
+
+// Returns the flags to precompile a translation unit's prefix headers with:
+// its flags without the source file and the output and dependency file
+// options, which differ between translation units whose prefix headers are
+// otherwise the same.  Returns an empty vector if there are no prefix headers.
+static std::vector<std::string> prefixHeaderArgv(const SourceFileInfo &sfi)
+{
+    const QDir dir(QString::fromStdString(sfi.workingDirectory));
+    std::vector<std::string> ret;
+    bool hasPrefixHeader = false;
+    for (size_t i = 0; i < sfi.clangArgv.size(); ++i) {
+        const std::string &arg = sfi.clangArgv[i];
+        if (arg == "-o" || arg == "-MF" || arg == "-MT" || arg == "-MQ") {
+            ++i;
+            continue;
+        }
+        if (i > 0 && !arg.empty() && arg[0] != '-' &&
+                QFileInfo(dir, QString::fromStdString(arg))
+                    .absoluteFilePath().toStdString() == sfi.sourceFilePath)
+            continue;
+        if (arg == "-include")
+            hasPrefixHeader = true;
+        ret.push_back(arg);
+    }
+    if (!hasPrefixHeader)
+        return std::vector<std::string>();
+    ret.push_back("-x");
+    ret.push_back(prefixHeaderLanguage(sfi));
+    return ret;
+}
+
+static std::vector<PrefixHeaderGroup> groupPrefixHeaders(
+        const std::vector<SourceFileInfo*> &sourceFiles)
+{
+    std::map<std::string, PrefixHeaderGroup> groups;
+    for (SourceFileInfo *sfi : sourceFiles) {
+        std::vector<std::string> pchArgv = prefixHeaderArgv(*sfi);
+        if (pchArgv.empty())
+            continue;
+        std::string key = sfi->workingDirectory;
+        for (const std::string &arg : pchArgv) {
+            key.push_back('\0');
+            key += arg;
+        }
+        PrefixHeaderGroup &group = groups[key];
+        if (group.sourceFiles.empty()) {
+            const QByteArray keyHash = QCryptographicHash::hash(
+                        QByteArray(key.data(), key.size()),
+                        QCryptographicHash::Sha1).toHex();
+            const QDir pchDir(kPrefixPCHDirectory);
+            group.workingDirectory = sfi->workingDirectory;
+            group.pchArgv = std::move(pchArgv);
+            group.pchPath = pchDir.absoluteFilePath(
+                        QString::fromLatin1(keyHash) + ".pch").toStdString();
+        }
+        group.sourceFiles.push_back(sfi);
+    }
+
+    std::vector<PrefixHeaderGroup> ret;
+    for (auto &pair : groups) {
+        if (pair.second.sourceFiles.size() >= 2)
+            ret.push_back(std::move(pair.second));
+    }
+    return ret;
+}
+
+// Precompile a group's prefix headers.  If that fails, its translation units
+// are indexed without a PCH file.
+static void precompilePrefixHeaderGroup(
+        DaemonPool *daemonPool,
+        PrefixHeaderGroup *group)
+{
+    Daemon *daemon = daemonPool->get();
+    std::vector<std::string> args;
+    args.push_back("--precompile");
+    args.push_back(group->pchPath);
+    args.push_back("--");
+    args.insert(args.end(), group->pchArgv.begin(), group->pchArgv.end());
+    const int status = daemon->run(group->workingDirectory, args);
+    daemonPool->release(daemon);
+
+    if (status != 0 ||
+            !QFile::exists(QString::fromStdString(group->pchPath))) {
+        std::cout << "warning: Could not precompile the prefix headers of "
+                  << group->sourceFiles[0]->sourceFilePath << std::endl;
+        return;
+    }
+    for (SourceFileInfo *sfi : group->sourceFiles)
+        sfi->pchPath = group->pchPath;
+}
+
+static void removePrefixHeaderGroups(
+        const std::vector<PrefixHeaderGroup> &groups)
+{
+    for (const PrefixHeaderGroup &group : groups) {
+        const QString pchPath = QString::fromStdString(group.pchPath);
+        QFile::remove(pchPath);
+        QFile::remove(pchPath + ".h");
+        QFile::remove(pchPath + ".idx");
+    }
+    QDir().rmdir(kPrefixPCHDirectory);
+}
+
+// An archive entry found while merging, and where it was found.
+struct ArchiveEntryRef {
+    std::string name;
+    std::string hash;
+    std::string archivePath;
+    int index;
+    bool cached;
+};
+
+// Return the deepest directory containing all of the source files.  Headers
+// outside of it are assumed to belong to the system or to other libraries, and
+// they rarely change.
+static std::string sourceRootDirectory(
+        const std::vector<SourceFileInfo> &sourceFiles)
+{
+    if (sourceFiles.empty())
+        return "";
+    std::string root = sourceFiles[0].sourceFilePath;
+    root.erase(root.rfind('/'));
+    for (const SourceFileInfo &sfi : sourceFiles) {
+        while (!root.empty() &&
+               sfi.sourceFilePath.compare(0, root.size() + 1, root + "/") != 0)
+            root.erase(root.rfind('/'));
+    }
+    return root;
+}
+
+// Whether an archive entry belongs in the merge cache.  Only files outside the
+// source root are cached, because changing any cached file invalidates the
+// whole cache.
+static bool isCacheableEntry(
+        const std::string &sourceRoot,
+        const std::string &name)
+{
+    if (name.empty() || name[0] == '\0' || name[0] == '<')
+        return false;
+    return name.compare(0, sourceRoot.size() + 1, sourceRoot + "/") != 0;
+}
+
+// Merge (or unmerge) archive entries on several threads.  Each archive is
+// opened once.
+static void mergeArchiveEntries(
+        indexdb::IndexMerger &merger,
+        int workerCount,
+        const std::vector<const ArchiveEntryRef*> &entries,
+        bool unmerge=false)
+{
+    std::map<std::string, std::vector<int> > archives;
+    for (const ArchiveEntryRef *entry : entries)
+        archives[entry->archivePath].push_back(entry->index);
+
+    Mutex mutex;
+    auto nextArchive = archives.cbegin();
+    indexdb::runWorkers(workerCount, [&](int worker) {
+        while (true) {
+            std::map<std::string, std::vector<int> >::const_iterator it;
+            {
+                LockGuard<Mutex> lock(mutex);
+                if (nextArchive == archives.cend())
+                    return;
+                it = nextArchive++;
+            }
+            indexdb::IndexArchiveReader archive(it->first);
+            for (int i : it->second) {
+                indexdb::Index *fileIndex = archive.openEntry(i);
+                if (unmerge)
+                    merger.unmerge(*fileIndex, worker);
+                else
+                    merger.merge(*fileIndex, worker);
+                delete fileIndex;
+            }
+        }
+    });
+}
+
+// Exit with an error message if an index file could not be written.  Unlike
+// an assert, the check is kept in release builds, where the run would
+// otherwise succeed with a missing or truncated file.
+static void checkFileWritten(bool success, const char *path)
+{
+    if (success)
+        return;
+    std::cerr << "error: could not write " << path << ": "
+              << strerror(errno) << std::endl;
+    exit(1);
+}
+
+// Replace a file with a newly written one.  The old file is replaced
+// atomically, so it is left in place if the rename fails.
+static void replaceFile(const std::string &tempPath, const char *path)
+{
+    checkFileWritten(renameOverFile(tempPath, path), path);
+}
+
+static std::string hexString(const std::string &data)
+{
+    static const char kHexDigits[] = "0123456789abcdef";
+    std::string ret;
+    for (unsigned char ch : data) {
+        ret.push_back(kHexDigits[ch >> 4]);
+        ret.push_back(kHexDigits[ch & 0xF]);
+    }
+    return ret;
+}
+
+static bool unhexString(const std::string &hex, std::string &data)
+{
+    if (hex.size() % 2 != 0)
+        return false;
+    data.clear();
+    for (size_t i = 0; i < hex.size(); i += 2) {
+        int value = 0;
+        for (size_t j = i; j < i + 2; ++j) {
+            const char ch = hex[j];
+            int digit;
+            if (ch >= '0' && ch <= '9')
+                digit = ch - '0';
+            else if (ch >= 'a' && ch <= 'f')
+                digit = ch - 'a' + 10;
+            else
+                return false;
+            value = value * 16 + digit;
+        }
+        data.push_back(static_cast<char>(value));
+    }
+    return true;
+}
+
+// The entries of an updatable index are listed next to it, along with the
+// archives they were merged from.  Each line holds an entry's hash in hex, its
+// archive's path, and its name, separated by tabs.  The list is keyed by hash.
+static bool readIndexEntries(std::map<std::string, ArchiveEntryRef> &entries)
+{
+    std::ifstream file(kIndexEntriesPath);
+    if (!file)
+        return false;
+    std::string line;
+    while (std::getline(file, line)) {
+        const size_t tab1 = line.find('\t');
+        const size_t tab2 = (tab1 != std::string::npos) ?
+                    line.find('\t', tab1 + 1) : std::string::npos;
+        ArchiveEntryRef entry;
+        if (tab2 == std::string::npos ||
+                !unhexString(line.substr(0, tab1), entry.hash))
+            return false;
+        entry.archivePath = line.substr(tab1 + 1, tab2 - tab1 - 1);
+        entry.name = line.substr(tab2 + 1);
+        entry.index = -1;
+        entry.cached = false;
+        entries[entry.hash] = entry;
+    }
+    return true;
+}
+
+static void writeIndexEntries(
+        const std::string &path,
+        std::vector<ArchiveEntryRef> entries)
+{
+    std::sort(entries.begin(), entries.end(),
+              [](const ArchiveEntryRef &x, const ArchiveEntryRef &y) {
+        return x.hash < y.hash;
+    });
+    std::ofstream file(path.c_str());
+    for (const ArchiveEntryRef &entry : entries) {
+        file << hexString(entry.hash) << '\t' << entry.archivePath << '\t'
+             << entry.name << '\n';
+    }
+    file.close();
+    checkFileWritten(static_cast<bool>(file), path.c_str());
+}
+
+// While an updatable index is updated, a reindexed translation unit's previous
+// archive is kept beside the new one, because the entries that disappear from
+// the archive must be unmerged.  If an update is interrupted, the oldest
+// archive is kept.
+static std::string previousIndexFilePath(const std::string &path)
+{
+    return path + ".prev";
+}
+
+static void keepPreviousIndexFile(const std::string &path)
+{
+    const QString current = QString::fromStdString(path);
+    const QString previous = QString::fromStdString(
+                previousIndexFilePath(path));
+    if (QFile::exists(current) && !QFile::exists(previous))
+        QFile::rename(current, previous);
+}
+
+// Find the base entries to unmerge in their archives.  Returns false if any
+// of them cannot be found.
+static bool findIndexEntries(std::vector<ArchiveEntryRef> &entries)
+{
+    for (ArchiveEntryRef &entry : entries) {
+        const std::string paths[] = {
+            previousIndexFilePath(entry.archivePath),
+            entry.archivePath,
+        };
+        for (const std::string &path : paths) {
+            if (!QFile::exists(QString::fromStdString(path)))
+                continue;
+            indexdb::IndexArchiveReader archive(path);
+            const int index = archive.indexOf(entry.name);
+            if (index >= 0 && archive.entry(index).hash == entry.hash) {
+                entry.archivePath = path;
+                entry.index = index;
+                break;
+            }
+        }
+        if (entry.index < 0)
+            return false;
+    }
+    return true;
+}
+
+// Make sure the non-index tables exist, and declare the index tables.  The
+// tables are usually created when the first source file is merged, but it's
+// possible that no source files exist.
+static void startProjectMerge(indexdb::IndexMerger &merger)
+{
+    indexdb::Index emptyIndex;
+    {
+        IndexBuilder builder(emptyIndex, /*createIndexTables=*/false);
+    }
+    emptyIndex.finalizeTables();
+    merger.merge(emptyIndex);
+    IndexBuilder::addIndexTables(merger);
+}
+
+// Replace the merge cache with one holding the given entries, which were
+// hashed with entryHash.  The cache is written to a temporary name first, so
+// an interrupted write never leaves a truncated cache behind.
+static void writeMergeCache(
+        std::vector<ArchiveEntryRef> &entries,
+        indexdb::ArchiveHash entryHash,
+        uint64_t mergeMemoryBudget,
+        int workerCount)
+{
+    std::sort(entries.begin(), entries.end(),
+              [](const ArchiveEntryRef &x, const ArchiveEntryRef &y) {
+        return x.name < y.name || (x.name == y.name && x.hash < y.hash);
+    });
+    std::vector<indexdb::IndexMergeCache::Key> keys;
+    std::vector<const ArchiveEntryRef*> entryRefs;
+    for (const ArchiveEntryRef &entry : entries) {
+        keys.push_back(indexdb::IndexMergeCache::Key(entry.name, entry.hash));
+        entryRefs.push_back(&entry);
+    }
+
+    indexdb::IndexMerger cacheMerger(mergeMemoryBudget, workerCount);
+    mergeArchiveEntries(cacheMerger, workerCount, entryRefs);
+    const std::string tempPath = std::string(kMergeCachePath) + ".tmp";
+    indexdb::IndexMergeCache::write(tempPath, keys, cacheMerger, entryHash);
+    replaceFile(tempPath, kMergeCachePath);
+}
+
+// The translation units are merged on several threads while they are being
+// indexed, in the order they finish.  The merge holds roughly
+// mergeMemoryBudget bytes of rows in memory and spills the rest to temporary
+// files.  The merged index does not depend on the merge order, because the
+// merger sorts the strings and rows when it writes the index.
+//
+// In incremental mode, the entries for files outside the source root are
+// merged through a cache kept next to the index.  If every cached entry is
+// still in use, the cache's pre-merged index is merged in their place.
+// Otherwise, the entries are merged from their archives, and the cache is
+// rebuilt after the index is written.
+//
+// In updatable mode, the index keeps the owner counts of its strings and rows
+// and the list of its entries.  The next run merges only the entries that are
+// new and unmerges the ones that are gone.  Only the changes are sorted.
+// They are joined with the old index's strings and rows in one linear pass,
+// which still rewrites the whole index.  If a gone entry cannot be found,
+// the index is rebuilt from every archive instead.
+//
+// With precompile, the prefix headers shared by several translation units are
+// precompiled before the translation units are indexed.  With
+// skipIndexedHeaders, a full run records the refs in a header's declarations
+// once for each distinct context (compiler options, macros and everything
+// preceding the header), rather than once for each translation unit.
+// Function bodies, initializers and default arguments are still indexed in
+// every translation unit.  With sharedMemory,
+// the temporary archives of a full run are kept in memory files.
+//
+// The translation units are indexed by jobs daemons, longest expected first,
+// and the costs measured by the run are saved for the next one.
+static int indexProject(
+        const std::string &argv0,
+        bool incremental,
+        bool updatable,
+        bool precompile,
+        bool skipIndexedHeaders,
+        bool sharedMemory,
+        indexdb::ArchiveHash entryHash,
+        int jobs,
+        uint64_t mergeMemoryBudget)
 {
     std::vector<SourceFileInfo> sourceFiles = readSourcesJson();
 
     DaemonPool daemonPool;
-    std::unique_ptr<indexdb::Index> mergedIndex(new indexdb::Index);
-    std::vector<std::pair<std::string, QFuture<std::string> > > futures;
+    const int mergeWorkers = indexdb::workerThreadCount();
+    std::unique_ptr<indexdb::IndexMerger> merger(
+                new indexdb::IndexMerger(mergeMemoryBudget, mergeWorkers));
+    MergeQueue mergeQueue(
+                sourceFiles.size(),
+                kTempIndexFilesPerThread * jobs);
+    std::vector<QFuture<void> > futures;
     std::unordered_map<std::string, time_t> fileTimeCache;
+    std::unique_ptr<indexdb::IndexMergeCache> mergeCache;
+    const std::string sourceRoot = sourceRootDirectory(sourceFiles);
+    std::map<std::string, ArchiveEntryRef> baseEntries;
+    bool update = false;
 
-    {
-        // Make sure the non-index tables exist.  They are usually created when
-        // the first source file is merged, but it's possible that no source
-        // files exist.
-        IndexBuilder builder(*mergedIndex, /*createIndexTables=*/false);
+    if (updatable) {
+        merger->countOwners();
+        update = readIndexEntries(baseEntries) &&
+                merger->setBase("index", kIndexOwnersPath);
+        if (!update)
+            baseEntries.clear();
+    } else if (incremental) {
+        mergeCache.reset(new indexdb::IndexMergeCache(kMergeCachePath));
     }
 
+    startProjectMerge(*merger);
     stripPCHIncludes(sourceFiles);
 
+    std::vector<SourceFileInfo*> pendingSourceFiles;
     for (auto &sfi : sourceFiles) {
         if (!incremental)
             sfi.indexFilePath = "";
         if (canReuseExistingIndexFile(fileTimeCache, sfi)) {
-            // TODO: It's inefficient to run identityString on a separate
-            // thread.
-            QFuture<std::string> future = QtConcurrent::run(
-                        identityString, sfi.indexFilePath);
-            futures.push_back(std::make_pair(sfi.sourceFilePath, future));
+            MergeQueue::Item item;
+            item.sourceFilePath = sfi.sourceFilePath;
+            item.indexFilePath = sfi.indexFilePath;
+            item.isTempFile = false;
+            item.memoryFd = -1;
+            mergeQueue.push(item);
         } else {
-            QFuture<std::string> future = QtConcurrent::run(
-                        indexProjectFile, &daemonPool, &sfi);
-            futures.push_back(std::make_pair(sfi.sourceFilePath, future));
+            if (update)
+                keepPreviousIndexFile(sfi.indexFilePath);
+            pendingSourceFiles.push_back(&sfi);
+        }
+    }
+
+    // Only a full run can share headers between archives.  An incremental
+    // run reuses an archive without the one that indexed its headers.
+    std::string indexedFilesPath;
+    if (skipIndexedHeaders && !incremental) {
+        QDir dir(kIndexedFilesDirectory);
+        if (dir.exists()) {
+            for (const QString &name : dir.entryList(QDir::Files))
+                dir.remove(name);
         }
+        QDir().mkpath(kIndexedFilesDirectory);
+        indexedFilesPath = dir.absolutePath().toStdString();
     }
 
+    std::vector<PrefixHeaderGroup> prefixHeaderGroups;
+    if (precompile) {
+        prefixHeaderGroups = groupPrefixHeaders(pendingSourceFiles);
+        QDir().mkpath(kPrefixPCHDirectory);
+        for (PrefixHeaderGroup &group : prefixHeaderGroups) {
+            futures.push_back(QtConcurrent::run(
+                        precompilePrefixHeaderGroup, &daemonPool, &group));
+        }
+        for (QFuture<void> &future : futures)
+            future.waitForFinished();
+        futures.clear();
+    }
+
+    // The workers spend their time waiting on daemons, so each one needs its
+    // own pool thread.  When there are fewer daemons than CPUs, the daemons
+    // use the spare CPUs to write their archives.
+    IndexFileOptions options;
+    options.indexedFilesPath = indexedFilesPath;
+    options.sharedMemory = sharedMemory;
+    options.archiveThreads = std::max(1, QThread::idealThreadCount() / jobs);
+    options.entryHash = entryHash;
+    IndexScheduler scheduler(pendingSourceFiles);
+    QThreadPool *threadPool = QThreadPool::globalInstance();
+    if (threadPool->maxThreadCount() < jobs)
+        threadPool->setMaxThreadCount(jobs);
+    for (int i = 0; i < jobs; ++i) {
+        futures.push_back(QtConcurrent::run(
+                    runIndexWorker, &daemonPool, &mergeQueue, &scheduler,
+                    &options));
+    }
+
+    // Each merge worker merges the archive entries of finished translation
+    // units.  An entry shared by several translation units (e.g. a header) is
+    // merged only once.  Its hashes match even when the translation units
+    // numbered their strings differently, because finalizeTables numbers an
+    // entry's strings in sorted order.  Entries
+    // already in the base index or in the merge cache are skipped.  The
+    // entries of an updatable index, and the cacheable entries, are
+    // remembered.
+    Mutex mergeMutex;
     std::unordered_set<std::string> mergedEntrySet;
+    std::vector<ArchiveEntryRef> indexEntries;
+    std::vector<ArchiveEntryRef> cacheEntries;
 
-    for (const auto &p : futures) {
-        std::string indexPath = p.second.result();
-        std::cout << "Indexed " << p.first << std::endl;
-        {
-            indexdb::IndexArchiveReader archive(indexPath);
-            for (int i = 0; i < archive.size(); ++i) {
-                if (mergedEntrySet.find(archive.entry(i).hash) !=
-                        mergedEntrySet.end())
-                    continue;
-                mergedEntrySet.insert(archive.entry(i).hash);
-                indexdb::Index *fileIndex = archive.openEntry(i);
-                mergedIndex->merge(*fileIndex);
-                delete fileIndex;
+    indexdb::runWorkers(mergeWorkers, [&](int worker) {
+        MergeQueue::Item item;
+        while (mergeQueue.pop(item)) {
+            {
+                LockGuard<Mutex> lock(mergeMutex);
+                std::cout << "Indexed " << item.sourceFilePath << std::endl;
+            }
+            {
+                indexdb::IndexArchiveReader archive(item.indexFilePath);
+                for (int i = 0; i < archive.size(); ++i) {
+                    const auto &entry = archive.entry(i);
+                    bool cached = false;
+                    {
+                        LockGuard<Mutex> lock(mergeMutex);
+                        if (!mergedEntrySet.insert(entry.hash).second)
+                            continue;
+                        if (updatable) {
+                            indexEntries.push_back(ArchiveEntryRef {
+                                entry.name, entry.hash,
+                                item.indexFilePath, i, false });
+                            if (baseEntries.find(entry.hash) !=
+                                    baseEntries.end())
+                                continue;
+                        }
+                        if (mergeCache) {
+                            cached = mergeCache->contains(entry.name,
+                                                          entry.hash);
+                            if (cached ||
+                                    isCacheableEntry(sourceRoot, entry.name)) {
+                                cacheEntries.push_back(ArchiveEntryRef {
+                                    entry.name, entry.hash,
+                                    item.indexFilePath, i, cached });
+                            }
+                        }
+                    }
+                    if (cached)
+                        continue;
+                    indexdb::Index *fileIndex = archive.openEntry(i);
+                    merger->merge(*fileIndex, worker);
+                    delete fileIndex;
+                }
+            }
+            if (item.memoryFd != -1) {
+                closeMemoryFile(item.memoryFd);
+                mergeQueue.releaseTempFileSlot();
+            } else if (item.isTempFile) {
+                QFile(QString::fromStdString(item.indexFilePath)).remove();
+                mergeQueue.releaseTempFileSlot();
             }
         }
-        if (!incremental)
-            QFile(QString::fromStdString(indexPath)).remove();
+    });
+
+    for (QFuture<void> &future : futures)
+        future.waitForFinished();
+    scheduler.writeCosts(sourceFiles);
+    removePrefixHeaderGroups(prefixHeaderGroups);
+    if (!indexedFilesPath.empty()) {
+        QDir dir(kIndexedFilesDirectory);
+        for (const QString &name : dir.entryList(QDir::Files))
+            dir.remove(name);
+        QDir().rmdir(kIndexedFilesDirectory);
     }
 
-    mergedIndex->finalizeTables();
-    {
-        IndexBuilder locationPopulator(*mergedIndex);
-        locationPopulator.populateIndexTables();
+    if (update) {
+        std::vector<ArchiveEntryRef> goneEntries;
+        for (const auto &pair : baseEntries) {
+            if (mergedEntrySet.find(pair.first) == mergedEntrySet.end())
+                goneEntries.push_back(pair.second);
+        }
+        std::vector<const ArchiveEntryRef*> entryRefs;
+        if (findIndexEntries(goneEntries)) {
+            for (const ArchiveEntryRef &entry : goneEntries)
+                entryRefs.push_back(&entry);
+            mergeArchiveEntries(*merger, mergeWorkers, entryRefs,
+                                /*unmerge=*/true);
+        } else {
+            std::cout << "Rebuilding index: a removed entry was not found"
+                      << std::endl;
+            merger.reset(new indexdb::IndexMerger(mergeMemoryBudget,
+                                                  mergeWorkers));
+            merger->countOwners();
+            startProjectMerge(*merger);
+            for (const ArchiveEntryRef &entry : indexEntries)
+                entryRefs.push_back(&entry);
+            mergeArchiveEntries(*merger, mergeWorkers, entryRefs);
+        }
+    }
+
+    bool rebuildMergeCache = false;
+    if (mergeCache) {
+        std::vector<const ArchiveEntryRef*> cachedEntries;
+        for (const ArchiveEntryRef &entry : cacheEntries) {
+            if (entry.cached)
+                cachedEntries.push_back(&entry);
+        }
+        if (cachedEntries.size() == mergeCache->size()) {
+            std::unique_ptr<indexdb::Index> cachedIndex(mergeCache->open());
+            if (cachedIndex)
+                merger->merge(*cachedIndex);
+        } else {
+            mergeArchiveEntries(*merger, mergeWorkers, cachedEntries);
+            rebuildMergeCache = true;
+        }
+        if (cachedEntries.size() != cacheEntries.size())
+            rebuildMergeCache = true;
+        mergeCache.reset();
+    }
+
+    if (updatable) {
+        // The base index is still mapped, so the new files are written under
+        // temporary names.  The entry list is removed first and replaced
+        // last, so an interrupted update leads to a rebuild.
+        QFile::remove(kIndexEntriesPath);
+        merger->write("index.tmp");
+        merger->writeOwners(std::string(kIndexOwnersPath) + ".tmp");
+        merger.reset();
+        replaceFile("index.tmp", "index");
+        replaceFile(std::string(kIndexOwnersPath) + ".tmp", kIndexOwnersPath);
+        writeIndexEntries(std::string(kIndexEntriesPath) + ".tmp",
+                          indexEntries);
+        replaceFile(std::string(kIndexEntriesPath) + ".tmp",
+                    kIndexEntriesPath);
+        for (const SourceFileInfo &sfi : sourceFiles)
+            QFile::remove(QString::fromStdString(
+                              previousIndexFilePath(sfi.indexFilePath)));
+        for (const auto &pair : baseEntries)
+            QFile::remove(QString::fromStdString(
+                              previousIndexFilePath(pair.second.archivePath)));
+    } else {
+        merger->write("index");
     }
-    mergedIndex->finalizeTables();
-    mergedIndex->write("index");
+
+    if (rebuildMergeCache)
+        writeMergeCache(cacheEntries, entryHash, mergeMemoryBudget,
+                        mergeWorkers);
 
     return 0;
 }
 
 static int indexFile(
         const std::string &outputFile,
+        const std::string &pchPath,
+        const std::string &indexedFilesPath,
+        int threads,
+        indexdb::ArchiveHash entryHash,
         const std::vector<std::string> &clangArgv)
 {
-    indexdb::IndexArchiveBuilder archive;
-    indexTranslationUnit(clangArgv, archive);
-    archive.finalize();
-    archive.write(outputFile, /*compressed=*/true);
+    // The daemon lives across many translation units, so the indexes of one
+    // translation unit are built in an arena, which is freed all at once.
+    // The other daemons use the other CPUs, so each index is finalized and
+    // written on one thread, and only the archive's threads run in parallel.
+    std::unique_ptr<IndexedFileRegistry> registry;
+    if (!indexedFilesPath.empty())
+        registry.reset(new IndexedFileRegistry(indexedFilesPath));
+    {
+        indexdb::Arena arena;
+        indexdb::ArenaScope arenaScope(arena);
+        indexdb::SerialScope serialScope;
+        indexdb::IndexArchiveBuilder archive(entryHash);
+        indexTranslationUnit(clangArgv, pchPath, registry.get(), archive);
+        archive.finalize(threads);
+        archive.write(outputFile, /*compressed=*/true, threads);
+    }
+    if (registry)
+        registry->commit();
     return 0;
 }
 
+static int precompileFile(
+        const std::string &pchPath,
+        const std::vector<std::string> &clangArgv)
+{
+    indexdb::Arena arena;
+    indexdb::ArenaScope arenaScope(arena);
+    return precompilePrefixHeaders(clangArgv, pchPath) ? 0 : 1;
+}
+
 static int runCommand(const std::vector<std::string> &argv)
 {
     const char *const kUsageTextPattern =
@@ -370,19 +1242,71 @@ static int runCommand(const std::vector<std::string> &argv)
             //        0         0         0         0         0         0         0         0
             "Usage: %s\n"
             "\n"
-            "    --index-project [--incremental]\n"
+            "    --index-project [--incremental | --updatable] [--pch]\n"
+            "                    [--skip-indexed-headers] [--shared-memory]\n"
+            "                    [-j N] [--merge-memory MB] [--sha256 | --fingerprint]\n"
             "          Index all of the translation units in the compile_commands.json file\n"
             "          and create a single merged index file named index.\n"
             "\n"
             "          If --incremental is specified, then each translation unit's index is\n"
             "          saved to a separate idx file, which is reused by later --index-project\n"
-            "          invocations if none of its referenced files have changed.\n"
+            "          invocations if none of its referenced files have changed.  Headers\n"
+            "          outside of the source tree are merged once and cached in index.cache\n"
+            "          until one of them changes.\n"
+            "\n"
+            "          --updatable implies --incremental, and it also updates the merged\n"
+            "          index in place.  Only the entries of changed translation units are\n"
+            "          merged or removed.  The number of entries owning each string and row\n"
+            "          is kept in index.owners, and the entries are listed in index.entries.\n"
+            "\n"
+            "          If --pch is specified, then the prefix headers (-include options)\n"
+            "          shared by translation units with the same flags are precompiled once\n"
+            "          into the index.pch directory and loaded by each translation unit.\n"
+            "\n"
+            "          If --skip-indexed-headers is specified without --incremental, then a\n"
+            "          header with an include guard is fully indexed only by the first\n"
+            "          translation unit that reaches it with the same compiler options,\n"
+            "          macros, preceding headers and preceding main file tokens.  The others\n"
+            "          index only its function bodies, initializers, default arguments and\n"
+            "          template instantiations.\n"
+            "\n"
+            "          If --shared-memory is specified without --incremental, then each\n"
+            "          translation unit's index is passed to the merge in a memory file\n"
+            "          rather than a temporary file, where the OS supports it (Linux).\n"
+            "\n"
+            "          The translation units are indexed by N daemon processes (default:\n"
+            "          the number of CPUs), longest first.  The indexing time of each one\n"
+            "          is saved in index.costs and used to order the next run.\n"
+            "\n"
+            "          The translation units are merged without holding the merged tables in\n"
+            "          memory.  About MB megabytes (default: 1024) of table rows are buffered,\n"
+            "          and the rest are sorted in temporary files.\n"
             "\n"
-            "    --index-file index-out-file -- clang-path clang-arguments...\n"
+            "          The translation units' index entries are hashed with MurmurHash3 to\n"
+            "          find identical entries, or with SHA-256 if --sha256 is specified.  If\n"
+            "          --fingerprint is specified, then an entry's strings and rows are\n"
+            "          hashed instead of its bytes, so --incremental also finds the entries\n"
+            "          of idx files written by a version with another index format.  Every\n"
+            "          row of every entry is then decoded to hash it.\n"
+            "\n"
+            "    --index-file index-out-file [--pch pch-file] [--indexed-files dir]\n"
+            "                 [--threads N] [--sha256 | --fingerprint]\n"
+            "                 -- clang-path clang-arguments...\n"
             "          Index a single translation unit.  Write the index to index-out-file.\n"
             "          clang-path must be the full path to a clang or clang++ driver\n"
             "          executable.  (This executable is not invoked, but libclang uses its\n"
-            "          path to locate header files like stdarg.h.)\n";
+            "          path to locate header files like stdarg.h.)  If --pch is specified,\n"
+            "          then the prefix headers are loaded from pch-file, which --precompile\n"
+            "          wrote.  If --indexed-files is specified, then the headers registered\n"
+            "          in dir are not indexed again, and the others are registered.\n"
+            "          The index's entries are finalized and written by N threads (default:\n"
+            "          1), and hashed with SHA-256 if --sha256 is specified, or by their\n"
+            "          content if --fingerprint is specified.\n"
+            "\n"
+            "    --precompile pch-file -- clang-path clang-arguments...\n"
+            "          Precompile the prefix headers (-include options) of clang-arguments,\n"
+            "          which must not name a source file, into pch-file.  Index them into\n"
+            "          pch-file.idx.\n";
 
             // TODO: I suspect it also uses the clang vs clang++ to decide between the C and
             // C++ languages.  Verify whether that's the case, and if so, mention it because
@@ -392,15 +1316,88 @@ static int runCommand(const std::vector<std::string> &argv)
     // TODO: Improve the argument parsing (allow --help anywhere, allow reversing the args)
 
     if (argv.size() >= 2 && argv[1] == "--index-project") {
-        bool incremental = argv.size() >= 3 && argv[2] == "--incremental";
-        return indexProject(argv[0], incremental);
-    } else if (argv.size() >= 6 &&
-               argv[1] == "--index-file" &&
-               argv[3] == "--") {
+        bool incremental = false;
+        bool updatable = false;
+        bool precompile = false;
+        bool skipIndexedHeaders = false;
+        bool sharedMemory = false;
+        indexdb::ArchiveHash entryHash = indexdb::ArchiveHashMurmur3_128;
+        int jobs = std::max(1, QThread::idealThreadCount());
+        uint64_t mergeMemoryBudget = indexdb::kDefaultMergeMemoryBudget;
+        for (size_t i = 2; i < argv.size(); ++i) {
+            if (argv[i] == "--incremental") {
+                incremental = true;
+            } else if (argv[i] == "--updatable") {
+                incremental = true;
+                updatable = true;
+            } else if (argv[i] == "--pch") {
+                precompile = true;
+            } else if (argv[i] == "--skip-indexed-headers") {
+                skipIndexedHeaders = true;
+            } else if (argv[i] == "--shared-memory") {
+                sharedMemory = true;
+            } else if (argv[i] == "--sha256") {
+                entryHash = indexdb::ArchiveHashSha256;
+            } else if (argv[i] == "--fingerprint") {
+                entryHash = indexdb::ArchiveHashFingerprint;
+            } else if (argv[i] == "-j" && i + 1 < argv.size() &&
+                       atoi(argv[i + 1].c_str()) > 0) {
+                jobs = atoi(argv[++i].c_str());
+            } else if (argv[i] == "--merge-memory" && i + 1 < argv.size() &&
+                       atoi(argv[i + 1].c_str()) > 0) {
+                mergeMemoryBudget =
+                        static_cast<uint64_t>(atoi(argv[++i].c_str())) << 20;
+            } else {
+                printf(kUsageTextPattern, argv[0].c_str());
+                return 1;
+            }
+        }
+        return indexProject(argv[0], incremental, updatable, precompile,
+                            skipIndexedHeaders, sharedMemory, entryHash, jobs,
+                            mergeMemoryBudget);
+    } else if (argv.size() >= 3 && argv[1] == "--index-file") {
         std::string outputFile = argv[2];
+        std::string pchPath;
+        std::string indexedFilesPath;
+        int threads = 1;
+        indexdb::ArchiveHash entryHash = indexdb::ArchiveHashMurmur3_128;
+        size_t i = 3;
+        while (i + 1 < argv.size() && argv[i] != "--") {
+            if (argv[i] == "--sha256") {
+                entryHash = indexdb::ArchiveHashSha256;
+                i++;
+                continue;
+            }
+            if (argv[i] == "--fingerprint") {
+                entryHash = indexdb::ArchiveHashFingerprint;
+                i++;
+                continue;
+            }
+            if (argv[i] == "--pch")
+                pchPath = argv[i + 1];
+            else if (argv[i] == "--indexed-files")
+                indexedFilesPath = argv[i + 1];
+            else if (argv[i] == "--threads" && atoi(argv[i + 1].c_str()) > 0)
+                threads = atoi(argv[i + 1].c_str());
+            else
+                break;
+            i += 2;
+        }
+        if (i + 2 < argv.size() && argv[i] == "--") {
+            std::vector<std::string> clangArgv = argv;
+            clangArgv.erase(clangArgv.begin(), clangArgv.begin() + i + 1);
+            return indexFile(outputFile, pchPath, indexedFilesPath, threads,
+                             entryHash, clangArgv);
+        }
+        printf(kUsageTextPattern, argv[0].c_str());
+        return 0;
+    } else if (argv.size() >= 5 &&
+               argv[1] == "--precompile" &&
+               argv[3] == "--") {
+        std::string pchPath = argv[2];
         std::vector<std::string> clangArgv = argv;
         clangArgv.erase(clangArgv.begin(), clangArgv.begin() + 4);
-        return indexFile(outputFile, clangArgv);
+        return precompileFile(pchPath, clangArgv);
     } else {
         printf(kUsageTextPattern, argv[0].c_str());
         return 0;
@@ -408,47 +1405,45 @@ static int runCommand(const std::vector<std::string> &argv)
 }
 
 // Read a series of commands from stdin and run them.  After each command,
-// print a line "DONE <status-code>".  Daemon mode exists mostly to avoid
-// process creation overhead on Windows.
+// reply with a message holding the status code.  Daemon mode exists mostly to
+// avoid process creation overhead on Windows.
 //
-// The input for each command is a series of lines, starting with a working
-// directory line, followed by a line for each argument, followed by a blank
-// line.  The master process kills the daemon by closing the stdin pipe.
-//
-// Example input:
-//
-//     --index-file
-//     /tmp/hello1.idx
-//     --
-//     /tmp/hello1.c
-//     -DFOO=BAR
-//
-//     --index-file
-//     /tmp/hello2.idx
-//     --
-//     /tmp/hello2.c
-//     -DFOO=BAR
+// Each command is a message (see writeMessage) whose first field is the
+// working directory, followed by a field for each argument.  Arguments may
+// contain any bytes, including newlines.  The master process kills the daemon
+// by closing the stdin pipe.
 //
+// The replies are written to a copy of the original stdout, and stdout is
+// redirected to stderr, so output printed by a command cannot corrupt the
+// protocol.
 static int runDaemon(const char *argv0)
 {
-    while (true) {
-        std::string cwd = readLine(stdin);
-        if (cwd.empty())
-            return 0;
-        std::vector<std::string> commandArgv;
-        commandArgv.push_back(argv0);
-        // TODO: What about newlines embedded in arguments?
-        while (true) {
-            std::string line = readLine(stdin);
-            if (line.empty())
-                break;
-            commandArgv.push_back(line);
-        }
-        if (commandArgv.size() <= 1) {
+#if defined(CXXCODEBROWSER_UNIX)
+    FILE *replyFile = fdopen(dup(STDOUT_FILENO), "w");
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+#elif defined(_WIN32)
+    // The messages are binary, and a descriptor's text mode is not cleared
+    // by opening a FILE on it in binary mode.
+    _setmode(_fileno(stdin), _O_BINARY);
+    const int replyFd = _dup(_fileno(stdout));
+    _setmode(replyFd, _O_BINARY);
+    FILE *replyFile = _fdopen(replyFd, "wb");
+    _dup2(_fileno(stderr), _fileno(stdout));
+#endif
+    assert(replyFile != NULL);
+
+    std::vector<std::string> message;
+    while (readMessage(stdin, message)) {
+        if (message.size() <= 1) {
             std::cerr << argv0 << " daemon error: "
                       << "command arguments missing." << std::endl;
             exit(1);
         }
+        const std::string &cwd = message[0];
+        std::vector<std::string> commandArgv;
+        commandArgv.push_back(argv0);
+        commandArgv.insert(commandArgv.end(), message.begin() + 1,
+                           message.end());
         if (chdir(cwd.c_str()) != 0) {
             std::stringstream err;
             err << argv0 << " daemon error: chdir to " << cwd << " failed";
@@ -456,9 +1451,12 @@ static int runDaemon(const char *argv0)
             exit(1);
         }
         int statusCode = runCommand(commandArgv);
-        printf("DONE %d\n", statusCode);
         fflush(stdout);
+        std::vector<std::string> reply;
+        reply.push_back(std::to_string(statusCode));
+        writeMessage(replyFile, reply);
     }
+    return 0;
 }
 
 } // namespace indexer
@@ -16,6 +16,9 @@ OTHER_FILES += \
 ROOT_DIR = ..
 include(../add_dependencies.pri)
 
+# libindexdb uses std::thread.
+unix: LIBS += -pthread
+
 target.path = $$BIN_DIR
 INSTALLS += target
 
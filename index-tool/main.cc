@@ -26,8 +26,9 @@ static void dump(const indexdb::Index &index)
             ++tableIndex) {
         std::string name = index.tableName(tableIndex);
         const indexdb::Table *table = index.table(name);
-        printf("    %-20s  %10d  %10d\n",
-               name.c_str(), table->size(), table->bufferSize());
+        printf("    %-20s  %10d  %10llu\n",
+               name.c_str(), table->size(),
+               static_cast<unsigned long long>(table->bufferSize()));
     }
 }
 
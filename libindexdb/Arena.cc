@@ -0,0 +1,86 @@
+#include "Arena.h"
+
+#include <cassert>
+#include <cstdlib>
+
+namespace indexdb {
+
+// Allocations are aligned for SSE2 loads.
+static const uint64_t kArenaAlign = 16;
+
+// Allocations larger than a quarter of a chunk get a chunk of their own, so
+// that a large buffer does not waste the rest of the current chunk.
+static const uint64_t kArenaChunkSize = 1 << 20;
+
+static thread_local Arena *t_currentArena = NULL;
+
+static inline uint64_t alignSize(uint64_t size)
+{
+    return (size + kArenaAlign - 1) & ~(kArenaAlign - 1);
+}
+
+Arena::Arena() : m_top(NULL), m_end(NULL), m_allocatedSize(0)
+{
+}
+
+Arena::~Arena()
+{
+    for (char *chunk : m_chunks)
+        free(chunk);
+}
+
+void *Arena::allocate(uint64_t size)
+{
+    size = alignSize(size);
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_allocatedSize += size;
+    if (size > kArenaChunkSize / 4) {
+        char *chunk = static_cast<char*>(malloc(size));
+        assert(chunk != NULL);
+        m_chunks.push_back(chunk);
+        return chunk;
+    }
+    if (static_cast<uint64_t>(m_end - m_top) < size) {
+        char *chunk = static_cast<char*>(malloc(kArenaChunkSize));
+        assert(chunk != NULL);
+        m_chunks.push_back(chunk);
+        m_top = chunk;
+        m_end = chunk + kArenaChunkSize;
+    }
+    char *result = m_top;
+    m_top += size;
+    return result;
+}
+
+// Grow the allocation at data in place.  This is only possible for the most
+// recent allocation of the current chunk.
+bool Arena::extend(void *data, uint64_t oldSize, uint64_t newSize)
+{
+    oldSize = alignSize(oldSize);
+    newSize = alignSize(newSize);
+    std::lock_guard<std::mutex> lock(m_mutex);
+    char *const start = static_cast<char*>(data);
+    if (start == NULL || start + oldSize != m_top ||
+            static_cast<uint64_t>(m_end - start) < newSize)
+        return false;
+    m_allocatedSize += newSize - oldSize;
+    m_top = start + newSize;
+    return true;
+}
+
+Arena *Arena::current()
+{
+    return t_currentArena;
+}
+
+ArenaScope::ArenaScope(Arena &arena) : m_previous(t_currentArena)
+{
+    t_currentArena = &arena;
+}
+
+ArenaScope::~ArenaScope()
+{
+    t_currentArena = m_previous;
+}
+
+} // namespace indexdb
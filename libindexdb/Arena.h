@@ -0,0 +1,54 @@
+#ifndef INDEXDB_ARENA_H
+#define INDEXDB_ARENA_H
+
+#include <mutex>
+#include <vector>
+
+#include <stdint.h>
+
+namespace indexdb {
+
+// A bump allocator for the Buffers of short-lived indexes, e.g. those built
+// while indexing one translation unit.  Buffers created on a thread while an
+// ArenaScope is active draw their memory from its arena, and keep using it as
+// they grow.  Nothing is freed until the arena is destroyed, so every such
+// Buffer must be destroyed first.
+//
+// A growing buffer is extended in place if it is the arena's most recent
+// allocation.  Otherwise, its old memory is abandoned, which costs at most
+// about as much memory as the buffer's final size.
+class Arena {
+public:
+    Arena();
+    ~Arena();
+    Arena(const Arena &other) = delete;
+    Arena &operator=(const Arena &other) = delete;
+    void *allocate(uint64_t size);
+    bool extend(void *data, uint64_t oldSize, uint64_t newSize);
+    uint64_t allocatedSize() const { return m_allocatedSize; }
+
+    // The arena of the innermost ArenaScope on this thread, or NULL.
+    static Arena *current();
+
+private:
+    std::mutex m_mutex;
+    std::vector<char*> m_chunks;
+    char *m_top;
+    char *m_end;
+    uint64_t m_allocatedSize;
+};
+
+class ArenaScope {
+public:
+    explicit ArenaScope(Arena &arena);
+    ~ArenaScope();
+    ArenaScope(const ArenaScope &other) = delete;
+    ArenaScope &operator=(const ArenaScope &other) = delete;
+
+private:
+    Arena *m_previous;
+};
+
+} // namespace indexdb
+
+#endif // INDEXDB_ARENA_H
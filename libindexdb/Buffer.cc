@@ -6,15 +6,18 @@
 #include <cstring>
 #include <utility>
 
+#include "Arena.h"
 #include "FileIo.h"
 
 namespace indexdb {
 
-Buffer::Buffer() : m_data(NULL), m_size(0), m_capacity(0), m_isMapped(false)
+Buffer::Buffer() :
+    m_data(NULL), m_size(0), m_capacity(0), m_isMapped(false),
+    m_arena(Arena::current())
 {
 }
 
-Buffer::Buffer(uint32_t size, int fillChar)
+Buffer::Buffer(uint64_t size, int fillChar) : m_arena(Arena::current())
 {
     if (size == 0) {
         m_data = NULL;
@@ -22,7 +25,7 @@ Buffer::Buffer(uint32_t size, int fillChar)
         m_capacity = 0;
         m_isMapped = false;
     } else {
-        m_data = malloc(size);
+        m_data = (m_arena != NULL) ? m_arena->allocate(size) : malloc(size);
         assert(m_data != NULL);
         m_size = size;
         m_capacity = size;
@@ -32,19 +35,19 @@ Buffer::Buffer(uint32_t size, int fillChar)
 }
 
 Buffer::Buffer(Buffer &&other) :
-    m_data(NULL), m_size(0), m_capacity(0), m_isMapped(false)
+    m_data(NULL), m_size(0), m_capacity(0), m_isMapped(false), m_arena(NULL)
 {
     *this = std::move(other);
 }
 
 Buffer &Buffer::operator=(Buffer &&other)
 {
-    if (!m_isMapped)
-        free(m_data);
+    releaseData();
     m_data = other.m_data;
     m_size = other.m_size;
     m_capacity = other.m_capacity;
     m_isMapped = other.m_isMapped;
+    m_arena = other.m_arena;
     other.m_data = NULL;
     other.m_size = 0;
     other.m_capacity = 0;
@@ -52,9 +55,10 @@ Buffer &Buffer::operator=(Buffer &&other)
     return *this;
 }
 
-Buffer Buffer::fromMappedBuffer(void *data, uint32_t size)
+Buffer Buffer::fromMappedBuffer(void *data, uint64_t size)
 {
     Buffer result;
+    result.m_arena = NULL;
     result.m_data = data;
     result.m_size = size;
     result.m_capacity = size;
@@ -64,16 +68,29 @@ Buffer Buffer::fromMappedBuffer(void *data, uint32_t size)
 
 Buffer::~Buffer()
 {
-    if (!m_isMapped)
+    releaseData();
+}
+
+// Arena memory is freed with the arena.
+void Buffer::releaseData()
+{
+    if (!m_isMapped && m_arena == NULL)
         free(m_data);
 }
 
-void Buffer::append(const void *data, uint32_t size)
+void Buffer::append(const void *data, uint64_t size)
 {
     assert(!m_isMapped);
     if (m_size + size > m_capacity) {
-        uint32_t newCapacity = std::max(m_capacity * 2, m_size + size);
-        m_data = realloc(m_data, newCapacity);
+        uint64_t newCapacity = std::max(m_capacity * 2, m_size + size);
+        if (m_arena == NULL) {
+            m_data = realloc(m_data, newCapacity);
+        } else if (!m_arena->extend(m_data, m_capacity, newCapacity)) {
+            void *newData = m_arena->allocate(newCapacity);
+            if (m_size > 0)
+                memcpy(newData, m_data, m_size);
+            m_data = newData;
+        }
         assert(m_data != NULL);
         m_capacity = newCapacity;
     }
@@ -7,27 +7,34 @@
 
 namespace indexdb {
 
+class Arena;
+
+// A Buffer created while an ArenaScope is active keeps its data in the
+// scope's arena.  See Arena.
 class Buffer {
 public:
     Buffer();
-    Buffer(uint32_t size, int fillChar=0);
+    Buffer(uint64_t size, int fillChar=0);
     Buffer(const Buffer &other) = delete;
     Buffer(Buffer &&other);
     Buffer &operator=(const Buffer &other) = delete;
     Buffer &operator=(Buffer &&other);
-    static Buffer fromMappedBuffer(void *data, uint32_t size);
+    static Buffer fromMappedBuffer(void *data, uint64_t size);
     ~Buffer();
-    uint32_t size() const       { return m_size; }
+    uint64_t size() const       { return m_size; }
     void *data()                { return m_data; }
     const void *data() const    { return m_data; }
-    void append(const void *data, uint32_t size);
+    void append(const void *data, uint64_t size);
     bool isMapped() const { return m_isMapped; }
 
 private:
+    void releaseData();
+
     void *m_data;
-    uint32_t m_size;
-    uint32_t m_capacity;
+    uint64_t m_size;
+    uint64_t m_capacity;
     bool m_isMapped;
+    Arena *m_arena;
 };
 
 inline bool operator==(const Buffer &x, const Buffer &y) {
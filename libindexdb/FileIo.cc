@@ -11,11 +11,14 @@
 #include "FileIo.h"
 #include "../shared_headers/host.h"
 
+#include <algorithm>
 #include <cassert>
 #include <cerrno>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <memory>
+#include <utility>
 
 #if defined(CXXCODEBROWSER_UNIX)
 #include <sys/mman.h>
@@ -37,11 +40,24 @@
 
 #include "Buffer.h"
 #include "FileIo64BitSupport.h"
+#include "FramedBuffer.h"
 #include "Util.h"
 #include "WriterSha256Context.h"
 
 namespace indexdb {
 
+// Each buffer is preceded by one of these format bytes.  If kBufferWideSizes
+// is set, the buffer's sizes and offsets are 64-bit.  Otherwise, they are
+// 32-bit, as written by older versions.
+const uint8_t kBufferPlain = 0;
+const uint8_t kBufferCompressed = 1;
+const uint8_t kBufferFramed = 2;
+const uint8_t kBufferWideSizes = 0x80;
+
+// Snappy cannot compress more than 4 GB at once, so larger buffers are split
+// into frames of this size when compressed.
+const uint32_t kLargeBufferFrameSize = 64 * 1024 * 1024;
+
 static size_t mapGranularity()
 {
 #if defined(CXXCODEBROWSER_UNIX)
@@ -57,9 +73,28 @@ static size_t mapGranularity()
 }
 
 
+// Exit with an error message if a read or write of an index file or temporary
+// file failed.  Unlike an assert, the check is kept in release builds, where a
+// short write (e.g. to a full disk) would otherwise leave a truncated index.
+void checkIo(bool success, const char *operation)
+{
+    if (success)
+        return;
+    fprintf(stderr, "indexdb: %s failed: %s\n", operation, strerror(errno));
+    exit(1);
+}
+
+
 ///////////////////////////////////////////////////////////////////////////////
 // Writer
 
+// Construct a Writer that writes to memory instead of a file.  See
+// takeMemory.
+Writer::Writer() :
+    m_sha256(NULL), m_compressed(false), m_fp(NULL), m_writeOffset(0)
+{
+}
+
 Writer::Writer(const std::string &path) : m_sha256(NULL), m_compressed(false)
 {
     const char *pathPtr = path.c_str();
@@ -76,7 +111,8 @@ Writer::Writer(const std::string &path) : m_sha256(NULL), m_compressed(false)
 
 Writer::~Writer()
 {
-    fclose(m_fp);
+    if (m_fp != NULL)
+        checkIo(fclose(m_fp) == 0, "write");
 }
 
 // Write padding bytes until the output is aligned to the given power of 2.
@@ -105,6 +141,15 @@ void Writer::writeUInt32(uint32_t val)
     writeData(&val, sizeof(val));
 }
 
+// 64-bit values are written as two little-endian 32-bit words, low word
+// first.
+void Writer::writeUInt64(uint64_t val)
+{
+    align(sizeof(uint64_t));
+    writeUInt32(static_cast<uint32_t>(val));
+    writeUInt32(static_cast<uint32_t>(val >> 32));
+}
+
 void Writer::writeString(const std::string &string)
 {
     writeUInt32(string.size());
@@ -113,19 +158,30 @@ void Writer::writeString(const std::string &string)
 
 void Writer::writeData(const void *data, size_t count)
 {
-    if (m_sha256 != NULL) {
-        sha256_update(
-                    &m_sha256->ctx,
-                    static_cast<const unsigned char*>(data),
-                    count);
+    if (m_sha256 != NULL)
+        m_sha256->update(data, count);
+    if (m_fp != NULL) {
+        checkIo(fwrite(data, 1, count, m_fp) == count, "write");
+    } else if (m_writeOffset == m_memory.size()) {
+        const char *bytes = static_cast<const char*>(data);
+        m_memory.insert(m_memory.end(), bytes, bytes + count);
+    } else if (count > 0) {
+        if (m_writeOffset + count > m_memory.size())
+            m_memory.resize(m_writeOffset + count);
+        memcpy(&m_memory[m_writeOffset], data, count);
     }
-    fwrite(data, 1, count, m_fp);
     m_writeOffset += count;
 }
 
 void Writer::writeBuffer(const Buffer &buffer)
 {
-    writeUInt8(m_compressed);
+    if (m_compressed && buffer.size() > 0xFFFFFFFFu) {
+        writeFramedBuffer(buffer, kLargeBufferFrameSize);
+        return;
+    }
+
+    writeUInt8((m_compressed ? kBufferCompressed : kBufferPlain) |
+               kBufferWideSizes);
 
     if (m_compressed) {
         size_t maxLength = snappy::MaxCompressedLength(buffer.size());
@@ -135,15 +191,110 @@ void Writer::writeBuffer(const Buffer &buffer)
         snappy::RawCompress(
                     static_cast<const char*>(buffer.data()), buffer.size(),
                     &m_tempCompressionBuffer[0], &length);
-        writeUInt32(length);
+        writeUInt64(length);
         writeData(m_tempCompressionBuffer.data(), length);
     } else {
-        writeUInt32(buffer.size());
+        writeUInt64(buffer.size());
         align(kMaxAlign);
         writeData(buffer.data(), buffer.size());
     }
 }
 
+// Write a buffer that can be read with Reader::readFramedBuffer.  If
+// compression is enabled, each frameSize bytes of the buffer are compressed
+// separately, and the frames are preceded by a table of their offsets.
+// Otherwise, the buffer is written as by writeBuffer.
+void Writer::writeFramedBuffer(const Buffer &buffer, uint32_t frameSize)
+{
+    if (!m_compressed) {
+        writeBuffer(buffer);
+        return;
+    }
+
+    assert(frameSize > 0);
+    const uint64_t frameCount = (buffer.size() + frameSize - 1) / frameSize;
+    std::vector<uint64_t> frameOffsets;
+    std::vector<char> frameData;
+    for (uint64_t i = 0; i < frameCount; ++i) {
+        const uint64_t start = i * frameSize;
+        const size_t size = std::min<uint64_t>(frameSize, buffer.size() - start);
+        size_t length = 0;
+        frameOffsets.push_back(frameData.size());
+        frameData.resize(frameData.size() + snappy::MaxCompressedLength(size));
+        snappy::RawCompress(
+                    static_cast<const char*>(buffer.data()) + start, size,
+                    &frameData[frameOffsets.back()], &length);
+        frameData.resize(frameOffsets.back() + length);
+    }
+    frameOffsets.push_back(frameData.size());
+
+    writeUInt8(kBufferFramed | kBufferWideSizes);
+    writeUInt64(buffer.size());
+    writeUInt32(frameSize);
+    for (uint64_t offset : frameOffsets)
+        writeUInt64(offset);
+    align(kMaxAlign);
+    writeData(frameData.data(), frameData.size());
+}
+
+// Write size bytes read from the current position of source in the same
+// format as writeFramedBuffer(const Buffer&, uint32_t), holding only one
+// frame in memory.  When compressing, the frame offsets are not known until
+// the frames are written, so the offset table is filled in afterwards, which
+// is incompatible with hashing.
+void Writer::writeFramedBuffer(FILE *source, uint64_t size, uint32_t frameSize)
+{
+    assert(frameSize > 0);
+    std::vector<char> frame(frameSize);
+    auto readFrame = [&](uint64_t start) -> size_t {
+        const size_t frameLength = std::min<uint64_t>(frameSize, size - start);
+        checkIo(fread(frame.data(), 1, frameLength, source) == frameLength,
+                "read");
+        return frameLength;
+    };
+
+    if (!m_compressed) {
+        writeUInt8(kBufferPlain | kBufferWideSizes);
+        writeUInt64(size);
+        align(kMaxAlign);
+        for (uint64_t start = 0; start < size; start += frameSize)
+            writeData(frame.data(), readFrame(start));
+        return;
+    }
+
+    assert(m_sha256 == NULL);
+    const uint64_t frameCount = (size + frameSize - 1) / frameSize;
+    std::vector<uint64_t> frameOffsets;
+    writeUInt8(kBufferFramed | kBufferWideSizes);
+    writeUInt64(size);
+    writeUInt32(frameSize);
+    align(sizeof(uint64_t));
+    const uint64_t offsetTable = tell();
+    for (uint64_t i = 0; i <= frameCount; ++i)
+        writeUInt64(0);
+    align(kMaxAlign);
+
+    const uint64_t frameDataStart = tell();
+    for (uint64_t start = 0; start < size; start += frameSize) {
+        const size_t frameLength = readFrame(start);
+        const size_t maxLength = snappy::MaxCompressedLength(frameLength);
+        if (m_tempCompressionBuffer.size() < maxLength)
+            m_tempCompressionBuffer.resize(maxLength);
+        size_t length = 0;
+        snappy::RawCompress(frame.data(), frameLength,
+                            &m_tempCompressionBuffer[0], &length);
+        frameOffsets.push_back(tell() - frameDataStart);
+        writeData(m_tempCompressionBuffer.data(), length);
+    }
+    frameOffsets.push_back(tell() - frameDataStart);
+
+    const uint64_t end = tell();
+    seek(offsetTable);
+    for (uint64_t offset : frameOffsets)
+        writeUInt64(offset);
+    seek(end);
+}
+
 void Writer::writeSignature(const char *signature)
 {
     writeData(signature, strlen(signature));
@@ -156,8 +307,12 @@ uint64_t Writer::tell()
 
 void Writer::seek(uint64_t offset)
 {
-    Seek64(m_fp, offset, SEEK_SET);
-    assert(Tell64(m_fp) == offset);
+    if (m_fp != NULL) {
+        Seek64(m_fp, offset, SEEK_SET);
+        assert(Tell64(m_fp) == offset);
+    } else {
+        assert(offset <= m_memory.size());
+    }
     m_writeOffset = offset;
 }
 
@@ -169,6 +324,14 @@ void Writer::setSha256Hash(WriterSha256Context *sha256)
     m_sha256 = sha256;
 }
 
+// Return the bytes written by a memory Writer, leaving it empty.
+std::vector<char> Writer::takeMemory()
+{
+    assert(m_fp == NULL);
+    m_writeOffset = 0;
+    return std::move(m_memory);
+}
+
 // Enable or disable compression.  Compression is done on a buffer-by-buffer
 // basis, so this flag may be toggled while writing a file.
 void Writer::setCompressed(bool compressed)
@@ -211,6 +374,14 @@ uint32_t Reader::readUInt32()
     return LEToHost32(ret);
 }
 
+uint64_t Reader::readUInt64()
+{
+    align(sizeof(uint64_t));
+    uint64_t ret = readUInt32();
+    ret |= static_cast<uint64_t>(readUInt32()) << 32;
+    return ret;
+}
+
 std::string Reader::readString()
 {
     uint32_t amount = readUInt32();
@@ -219,13 +390,27 @@ std::string Reader::readString()
     return std::string(buf.get(), amount);
 }
 
+uint64_t Reader::readSize(uint8_t format)
+{
+    return (format & kBufferWideSizes) ? readUInt64() : readUInt32();
+}
+
 // The returned Buffer has pointers into the Reader's memory-mapped buffer,
 // so it must be freed before the Reader.
 Buffer Reader::readBuffer()
 {
-    bool isCompressed = readUInt8();
-    if (isCompressed) {
-        size_t compressedLength = readUInt32(); // TODO: Make 64-bit
+    const uint8_t format = readUInt8();
+    if ((format & ~kBufferWideSizes) == kBufferFramed)
+        return readFramedBufferContent(format).flatten();
+    return readBufferContent(format);
+}
+
+Buffer Reader::readBufferContent(uint8_t format)
+{
+    const uint8_t kind = format & ~kBufferWideSizes;
+    assert(kind == kBufferPlain || kind == kBufferCompressed);
+    if (kind == kBufferCompressed) {
+        size_t compressedLength = readSize(format);
         Buffer compressedData = readData(compressedLength);
         size_t length = 0;
         bool success = snappy::GetUncompressedLength(
@@ -241,12 +426,37 @@ Buffer Reader::readBuffer()
         assert(success);
         return std::move(buffer);
     } else {
-        uint32_t size = readUInt32();
+        uint64_t size = readSize(format);
         align(kMaxAlign);
         return readData(size);
     }
 }
 
+// Read a buffer written by Writer::writeFramedBuffer or Writer::writeBuffer.
+// Only a framed buffer's offset table is read up front.  Its frames stay in
+// the Reader's memory until they are decompressed on demand.
+FramedBuffer Reader::readFramedBuffer()
+{
+    const uint8_t format = readUInt8();
+    if ((format & ~kBufferWideSizes) != kBufferFramed)
+        return FramedBuffer(readBufferContent(format));
+    return readFramedBufferContent(format);
+}
+
+FramedBuffer Reader::readFramedBufferContent(uint8_t format)
+{
+    const uint64_t size = readSize(format);
+    const uint32_t frameSize = readUInt32();
+    const uint64_t frameCount = (size + frameSize - 1) / frameSize;
+    std::vector<uint64_t> frameOffsets(frameCount + 1);
+    for (uint64_t &offset : frameOffsets)
+        offset = readSize(format);
+    align(kMaxAlign);
+    Buffer frameData = readData(frameOffsets.back());
+    return FramedBuffer(size, frameSize,
+                        std::move(frameOffsets), std::move(frameData));
+}
+
 void Reader::readSignature(const char *signature)
 {
     size_t len = strlen(signature);
@@ -274,8 +484,10 @@ bool Reader::peekSignature(const char *signature)
 
 // offset need not be page-aligned, but it must be no greater than the file
 // size.  (offset + size) may exceed the file size -- the memory-mapped region
-// is limited to the file size.
-MappedReader::MappedReader(const std::string &path, size_t offset, size_t size)
+// is limited to the file size.  The mapped region must fit in the address
+// space; on a 32-bit host, mapping a larger region exits with an error.
+MappedReader::MappedReader(const std::string &path, uint64_t offset,
+                           uint64_t size)
 {
     // The view offset must be aligned to at least kMaxAlign bytes, because the
     // align method operates upon the offset within the mapped view rather than
@@ -285,7 +497,7 @@ MappedReader::MappedReader(const std::string &path, size_t offset, size_t size)
 
     // XXX: What about a size of 0?
     // XXX: What about an offset equal to the file size?
-    const size_t alignOffset = offset & (mapGranularity() - 1);
+    const uint64_t alignOffset = offset & (mapGranularity() - 1);
     const uint64_t mapOffset = offset - alignOffset;
 
 #if defined(CXXCODEBROWSER_UNIX)
@@ -305,8 +517,15 @@ MappedReader::MappedReader(const std::string &path, size_t offset, size_t size)
 #endif
     assert(offset <= fileSize);
 
-    m_viewSize = std::min<size_t>(size, fileSize - offset);
-    m_mapBufferSize = m_viewSize + alignOffset;
+    const uint64_t viewSize = std::min<uint64_t>(size, fileSize - offset);
+    if (viewSize + alignOffset > static_cast<size_t>(-1)) {
+        fprintf(stderr,
+                "indexdb: cannot map %llu bytes of %s into memory\n",
+                static_cast<unsigned long long>(viewSize), path.c_str());
+        exit(1);
+    }
+    m_viewSize = viewSize;
+    m_mapBufferSize = viewSize + alignOffset;
 
 #if defined(CXXCODEBROWSER_UNIX)
     m_mapBuffer = static_cast<char*>(
@@ -414,8 +633,7 @@ Buffer UnmappedReader::readData(size_t size)
 
 void UnmappedReader::readData(void *output, size_t size)
 {
-    size_t amount = fread(output, 1, size, m_fp);
-    assert(amount == size);
+    checkIo(fread(output, 1, size, m_fp) == size, "read");
     m_offset += size;
 }
 
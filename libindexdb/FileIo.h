@@ -9,8 +9,11 @@
 namespace indexdb {
 
 class Buffer;
+class FramedBuffer;
 const int kMaxAlign = 8;
 
+void checkIo(bool success, const char *operation);
+
 
 ///////////////////////////////////////////////////////////////////////////////
 // Writer
@@ -19,23 +22,29 @@ struct WriterSha256Context;
 
 class Writer {
 public:
+    Writer();
     Writer(const std::string &path);
     ~Writer();
     void align(int multiple);
     void writeUInt8(uint8_t val);
     void writeUInt32(uint32_t val);
+    void writeUInt64(uint64_t val);
     void writeString(const std::string &string);
     void writeData(const void *data, size_t count);
     void writeBuffer(const Buffer &buffer);
+    void writeFramedBuffer(const Buffer &buffer, uint32_t frameSize);
+    void writeFramedBuffer(FILE *source, uint64_t size, uint32_t frameSize);
     void writeSignature(const char *signature);
     uint64_t tell();
     void seek(uint64_t offset);
     void setSha256Hash(WriterSha256Context *sha256);
     void setCompressed(bool compressed);
+    std::vector<char> takeMemory();
 private:
     WriterSha256Context *m_sha256;
     bool m_compressed;
     FILE *m_fp;
+    std::vector<char> m_memory;
     uint64_t m_writeOffset;
     std::vector<char> m_tempCompressionBuffer;
 };
@@ -61,10 +70,17 @@ public:
     void align(int multiple);
     uint8_t readUInt8();
     uint32_t readUInt32();
+    uint64_t readUInt64();
     std::string readString();
     Buffer readBuffer();
+    FramedBuffer readFramedBuffer();
     void readSignature(const char *signature);
     bool peekSignature(const char *signature);
+
+private:
+    uint64_t readSize(uint8_t format);
+    Buffer readBufferContent(uint8_t format);
+    FramedBuffer readFramedBufferContent(uint8_t format);
 };
 
 
@@ -73,7 +89,8 @@ public:
 
 class MappedReader : public Reader {
 public:
-    MappedReader(const std::string &path, size_t offset=0, size_t size=-1);
+    MappedReader(const std::string &path, uint64_t offset=0,
+                 uint64_t size=static_cast<uint64_t>(-1));
     virtual ~MappedReader();
 
     // Implementation of Reader methods.
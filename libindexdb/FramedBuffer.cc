@@ -0,0 +1,197 @@
+#include "FramedBuffer.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+
+#include <snappy.h>
+
+
+namespace indexdb {
+
+// The number of decompressed frames each framed buffer keeps.
+const size_t kFrameCacheCapacity = 32;
+
+
+///////////////////////////////////////////////////////////////////////////////
+// FrameCache
+
+// A least-recently-used cache of decompressed frames.
+class FrameCache {
+public:
+    FramePin find(uint32_t index);
+    FramePin insert(uint32_t index, const FramePin &frame);
+
+private:
+    typedef std::list<std::pair<uint32_t, FramePin> > List;
+    std::mutex m_mutex;
+    List m_frames;  // Most recently used first.
+    std::unordered_map<uint32_t, List::iterator> m_map;
+};
+
+FramePin FrameCache::find(uint32_t index)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_map.find(index);
+    if (it == m_map.end())
+        return FramePin();
+    m_frames.splice(m_frames.begin(), m_frames, it->second);
+    return it->second->second;
+}
+
+// Add a frame to the cache and return the cached frame, which is the
+// existing one if another thread added the frame first.
+FramePin FrameCache::insert(uint32_t index, const FramePin &frame)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_map.find(index);
+    if (it != m_map.end())
+        return it->second->second;
+    m_frames.push_front(std::make_pair(index, frame));
+    m_map[index] = m_frames.begin();
+    if (m_frames.size() > kFrameCacheCapacity) {
+        m_map.erase(m_frames.back().first);
+        m_frames.pop_back();
+    }
+    return frame;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// FramedBuffer
+
+FramedBuffer::FramedBuffer() : m_size(0), m_frameSize(0), m_cache(NULL)
+{
+}
+
+FramedBuffer::FramedBuffer(Buffer &&buffer) :
+    m_size(buffer.size()),
+    m_frameSize(0),
+    m_buffer(std::move(buffer)),
+    m_cache(NULL)
+{
+}
+
+// frameOffsets holds (frameCount + 1) offsets into frameData.  Frame i is
+// compressed in [offset[i], offset[i + 1]).
+FramedBuffer::FramedBuffer(
+        uint64_t size,
+        uint32_t frameSize,
+        std::vector<uint64_t> &&frameOffsets,
+        Buffer &&frameData) :
+    m_size(size),
+    m_frameSize(frameSize),
+    m_frameOffsets(std::move(frameOffsets)),
+    m_frameData(std::move(frameData)),
+    m_cache(new FrameCache)
+{
+    assert(frameSize > 0);
+    assert(frameCount() == (size + frameSize - 1) / frameSize);
+}
+
+FramedBuffer::FramedBuffer(FramedBuffer &&other) : m_cache(NULL)
+{
+    *this = std::move(other);
+}
+
+FramedBuffer &FramedBuffer::operator=(FramedBuffer &&other)
+{
+    delete m_cache;
+    m_size = other.m_size;
+    m_frameSize = other.m_frameSize;
+    m_buffer = std::move(other.m_buffer);
+    m_frameOffsets = std::move(other.m_frameOffsets);
+    m_frameData = std::move(other.m_frameData);
+    m_cache = other.m_cache;
+    other.m_size = 0;
+    other.m_frameSize = 0;
+    other.m_cache = NULL;
+    return *this;
+}
+
+FramedBuffer::~FramedBuffer()
+{
+    delete m_cache;
+}
+
+// A frame that does not decompress to its expected size means the index file
+// is corrupt.  Unlike an assert, the check is kept in release builds.
+static void checkFrame(bool valid, uint32_t index)
+{
+    if (valid)
+        return;
+    fprintf(stderr, "indexdb: corrupt index: frame %u is invalid\n", index);
+    exit(1);
+}
+
+std::shared_ptr<Buffer> FramedBuffer::decompressFrame(uint32_t index) const
+{
+    const uint64_t begin = m_frameOffsets[index];
+    const uint64_t end = m_frameOffsets[index + 1];
+    assert(begin <= end && end <= m_frameData.size());
+    const char *compressed =
+            static_cast<const char*>(m_frameData.data()) + begin;
+    size_t length = 0;
+    checkFrame(snappy::GetUncompressedLength(
+                   compressed, end - begin, &length), index);
+    checkFrame(length == std::min<uint64_t>(
+                   m_frameSize,
+                   m_size - static_cast<uint64_t>(index) * m_frameSize),
+               index);
+    std::shared_ptr<Buffer> frame(new Buffer(length));
+    checkFrame(snappy::RawUncompress(
+                   compressed, end - begin,
+                   static_cast<char*>(frame->data())), index);
+    return frame;
+}
+
+// Return the contents of the buffer as one Buffer.  A framed buffer is
+// decompressed in full, bypassing the cache.
+Buffer FramedBuffer::flatten() const
+{
+    Buffer ret(m_size);
+    if (!isFramed()) {
+        if (m_size > 0)
+            memcpy(ret.data(), m_buffer.data(), m_size);
+        return ret;
+    }
+    for (uint32_t i = 0; i < frameCount(); ++i) {
+        std::shared_ptr<Buffer> frame = decompressFrame(i);
+        memcpy(static_cast<char*>(ret.data()) +
+                    static_cast<uint64_t>(i) * m_frameSize,
+               frame->data(), frame->size());
+    }
+    return ret;
+}
+
+// Return a pointer to the start of the frame containing the given offset.
+// The frame covers [frameStart, frameEnd), and it stays valid as long as the
+// pin (and the FramedBuffer) is alive.  An unframed buffer is a single frame.
+const char *FramedBuffer::frame(
+        uint64_t offset,
+        uint64_t &frameStart,
+        uint64_t &frameEnd,
+        FramePin &pin) const
+{
+    assert(offset < m_size);
+    if (!isFramed()) {
+        frameStart = 0;
+        frameEnd = m_size;
+        pin.reset();
+        return static_cast<const char*>(m_buffer.data());
+    }
+    const uint32_t index = offset / m_frameSize;
+    pin = m_cache->find(index);
+    if (pin == NULL)
+        pin = m_cache->insert(index, decompressFrame(index));
+    frameStart = static_cast<uint64_t>(index) * m_frameSize;
+    frameEnd = frameStart + pin->size();
+    return static_cast<const char*>(pin->data());
+}
+
+} // namespace indexdb
@@ -0,0 +1,60 @@
+#ifndef INDEXDB_FRAMEDBUFFER_H
+#define INDEXDB_FRAMEDBUFFER_H
+
+#include <cassert>
+#include <memory>
+#include <stdint.h>
+#include <vector>
+
+#include "Buffer.h"
+
+namespace indexdb {
+
+class FrameCache;
+
+// Keeps a decompressed frame alive while it is in use, even if the frame
+// cache evicts it.
+typedef std::shared_ptr<const Buffer> FramePin;
+
+// A read-only buffer that is either stored whole or split into frames of
+// frameSize bytes that are compressed independently.  A framed buffer
+// decompresses only the frames that are read, and it keeps the most recently
+// used frames in a bounded cache.
+class FramedBuffer {
+public:
+    FramedBuffer();
+    explicit FramedBuffer(Buffer &&buffer);
+    FramedBuffer(uint64_t size, uint32_t frameSize,
+                 std::vector<uint64_t> &&frameOffsets, Buffer &&frameData);
+    FramedBuffer(FramedBuffer &&other);
+    FramedBuffer &operator=(FramedBuffer &&other);
+    ~FramedBuffer();
+
+    uint64_t size() const { return m_size; }
+    bool isFramed() const { return m_cache != NULL; }
+
+    // The whole buffer.  Only valid if the buffer is not framed.
+    const Buffer &buffer() const {
+        assert(!isFramed());
+        return m_buffer;
+    }
+
+    Buffer flatten() const;
+    const char *frame(uint64_t offset, uint64_t &frameStart,
+                      uint64_t &frameEnd, FramePin &pin) const;
+
+private:
+    uint32_t frameCount() const { return m_frameOffsets.size() - 1; }
+    std::shared_ptr<Buffer> decompressFrame(uint32_t index) const;
+
+    uint64_t m_size;
+    uint32_t m_frameSize;
+    Buffer m_buffer;
+    std::vector<uint64_t> m_frameOffsets;
+    Buffer m_frameData;
+    FrameCache *m_cache;
+};
+
+} // namespace indexdb
+
+#endif // INDEXDB_FRAMEDBUFFER_H
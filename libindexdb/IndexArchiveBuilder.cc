@@ -1,15 +1,85 @@
 #include "IndexArchiveBuilder.h"
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <climits>
+#include <functional>
+#include <memory>
+#include <vector>
 
+#include <MurmurHash3.h>
 #include <sha2.h>
 
+#include "Arena.h"
 #include "FileIo.h"
 #include "IndexDb.h"
+#include "IndexFingerprint.h"
+#include "Parallel.h"
 #include "WriterSha256Context.h"
 
 namespace indexdb {
 
+// Call func(i) for each i in [0, count) on up to workers threads.  The threads
+// use the caller's arena, if any, and the parallel work inside func runs on
+// one thread, since the calls are already spread across threads.
+static void forEachEntry(
+        size_t count,
+        int workers,
+        const std::function<void(size_t)> &func)
+{
+    Arena *const arena = Arena::current();
+    std::atomic<size_t> next(0);
+    workers = std::max<size_t>(1, std::min<size_t>(workers, count));
+    runWorkers(workers, [&](int worker) {
+        std::unique_ptr<ArenaScope> arenaScope;
+        if (arena != NULL)
+            arenaScope.reset(new ArenaScope(*arena));
+        SerialScope serialScope;
+        for (size_t i = next++; i < count; i = next++)
+            func(i);
+    });
+}
+
+// Hash an entry's bytes with the given algorithm.
+static std::string archiveEntryHash(
+        ArchiveHash hash,
+        const char *data,
+        uint64_t size)
+{
+    if (hash == ArchiveHashSha256) {
+        WriterSha256Context hashContext;
+        sha256_init(&hashContext.ctx);
+        hashContext.update(data, size);
+        unsigned char digest[256 / 8];
+        sha256_final(&hashContext.ctx, digest);
+        return std::string(reinterpret_cast<char*>(digest), sizeof(digest));
+    }
+    assert(hash == ArchiveHashMurmur3_128 && "Unknown archive hash");
+    uint64_t digest[2];
+    if (size <= INT_MAX) {
+        MurmurHash3_x64_128(data, static_cast<int>(size), 0, digest);
+        return std::string(reinterpret_cast<char*>(digest), sizeof(digest));
+    }
+
+    // MurmurHash3 takes an int length, so a larger entry is hashed in chunks,
+    // and the hash is the hash of the chunks' hashes.
+    std::vector<uint64_t> chunkDigests;
+    for (uint64_t offset = 0; offset < size; offset += INT_MAX) {
+        const int length = std::min<uint64_t>(INT_MAX, size - offset);
+        MurmurHash3_x64_128(data + offset, length, 0, digest);
+        chunkDigests.push_back(digest[0]);
+        chunkDigests.push_back(digest[1]);
+    }
+    MurmurHash3_x64_128(chunkDigests.data(),
+                        chunkDigests.size() * sizeof(uint64_t), 0, digest);
+    return std::string(reinterpret_cast<char*>(digest), sizeof(digest));
+}
+
+IndexArchiveBuilder::IndexArchiveBuilder(ArchiveHash hash) : m_hash(hash)
+{
+}
+
 IndexArchiveBuilder::~IndexArchiveBuilder()
 {
     for (const auto &pair : m_indices)
@@ -28,20 +98,46 @@ Index *IndexArchiveBuilder::lookup(const std::string &entryName)
     return (it != m_indices.end()) ? it->second : NULL;
 }
 
-void IndexArchiveBuilder::finalize()
+// With several workers, the entries are finalized concurrently.  With one,
+// each entry is finalized on the calling thread alone.
+void IndexArchiveBuilder::finalize(int workers)
 {
+    if (workers <= 1) {
+        SerialScope serialScope;
+        for (const auto &pair : m_indices)
+            pair.second->finalizeTables();
+        return;
+    }
+    std::vector<Index*> indices;
     for (const auto &pair : m_indices)
-        pair.second->finalizeTables();
+        indices.push_back(pair.second);
+    forEachEntry(indices.size(), workers, [&](size_t i) {
+        indices[i]->finalizeTables();
+    });
 }
 
-void IndexArchiveBuilder::write(const std::string &path, bool compressed)
+// A SHA-256 archive is hashed while it is written, unless there are several
+// workers.  Otherwise, see writeBuffered.  The output is the same either way.
+void IndexArchiveBuilder::write(
+        const std::string &path,
+        bool compressed,
+        int workers)
 {
+    if (m_hash != ArchiveHashSha256 || (workers > 1 && m_indices.size() > 1)) {
+        writeBuffered(path, compressed, workers);
+        return;
+    }
+
+    SerialScope serialScope;
+
     const int kHashByteSize = 256 / 8;
     std::string zeroHash;
     zeroHash.resize(kHashByteSize);
 
     Writer writer(path);
     writer.writeSignature(kIndexArchiveSignature);
+    writer.writeUInt32(kIndexVersionFlag | kIndexArchiveVersion);
+    writer.writeUInt32(m_hash);
     writer.writeUInt32(m_indices.size());
     writer.setCompressed(compressed);
 
@@ -54,8 +150,8 @@ void IndexArchiveBuilder::write(const std::string &path, bool compressed)
     for (const auto &pair : m_indices) {
         writer.writeString(pair.first);
         writer.writeString(zeroHash);
-        writer.writeUInt32(0); // Entry offset
-        writer.writeUInt32(0); // Entry length
+        writer.writeUInt64(0); // Entry offset
+        writer.writeUInt64(0); // Entry length
     }
 
     unsigned char hashDigest[kHashByteSize];
@@ -87,10 +183,80 @@ void IndexArchiveBuilder::write(const std::string &path, bool compressed)
     for (const auto &pair : m_indices) {
         writer.writeString(pair.first);
         writer.writeString(entryHashes[index]);
-        writer.writeUInt32(entryOffsets[index]);
-        writer.writeUInt32(entryLengths[index]);
+        writer.writeUInt64(entryOffsets[index]);
+        writer.writeUInt64(entryLengths[index]);
         index++;
     }
 }
 
+// Serialize, compress and hash the entries into memory, concurrently with
+// several workers, then
+// write the archive in a single forward pass.  An entry starts at an offset
+// aligned to kMaxAlign, the largest alignment used within it, so its bytes do
+// not depend on where it is written.  The table-of-contents has the same size
+// whatever its offsets are, so the entries' offsets are computed from a copy
+// of it written with zero offsets.
+void IndexArchiveBuilder::writeBuffered(
+        const std::string &path,
+        bool compressed,
+        int workers)
+{
+    std::vector<const std::string*> entryNames;
+    std::vector<Index*> indices;
+    for (const auto &pair : m_indices) {
+        entryNames.push_back(&pair.first);
+        indices.push_back(pair.second);
+    }
+
+    std::vector<std::vector<char> > entryData(indices.size());
+    std::vector<std::string> entryHashes(indices.size());
+    forEachEntry(indices.size(), workers, [&](size_t i) {
+        Writer entryWriter;
+        entryWriter.setCompressed(compressed);
+        indices[i]->write(entryWriter);
+        entryData[i] = entryWriter.takeMemory();
+        if (m_hash == ArchiveHashFingerprint)
+            entryHashes[i] = indexFingerprint(*indices[i]);
+        else
+            entryHashes[i] = archiveEntryHash(m_hash, entryData[i].data(),
+                                              entryData[i].size());
+    });
+
+    auto writeHeader = [&](Writer &writer,
+                           const std::vector<uint64_t> &entryOffsets) {
+        writer.writeSignature(kIndexArchiveSignature);
+        writer.writeUInt32(kIndexVersionFlag | kIndexArchiveVersion);
+        writer.writeUInt32(m_hash);
+        writer.writeUInt32(indices.size());
+        for (size_t i = 0; i < indices.size(); ++i) {
+            writer.writeString(*entryNames[i]);
+            writer.writeString(entryHashes[i]);
+            writer.writeUInt64(entryOffsets.empty() ? 0 : entryOffsets[i]);
+            writer.writeUInt64(entryOffsets.empty() ? 0 :
+                               entryData[i].size());
+        }
+    };
+
+    std::vector<uint64_t> entryOffsets;
+    {
+        Writer sizingWriter;
+        writeHeader(sizingWriter, entryOffsets);
+        uint64_t offset = sizingWriter.tell();
+        for (const std::vector<char> &data : entryData) {
+            offset = (offset + kMaxAlign - 1) & ~static_cast<uint64_t>(
+                        kMaxAlign - 1);
+            entryOffsets.push_back(offset);
+            offset += data.size();
+        }
+    }
+
+    Writer writer(path);
+    writeHeader(writer, entryOffsets);
+    for (size_t i = 0; i < entryData.size(); ++i) {
+        writer.align(kMaxAlign);
+        assert(writer.tell() == entryOffsets[i]);
+        writer.writeData(entryData[i].data(), entryData[i].size());
+    }
+}
+
 } // namespace indexdb
@@ -4,20 +4,24 @@
 #include <map>
 #include <string>
 
-namespace indexdb {
+#include "IndexDb.h"
 
-class Index;
+namespace indexdb {
 
 class IndexArchiveBuilder
 {
 public:
+    explicit IndexArchiveBuilder(ArchiveHash hash=ArchiveHashMurmur3_128);
     ~IndexArchiveBuilder();
     void insert(const std::string &entryName, Index *index);
     Index *lookup(const std::string &entryName);
-    void finalize();
-    void write(const std::string &path, bool compressed=false);
+    void finalize(int workers=1);
+    void write(const std::string &path, bool compressed=false, int workers=1);
 
 private:
+    void writeBuffered(const std::string &path, bool compressed, int workers);
+
+    ArchiveHash m_hash;
     std::map<std::string, Index*> m_indices;
 };
 
@@ -1,21 +1,56 @@
 #include "IndexArchiveReader.h"
 
+#include <cstdio>
+#include <cstdlib>
+
 #include "FileIo.h"
 #include "IndexDb.h"
 
 namespace indexdb {
 
+// Exit with an error message if the archive has a version or entry hash this
+// reader does not understand.  Unlike an assert, the check is kept in release
+// builds, where the entries would otherwise be misread or their hashes
+// compared against the wrong algorithm.
+static void checkArchiveFormat(bool valid, const std::string &path,
+                               const char *what, uint32_t value)
+{
+    if (valid)
+        return;
+    fprintf(stderr, "indexdb: %s: unsupported index archive %s %u\n",
+            path.c_str(), what, value);
+    exit(1);
+}
+
 IndexArchiveReader::IndexArchiveReader(const std::string &path) : m_path(path)
 {
     UnmappedReader reader(path);
     reader.readSignature(kIndexArchiveSignature);
+    uint32_t version = 0;
     uint32_t entryCount = reader.readUInt32();
+    m_hash = ArchiveHashSha256;
+    if (entryCount & kIndexVersionFlag) {
+        version = entryCount & ~kIndexVersionFlag;
+        checkArchiveFormat(version <= kIndexArchiveVersion,
+                           path, "version", version);
+        if (version >= kIndexArchiveVersionHashTag) {
+            const uint32_t hash = reader.readUInt32();
+            checkArchiveFormat(hash < ArchiveHashMax, path, "hash", hash);
+            m_hash = static_cast<ArchiveHash>(hash);
+        }
+        entryCount = reader.readUInt32();
+    }
     for (uint32_t i = 0; i < entryCount; ++i) {
         Entry *entry = new Entry;
         entry->name = reader.readString();
         entry->hash = reader.readString();
-        entry->fileOffset = reader.readUInt32(); // TODO: use 64-bit
-        entry->fileLength = reader.readUInt32(); // TODO: use 64-bit
+        if (version >= kIndexArchiveVersionWideSizes) {
+            entry->fileOffset = reader.readUInt64();
+            entry->fileLength = reader.readUInt64();
+        } else {
+            entry->fileOffset = reader.readUInt32();
+            entry->fileLength = reader.readUInt32();
+        }
         m_entryMap[entry->name] = m_entries.size();
         m_entries.push_back(entry);
     }
@@ -6,17 +6,17 @@
 #include <string>
 #include <vector>
 
-namespace indexdb {
+#include "IndexDb.h"
 
-class Index;
+namespace indexdb {
 
 // An index archive is a file containing a series of indexes.
 //
 // Its intended application is to speed up merging of indices for C/C++
 // translation units.  Each source file in a translation unit is placed into a
 // separate index within a single index archive file.  Each index is hashed
-// using something like MD5/SHA.  When merging index archives, an entry can be
-// skipped if a previous entry with the same hash was already merged.  The
+// using the archive's ArchiveHash.  When merging index archives, an entry can
+// be skipped if a previous entry with the same hash was already merged.  The
 // expectation is that entries for header files will typically be identical
 // between translation units.
 class IndexArchiveReader
@@ -32,12 +32,14 @@ public:
     IndexArchiveReader(const std::string &path);
     ~IndexArchiveReader();
     int size();
+    ArchiveHash hash() const { return m_hash; }
     const Entry &entry(int index);
     int indexOf(const std::string &entryName);
     Index *openEntry(int index);
 
 private:
     std::string m_path;
+    ArchiveHash m_hash;
     std::vector<Entry*> m_entries;
     std::map<std::string, int> m_entryMap;
 };
@@ -1,13 +1,18 @@
 #include "IndexDb.h"
 
 #include <algorithm>
+#include <cstdio>
+#include <cstdlib>
 #include <functional>
 #include <iostream>
+#include <mutex>
 #include <vector>
 
 #include <MurmurHash3.h>
 
 #include "FileIo.h"
+#include "Parallel.h"
+#include "RowEncoding.h"
 #include "Util.h"
 
 namespace indexdb {
@@ -16,67 +21,29 @@ namespace indexdb {
 ///////////////////////////////////////////////////////////////////////////////
 // Row
 
-static inline uint32_t readVleUInt32(const char *&buffer)
-{
-    uint32_t result = 0;
-    unsigned char nibble;
-    int bit = 0;
-    do {
-        nibble = static_cast<unsigned char>(*(buffer++));
-        result |= (nibble & 0x7F) << bit;
-        bit += 7;
-    } while ((nibble & 0x80) == 0x80);
-    return result;
-}
-
-// This encoding of a uint32 is guaranteed not to contain NUL bytes unless the
-// value is zero.
-static inline void writeVleUInt32(char *&buffer, uint32_t value)
-{
-    do {
-        unsigned char nibble = value & 0x7F;
-        value >>= 7;
-        if (value != 0)
-            nibble |= 0x80;
-        *buffer++ = nibble;
-    } while (value != 0);
-}
-
-// Maximum number of bytes used by an encoded row of a given number of columns.
-// This return value does not include the NUL terminator.
-static inline size_t maxEncodedRowSize(int columnCount)
-{
-    return columnCount * 5;
-}
-
-static inline void encodeRow(const ID *input, int columnCount, char *output)
+static inline void decodeRow(Row &output, const char *input)
 {
-    for (int i = 0; i < columnCount; ++i) {
-        uint32_t temp = input[i] + 1;
-        assert(temp != 0);
-        writeVleUInt32(output, temp);
-    }
-    *output++ = '\0';
+    decodeRow(&output[0], output.count(), input);
 }
 
-static inline void decodeRow(ID *output, int columnCount, const char *input)
+// Compare the first row.count() values against the given row.
+static inline int comparePrefix(const ID *values, const Row &row)
 {
-    const char *pinput = input;
-    for (int i = 0; i < columnCount; ++i) {
-        uint32_t temp = readVleUInt32(pinput);
-        assert(temp != 0);
-        output[i] = temp - 1;
+    for (int column = 0; column < row.count(); ++column) {
+        if (values[column] < row[column])
+            return -1;
+        else if (values[column] > row[column])
+            return 1;
     }
+    return 0;
 }
 
-static inline void encodeRow(const Row &input, char *output)
-{
-    return encodeRow(&input[0], input.count(), output);
-}
-
-static inline void decodeRow(Row &output, const char *input)
+// Returns true if the values come before the lower bound (or upper bound) for
+// the given row.  A row is within the upper bound if its prefix is equal.
+static inline bool precedesBound(const ID *values, const Row &row, bool upper)
 {
-    return decodeRow(&output[0], output.count(), input);
+    const int cmp = comparePrefix(values, row);
+    return upper ? cmp <= 0 : cmp < 0;
 }
 
 void Row::resize(int count)
@@ -94,35 +61,187 @@ void Row::resize(int count)
 ///////////////////////////////////////////////////////////////////////////////
 // TableIterator
 
+// The offset must be the end of the table or the start of a row that can be
+// decoded on its own (i.e. a block start, or any row in the legacy layout).
+TableIterator::TableIterator(const Table *table, uint64_t offset) :
+    m_table(table), m_offset(offset), m_nextOffset(0),
+    m_frame(NULL), m_frameStart(0), m_frameEnd(0)
+{
+    if (m_offset != m_table->rowsEnd()) {
+        assert(!m_table->m_blockLayout || Table::isBlockStart(m_offset));
+        clearRow();
+        decode();
+    }
+}
+
+// Return a pointer to the byte at the given offset in the table's rows.  The
+// bytes are contiguous up to the end of the offset's frame.  A row never
+// straddles two frames.
+inline const char *TableIterator::dataAt(uint64_t offset)
+{
+    if (offset < m_frameStart || offset >= m_frameEnd) {
+        m_frame = m_table->m_stringSetBuffer.frame(
+                    offset, m_frameStart, m_frameEnd, m_framePin);
+    }
+    return m_frame + (offset - m_frameStart);
+}
+
+void TableIterator::decode()
+{
+    const char *row = dataAt(m_offset);
+    const char *next;
+    if (m_table->m_blockLayout) {
+        next = decodeDeltaRow(m_row, m_table->columnCount(), row);
+    } else {
+        next = decodeRow(m_row, m_table->columnCount(), row);
+    }
+    m_nextOffset = m_offset + (next - row);
+}
+
 void TableIterator::value(Row &row)
 {
-    decodeRow(row, m_string);
+    assert(m_offset != m_table->rowsEnd());
+    assert(row.count() <= m_table->columnCount());
+    memcpy(&row[0], m_row, row.count() * sizeof(ID));
+}
+
+TableIterator &TableIterator::operator++()
+{
+    assert(m_offset != m_table->rowsEnd());
+    m_offset = m_nextOffset;
+    if (m_offset == m_table->rowsEnd())
+        return *this;
+    if (m_table->m_blockLayout) {
+        // Rows never start with a NUL, so a NUL here is padding at the end of
+        // a block.
+        if (*dataAt(m_offset) == '\0') {
+            m_offset = m_table->nextBlockStart(m_offset);
+            if (m_offset == m_table->rowsEnd())
+                return *this;
+        }
+        if (Table::isBlockStart(m_offset))
+            clearRow();
+    }
+    decode();
+    return *this;
 }
 
 TableIterator &TableIterator::operator--()
 {
-    const char *start = m_table->begin().m_string;
-    assert(m_string - start >= 2);
-    assert(m_string[-1] == '\0');
-    m_string -= 2;
+    const uint64_t start = m_table->rowsBegin();
+    assert(m_offset > start);
+    assert(*dataAt(m_offset - 1) == '\0');
+
+    // Step back over the previous row's NUL terminator and any block padding
+    // to reach the last byte of the previous row.
+    uint64_t target = m_offset - 1;
+    while (*dataAt(target) == '\0') {
+        assert(target > start);
+        target--;
+    }
+
+    // Then find the start of that row.  In the block layout, the byte before
+    // a block is always NUL, and in the legacy layout, the buffer starts with
+    // a NUL.
+    while (target > start && *dataAt(target - 1) != '\0')
+        target--;
+
+    if (!m_table->m_blockLayout) {
+        m_offset = target;
+        decode();
+        return *this;
+    }
+
+    // A delta-encoded row can only be decoded by scanning forward from the
+    // start of its block.
+    m_offset = target / kTableBlockSize * kTableBlockSize;
+    clearRow();
     while (true) {
-        if (m_string[0] == '\0') {
-            m_string++;
+        decode();
+        if (m_offset == target)
             break;
-        }
-        m_string--;
+        m_offset = m_nextOffset;
     }
     return *this;
 }
 
 
+///////////////////////////////////////////////////////////////////////////////
+// TableRange
+
+// Decode up to maxRows rows into output, which must have room for maxRows *
+// columnCount values, and advance the start of the range past them.  Returns
+// the number of rows decoded, which is zero once the range is empty.
+//
+// In the block layout, the rows up to the end of the current block are
+// decoded in one loop straight into output, each relative to the row before
+// it.  The iterator is only advanced through the slower operator++ to cross
+// into the next block.
+size_t TableRange::read(ID *output, size_t maxRows)
+{
+    const Table *const table = m_begin.m_table;
+    const int columnCount = table->columnCount();
+    const size_t rowBytes = columnCount * sizeof(ID);
+    size_t count = 0;
+    if (!table->m_blockLayout) {
+        while (count < maxRows && m_begin != m_end) {
+            memcpy(output, m_begin.m_row, rowBytes);
+            output += columnCount;
+            ++count;
+            ++m_begin;
+        }
+        return count;
+    }
+
+    while (count < maxRows && m_begin != m_end) {
+        TableIterator &it = m_begin;
+        const char *const rowData = it.dataAt(it.m_offset);
+        memcpy(output, it.m_row, rowBytes);
+        const ID *previous = output;
+        output += columnCount;
+        ++count;
+
+        const uint64_t blockEnd =
+                (it.m_offset / kTableBlockSize + 1) * kTableBlockSize;
+        const uint64_t stop = std::min(std::min(blockEnd, it.m_frameEnd),
+                                       m_end.m_offset);
+        uint64_t lastOffset = it.m_offset;
+        uint64_t offset = it.m_nextOffset;
+        const char *input = rowData + (offset - it.m_offset);
+        while (count < maxRows && offset < stop && *input != '\0') {
+            memcpy(output, previous, rowBytes);
+            const char *const next = decodeDeltaRow(output, columnCount, input);
+            lastOffset = offset;
+            offset += next - input;
+            input = next;
+            previous = output;
+            output += columnCount;
+            ++count;
+        }
+
+        // Leave the iterator on the last decoded row, then step past it.
+        memcpy(it.m_row, previous, rowBytes);
+        it.m_offset = lastOffset;
+        it.m_nextOffset = offset;
+        ++it;
+    }
+    return count;
+}
+
+
 ///////////////////////////////////////////////////////////////////////////////
 // Table
 
 void Table::add(const Row &row)
+{
+    addValues(&row[0], row.count());
+}
+
+void Table::addValues(const ID *values, int count)
 {
     assert(!m_readonly);
-    encodeRow(row, m_tempEncodedRow.data());
+    assert(count == columnCount() && "Row does not match the table's columns");
+    encodeRow(values, count, m_tempEncodedRow.data());
     m_stringSetHash.insert(m_tempEncodedRow.data());
 }
 
@@ -131,39 +250,51 @@ int Table::columnCount() const
     return m_columnNames.size();
 }
 
-Table::Table(Index *index, Reader &reader) : m_readonly(true)
+Table::Table(Index *index, Reader &reader, uint32_t version) :
+    m_readonly(true),
+    m_blockLayout(version >= kIndexVersionDeltaRows)
 {
     m_readonlySize = reader.readUInt32();
     uint32_t columns = reader.readUInt32();
+    assert(columns <= static_cast<uint32_t>(kMaxTableColumns));
     m_tempEncodedRow.resize(maxEncodedRowSize(columns) + 1);
     m_columnNames.resize(columns);
     for (uint32_t i = 0; i < columns; ++i) {
         m_columnNames[i] = reader.readString();
-        if (!m_columnNames[i].empty()) {
-            StringTable *stringTable = index->stringTable(m_columnNames[i]);
-            assert(stringTable != NULL);
-        }
+        assert(m_columnNames[i].empty() ||
+               index->hasStringTable(m_columnNames[i]));
     }
-    m_stringSetBuffer = reader.readBuffer();
+    m_stringSetBuffer = reader.readFramedBuffer();
+    if (m_blockLayout)
+        m_blockDirectory = reader.readBuffer();
 }
 
 void Table::write(Writer &writer)
 {
     assert(m_readonly);
+    // Tables loaded from a legacy index cannot be rewritten.
+    assert(m_blockLayout);
     writer.writeUInt32(m_readonlySize);
     writer.writeUInt32(m_columnNames.size());
     for (const auto &name : m_columnNames) {
         writer.writeString(name);
     }
-    writer.writeBuffer(m_stringSetBuffer);
+    if (m_stringSetBuffer.isFramed()) {
+        writer.writeFramedBuffer(m_stringSetBuffer.flatten(), kTableFrameSize);
+    } else {
+        writer.writeFramedBuffer(m_stringSetBuffer.buffer(), kTableFrameSize);
+    }
+    writer.writeBuffer(m_blockDirectory);
 }
 
 Table::Table(Index *index, const std::vector<std::string> &columnNames) :
     m_readonly(false),
+    m_blockLayout(true),
     m_readonlySize(0),
     m_tempEncodedRow(maxEncodedRowSize(columnNames.size()) + 1)
 {
     assert(columnNames.size() >= 1);
+    assert(columnNames.size() <= static_cast<size_t>(kMaxTableColumns));
     uint32_t size = columnNames.size();
     m_columnNames = columnNames;
     for (uint32_t i = 0; i < size; ++i) {
@@ -188,6 +319,137 @@ std::vector<const std::vector<ID>*> Table::createTableSpecificIdMap(
     return tableIdMap;
 }
 
+// Sort the rows of a 2-dimensional array and return the row indices in sorted
+// order.
+//
+// The rows are first distributed into buckets by an MSD radix pass.  The
+// radix digit is the top kDigitBits bits of the row, where the row is treated
+// as the concatenation of each column's significant bits.  (Most IDs are far
+// smaller than 2^32, so using the top bits of each 32-bit word would put
+// nearly every row into the same bucket.)  Each bucket is then sorted
+// independently.  Both phases run on all worker threads.
+std::vector<uint32_t> sortRows(
+        const std::vector<ID> &tableData,
+        uint32_t rowCount,
+        uint32_t columnCount)
+{
+    const int kDigitBits = 16;
+    const uint32_t kBucketCount = 1u << kDigitBits;
+    const int workers = parallelWorkerCount(rowCount);
+    std::vector<uint32_t> sortedRows(rowCount);
+    if (rowCount == 0)
+        return sortedRows;
+
+    // Find the number of significant bits in each column.
+    std::vector<std::vector<ID> > workerBits(
+                workers, std::vector<ID>(columnCount));
+    parallelFor(rowCount, [&](size_t begin, size_t end, int worker) {
+        ID *bits = workerBits[worker].data();
+        for (size_t row = begin; row < end; ++row) {
+            const ID *values = &tableData[row * columnCount];
+            for (uint32_t column = 0; column < columnCount; ++column)
+                bits[column] |= values[column];
+        }
+    }, workers);
+
+    // Plan how to extract the digit: take bits from the leading columns
+    // until kDigitBits bits have been taken.
+    struct DigitPart {
+        uint32_t column;
+        uint32_t shift;
+        uint32_t mask;
+        uint32_t width;
+    };
+    std::vector<DigitPart> digitParts;
+    int digitBitsLeft = kDigitBits;
+    for (uint32_t column = 0; column < columnCount && digitBitsLeft > 0;
+            ++column) {
+        ID bits = 0;
+        for (int worker = 0; worker < workers; ++worker)
+            bits |= workerBits[worker][column];
+        uint32_t width = 0;
+        while (width < 32 && (bits >> width) != 0)
+            width++;
+        if (width == 0)
+            continue;
+        DigitPart part;
+        part.width = std::min<uint32_t>(width, digitBitsLeft);
+        part.column = column;
+        part.shift = width - part.width;
+        part.mask = (1u << part.width) - 1;
+        digitParts.push_back(part);
+        digitBitsLeft -= part.width;
+    }
+    auto digit = [&](uint32_t row) -> uint32_t {
+        const ID *values = &tableData[static_cast<size_t>(row) * columnCount];
+        uint32_t ret = 0;
+        for (const DigitPart &part : digitParts) {
+            ret = (ret << part.width) |
+                    ((values[part.column] >> part.shift) & part.mask);
+        }
+        return ret;
+    };
+
+    // Count each worker's rows in each bucket, then turn the counts into
+    // output offsets.  Each worker scatters its rows into its own slice of
+    // each bucket.
+    std::vector<std::vector<uint32_t> > workerOffsets(
+                workers, std::vector<uint32_t>(kBucketCount));
+    parallelFor(rowCount, [&](size_t begin, size_t end, int worker) {
+        uint32_t *counts = workerOffsets[worker].data();
+        for (size_t row = begin; row < end; ++row)
+            counts[digit(row)]++;
+    }, workers);
+    std::vector<uint32_t> bucketStart(kBucketCount + 1);
+    uint32_t offset = 0;
+    for (uint32_t bucket = 0; bucket < kBucketCount; ++bucket) {
+        bucketStart[bucket] = offset;
+        for (int worker = 0; worker < workers; ++worker) {
+            const uint32_t count = workerOffsets[worker][bucket];
+            workerOffsets[worker][bucket] = offset;
+            offset += count;
+        }
+    }
+    bucketStart[kBucketCount] = offset;
+    assert(offset == rowCount);
+    parallelFor(rowCount, [&](size_t begin, size_t end, int worker) {
+        uint32_t *offsets = workerOffsets[worker].data();
+        for (size_t row = begin; row < end; ++row)
+            sortedRows[offsets[digit(row)]++] = row;
+    }, workers);
+
+    // Sort the buckets.  Each worker takes the buckets starting within its
+    // share of the rows.
+    struct CompareFunc {
+        uint32_t columnCount;
+        const ID *tableData;
+        bool operator()(uint32_t x, uint32_t y) const {
+            const ID *rowX = &tableData[static_cast<size_t>(x) * columnCount];
+            const ID *rowY = &tableData[static_cast<size_t>(y) * columnCount];
+            for (uint32_t column = 0; column < columnCount; ++column) {
+                if (rowX[column] != rowY[column])
+                    return rowX[column] < rowY[column];
+            }
+            return false;
+        }
+    } compareFunc;
+    compareFunc.columnCount = columnCount;
+    compareFunc.tableData = tableData.data();
+    parallelFor(rowCount, [&](size_t begin, size_t end, int worker) {
+        uint32_t bucket = std::lower_bound(
+                    bucketStart.begin(), bucketStart.end(), begin) -
+                bucketStart.begin();
+        for (; bucket < kBucketCount && bucketStart[bucket] < end;
+                ++bucket) {
+            std::sort(sortedRows.begin() + bucketStart[bucket],
+                      sortedRows.begin() + bucketStart[bucket + 1],
+                      compareFunc);
+        }
+    }, workers);
+
+    return sortedRows;
+}
+
 // Transform the Table from its mutable representation to its read-only
 // representation.
 //
@@ -200,6 +462,9 @@ std::vector<const std::vector<ID>*> Table::createTableSpecificIdMap(
 // remaps all the IDs in its rows (before sorting them, of course).  The effect
 // is that everything (string and non-string tables) are in sorted order.
 //
+// Each phase (decoding, sorting, and encoding) is split across the worker
+// threads.  The output does not depend on the number of threads.
+//
 void Table::setReadOnly(
         const std::map<std::string, std::vector<ID> > &idMap)
 {
@@ -209,108 +474,281 @@ void Table::setReadOnly(
 
     const uint32_t columnCount = this->columnCount();
     const uint32_t rowCount = m_stringSetHash.size();
-    std::vector<ID> tableData(rowCount * columnCount);
+    std::vector<ID> tableData(static_cast<size_t>(rowCount) * columnCount);
 
     {
         // Decode the packed strings in the string set into a 2-dimensional
         // array.  As we're writing the new table, transform the ID values
         // using the idMap.
         auto tableIdMap = createTableSpecificIdMap(idMap);
-        uint32_t rowIndex = 0;
-        ID *ptr = tableData.data();
-        ID *endPtr = tableData.data() + tableData.size();
-        while (ptr != endPtr) {
-            decodeRow(ptr, columnCount, m_stringSetHash.item(rowIndex));
-            for (uint32_t column = 0; column < columnCount; ++column) {
-                const std::vector<ID> *map = tableIdMap[column];
-                if (map != NULL)
-                    *ptr = (*map)[*ptr];
-                // Convert each uint32_t to big-endian so that rows can be
-                // compared below using memcmp.
-                *ptr = HostToBE32(*ptr);
-                ptr++;
+        parallelFor(rowCount, [&](size_t begin, size_t end, int worker) {
+            for (size_t rowIndex = begin; rowIndex < end; ++rowIndex) {
+                ID *ptr = &tableData[rowIndex * columnCount];
+                decodeRow(ptr, columnCount, m_stringSetHash.item(rowIndex));
+                for (uint32_t column = 0; column < columnCount; ++column) {
+                    const std::vector<ID> *map = tableIdMap[column];
+                    if (map != NULL)
+                        ptr[column] = (*map)[ptr[column]];
+                }
             }
-            rowIndex++;
-        }
+        });
         // Discard the old string set to conserve memory.
         m_stringSetHash = StringTable();
     }
 
-    // Create a table mapping sorted index to old index.
-    std::vector<uint32_t> sortedStrings(rowCount);
-    for (uint32_t i = 0; i < rowCount; ++i)
-        sortedStrings[i] = i;
+    encodeBlocks(tableData, sortRows(tableData, rowCount, columnCount));
 
-    struct CompareFunc {
-        uint32_t rowCount;
-        uint32_t columnCount;
-        ID *tableData;
-        bool operator()(uint32_t x, uint32_t y) {
-            assert(x < rowCount);
-            assert(y < rowCount);
-            ID *rowX = &tableData[x * columnCount];
-            ID *rowY = &tableData[y * columnCount];
-            return memcmp(rowX, rowY, columnCount * sizeof(ID)) < 0;
+    m_readonly = true;
+    m_readonlySize = rowCount;
+}
+
+// Encode the sorted rows and add them to the buffer.  Rows are packed into
+// blocks of kTableBlockSize bytes.  When a row does not fit in the rest of the
+// current block, the block is padded with NULs and the row starts the next
+// block.  The last block is not padded.  Each row is delta-encoded against the
+// previous row in its block, so sorted rows sharing leading columns (e.g. the
+// same file and line) take only a few bytes.
+//
+// The rows are encoded in three passes.  The first pass measures each row's
+// encoding in parallel, the second pass (serial, but only adding sizes) lays
+// out the blocks, and the third pass encodes the blocks in parallel directly
+// into their final positions.
+void Table::encodeBlocks(
+        const std::vector<ID> &tableData,
+        const std::vector<uint32_t> &sortedRows)
+{
+    const uint32_t columnCount = this->columnCount();
+    const uint32_t rowCount = sortedRows.size();
+    const size_t maxRowSize = maxEncodedRowSize(columnCount) + 1;
+    const std::vector<ID> zeroRow(columnCount);
+    assert(maxRowSize <= kTableBlockSize);
+    auto sortedRow = [&](uint32_t index) -> const ID* {
+        return &tableData[static_cast<size_t>(sortedRows[index]) * columnCount];
+    };
+
+    // Measure each row when encoded against the previous row.
+    std::vector<uint8_t> deltaSizes(rowCount);
+    parallelFor(rowCount, [&](size_t begin, size_t end, int worker) {
+        std::vector<char> encodedRow(maxRowSize);
+        for (size_t i = begin; i < end; ++i) {
+            const ID *previous = (i == 0) ? zeroRow.data() : sortedRow(i - 1);
+            deltaSizes[i] = encodeDeltaRow(
+                        sortedRow(i), previous, columnCount,
+                        encodedRow.data());
         }
-    } compareFunc;
+    });
 
-    compareFunc.rowCount = rowCount;
-    compareFunc.columnCount = columnCount;
-    compareFunc.tableData = tableData.data();
-    std::sort<uint32_t*, CompareFunc>(
-                &sortedStrings[0],
-                &sortedStrings[rowCount],
-                compareFunc);
-
-    // Prepend an initial NUL character to simplify iterator decrement.
-    m_stringSetBuffer.append("", 1);
-
-    // Encode each row and add it to the buffer.
-    std::vector<char> encodedRow(maxEncodedRowSize(columnCount) + 1);
-    for (uint32_t newIndex = 0; newIndex < rowCount; ++newIndex) {
-        uint32_t oldIndex = sortedStrings[newIndex];
-        ID *row = &tableData[oldIndex * columnCount];
-        for (uint32_t i = 0; i < columnCount; ++i) {
-            // The integers were converted to big-endian above.  Convert them
-            // to host-encoding here.  (encodeRow will further convert them to
-            // a VLE representation.)
-            row[i] = BEToHost32(row[i]);
+    // Lay out the blocks.
+    std::vector<uint32_t> blockFirstRows;
+    uint64_t bufferSize = 0;
+    {
+        std::vector<char> encodedRow(maxRowSize);
+        for (uint32_t i = 0; i < rowCount; ++i) {
+            uint32_t blockOffset = bufferSize % kTableBlockSize;
+            uint32_t encodedSize = deltaSizes[i];
+            if (blockOffset != 0 &&
+                    blockOffset + encodedSize > kTableBlockSize) {
+                bufferSize += kTableBlockSize - blockOffset;
+                blockOffset = 0;
+            }
+            if (blockOffset == 0) {
+                // The first row of a block is encoded against a row of zeros.
+                encodedSize = encodeDeltaRow(
+                            sortedRow(i), zeroRow.data(), columnCount,
+                            encodedRow.data());
+                blockFirstRows.push_back(i);
+            }
+            bufferSize += encodedSize;
         }
-        encodeRow(row, columnCount, encodedRow.data());
-        m_stringSetBuffer.append(
-                    encodedRow.data(),
-                    strlen(encodedRow.data()) + 1);
     }
 
-    m_readonly = true;
-    m_readonlySize = rowCount;
+    // Encode the blocks.  A block holds many rows, so the rows, rather than
+    // the blocks, decide how many workers are worth starting.
+    const uint32_t blockCount = blockFirstRows.size();
+    Buffer rows(bufferSize);
+    m_blockDirectory = Buffer(blockCount * columnCount * sizeof(uint32_t));
+    char *const buffer = static_cast<char*>(rows.data());
+    uint32_t *const directory =
+            static_cast<uint32_t*>(m_blockDirectory.data());
+    parallelFor(blockCount, [&](size_t begin, size_t end, int worker) {
+        for (size_t block = begin; block < end; ++block) {
+            const uint32_t firstRow = blockFirstRows[block];
+            const uint32_t lastRow = (block + 1 < blockCount) ?
+                        blockFirstRows[block + 1] : rowCount;
+            for (uint32_t i = 0; i < columnCount; ++i) {
+                directory[block * columnCount + i] =
+                        HostToLE32(sortedRow(firstRow)[i]);
+            }
+            char *output =
+                    buffer + static_cast<uint64_t>(block) * kTableBlockSize;
+            const ID *previous = zeroRow.data();
+            for (uint32_t i = firstRow; i < lastRow; ++i) {
+                output += encodeDeltaRow(
+                            sortedRow(i), previous, columnCount, output);
+                previous = sortedRow(i);
+            }
+            assert(output <= buffer + bufferSize);
+        }
+    }, parallelWorkerCount(rowCount));
+    m_stringSetBuffer = FramedBuffer(std::move(rows));
 }
 
-// Find the first iterator that is greater than or equal to the given row.
-TableIterator Table::lowerBound(const Row &row)
+// Return the start of the block following the one containing the offset.
+uint64_t Table::nextBlockStart(uint64_t offset) const
+{
+    assert(m_blockLayout);
+    const uint64_t ret = (offset / kTableBlockSize + 1) * kTableBlockSize;
+    assert(ret <= rowsEnd());
+    return ret;
+}
+
+// Returns true if the first row of the given block comes before the lower
+// bound (or upper bound) for the given row.  The row may have fewer columns
+// than the table.
+bool Table::blockPrecedes(uint32_t block, const Row &row, bool upper) const
+{
+    const uint32_t *firstRow = blockFirstRow(block);
+    ID values[kMaxTableColumns];
+    for (int column = 0; column < row.count(); ++column)
+        values[column] = LEToHost32(firstRow[column]);
+    return precedesBound(values, row, upper);
+}
+
+// Binary search the block directory for the first block in [blockMin,
+// blockMax) whose first row does not precede the bound.
+uint32_t Table::searchBlocks(
+        const Row &row,
+        bool upper,
+        uint32_t blockMin,
+        uint32_t blockMax) const
+{
+    while (blockMin != blockMax) {
+        const uint32_t blockMid = blockMin + (blockMax - blockMin) / 2;
+        if (blockPrecedes(blockMid, row, upper))
+            blockMin = blockMid + 1;
+        else
+            blockMax = blockMid;
+    }
+    return blockMin;
+}
+
+// Given the first block whose first row does not precede the bound, find the
+// bound's iterator.  It is either in the block before it or is that block's
+// first row.
+TableIterator Table::scanBlock(
+        uint32_t block,
+        const Row &row,
+        bool upper) const
+{
+    if (block == 0)
+        return begin();
+    TableIterator it(this, static_cast<uint64_t>(block - 1) * kTableBlockSize);
+    const TableIterator itEnd = end();
+    for (; it != itEnd; ++it) {
+        if (!precedesBound(it.m_row, row, upper))
+            break;
+    }
+    return it;
+}
+
+TableIterator Table::bound(const Row &row, bool upper) const
 {
     assert(m_readonly);
     assert(row.count() <= columnCount());
 
+    if (!m_blockLayout)
+        return legacyBound(row, upper);
+
+    return scanBlock(searchBlocks(row, upper, 0, blockCount()), row, upper);
+}
+
+// Find the first iterator that is greater than or equal to the given row.
+TableIterator Table::lowerBound(const Row &row) const
+{
+    return bound(row, /*upper=*/false);
+}
+
+// Find the first iterator whose row is greater than the given row, ignoring
+// columns past the end of the given row.
+TableIterator Table::upperBound(const Row &row) const
+{
+    return bound(row, /*upper=*/true);
+}
+
+// Return the rows between the lower and upper rows, inclusive, where only the
+// columns present in the lower and upper rows are compared.  The two bounds
+// are found with a single binary search of the block directory until the
+// bounds fall into different blocks.
+TableRange Table::range(const Row &lower, const Row &upper) const
+{
+    assert(m_readonly);
+    assert(lower.count() == upper.count());
+
+    // An inverted range is empty, e.g. a query for lines [10, 9].
+    if (upper < lower)
+        return TableRange(end(), end());
+
+    if (!m_blockLayout) {
+        return TableRange(legacyBound(lower, /*upper=*/false),
+                          legacyBound(upper, /*upper=*/true));
+    }
+
+    uint32_t blockMin = 0;
+    uint32_t blockMax = blockCount();
+    uint32_t lowerBlock = blockMax;
+    uint32_t upperBlock = blockMax;
+    while (true) {
+        if (blockMin == blockMax) {
+            lowerBlock = upperBlock = blockMin;
+            break;
+        }
+        const uint32_t blockMid = blockMin + (blockMax - blockMin) / 2;
+        if (blockPrecedes(blockMid, lower, /*upper=*/false)) {
+            blockMin = blockMid + 1;
+        } else if (!blockPrecedes(blockMid, upper, /*upper=*/true)) {
+            blockMax = blockMid;
+        } else {
+            // The block's first row is within the range, so the bounds
+            // diverge here.
+            lowerBlock = searchBlocks(lower, false, blockMin, blockMid);
+            upperBlock = searchBlocks(upper, true, blockMid + 1, blockMax);
+            break;
+        }
+    }
+
+    return TableRange(scanBlock(lowerBlock, lower, /*upper=*/false),
+                      scanBlock(upperBlock, upper, /*upper=*/true));
+}
+
+// Return the rows whose leading columns equal the given prefix.
+TableRange Table::equalRange(const Row &prefix) const
+{
+    return range(prefix, prefix);
+}
+
+// Binary search a table using the legacy layout, which has no block
+// directory.
+TableIterator Table::legacyBound(const Row &row, bool upper) const
+{
     TableIterator itMin = begin();
     TableIterator itMax = end();
-    Row tempRow(columnCount());
+    const char *base =
+            static_cast<const char*>(m_stringSetBuffer.buffer().data());
 
     // Binary search for the provided row.
     while (itMin != itMax) {
         // Find a midpoint itMid.  It will be in the range [itMin, itMax).
         TableIterator itMid = itMin;
         {
-            const char *midStr = itMin.m_string + ((itMax.m_string - itMin.m_string) / 2);
-            assert(midStr < itMax.m_string);
-            midStr += strlen(midStr) + 1;
-            itMid.m_string = midStr;
+            uint64_t mid = itMin.m_offset + ((itMax.m_offset - itMin.m_offset) / 2);
+            assert(mid < itMax.m_offset);
+            mid += strlen(base + mid) + 1;
+            itMid.m_offset = mid;
             --itMid;
             assert(itMid >= itMin && itMid < itMax);
         }
 
-        decodeRow(tempRow, itMid.m_string);
-        if (tempRow < row) {
+        if (precedesBound(itMid.m_row, row, upper)) {
             itMin = itMid;
             ++itMin;
         } else {
@@ -332,7 +770,10 @@ void Table::dumpStats() const
 ///////////////////////////////////////////////////////////////////////////////
 // Index
 
-Index::Index() : m_reader(NULL)
+class IndexLoadMutex : public std::mutex {};
+
+Index::Index() :
+    m_reader(NULL), m_version(kIndexVersion), m_loadMutex(NULL)
 {
 }
 
@@ -347,24 +788,123 @@ Index::Index(Reader *reader)
     init(reader);
 }
 
+// Exit with an error message if the index has a version this reader cannot
+// parse, e.g. one written by a newer version.  Unlike an assert, the check is
+// kept in release builds, where the index would otherwise be misread.
+static void checkIndexVersion(uint32_t version)
+{
+    if (version >= kIndexVersionDeltaRows && version <= kIndexVersion)
+        return;
+    fprintf(stderr, "indexdb: unsupported index version %u\n", version);
+    exit(1);
+}
+
 void Index::init(Reader *reader)
 {
     m_reader = reader;
+    m_loadMutex = NULL;
     m_reader->readSignature(kIndexSignature);
 
     uint32_t tableCount;
 
     tableCount = m_reader->readUInt32();
+    if (tableCount & kIndexVersionFlag) {
+        m_version = tableCount & ~kIndexVersionFlag;
+        checkIndexVersion(m_version);
+        if (m_version >= kIndexVersionTableDirectory) {
+            readTableDirectory();
+            return;
+        }
+        tableCount = m_reader->readUInt32();
+    } else {
+        m_version = kIndexVersionLegacy;
+    }
+
     for (uint32_t i = 0; i < tableCount; ++i) {
         std::string tableName = m_reader->readString();
-        m_stringTables[tableName] = new StringTable(*m_reader);
+        m_stringTables[tableName] = new StringTable(
+                    *m_reader, m_version >= kIndexVersionStringIndexLayout);
     }
 
     tableCount = m_reader->readUInt32();
     for (uint32_t i = 0; i < tableCount; ++i) {
         std::string tableName = m_reader->readString();
-        m_tables[tableName] = new Table(this, *m_reader);
+        m_tables[tableName] = new Table(this, *m_reader, m_version);
+    }
+}
+
+// The table directory follows the tables, and the last 8 bytes of the index
+// hold the directory's offset.  Only the directory is read here.  Nothing is
+// read from a table until it is first used.
+void Index::readTableDirectory()
+{
+    m_reader->seek(m_reader->size() - sizeof(uint64_t));
+    m_reader->seek(m_reader->readUInt64());
+
+    uint32_t tableCount = m_reader->readUInt32();
+    for (uint32_t i = 0; i < tableCount; ++i) {
+        std::string tableName = m_reader->readString();
+        m_stringTables[tableName] = NULL;
+        m_stringTableOffsets[tableName] = m_reader->readUInt64();
+    }
+
+    tableCount = m_reader->readUInt32();
+    for (uint32_t i = 0; i < tableCount; ++i) {
+        std::string tableName = m_reader->readString();
+        m_tables[tableName] = NULL;
+        m_tableOffsets[tableName] = m_reader->readUInt64();
+    }
+
+    m_loadMutex = new IndexLoadMutex;
+}
+
+void Index::loadAllTables() const
+{
+    if (m_loadMutex == NULL)
+        return;
+    for (const auto &pair : m_stringTables)
+        findStringTable(pair.first);
+    for (const auto &pair : m_tables)
+        findTable(pair.first);
+}
+
+bool Index::hasStringTable(const std::string &name) const
+{
+    return m_stringTables.find(name) != m_stringTables.end();
+}
+
+// Return the string table with the given name, loading it if necessary, or
+// NULL if it does not exist.
+StringTable *Index::findStringTable(const std::string &name) const
+{
+    std::unique_lock<std::mutex> lock;
+    if (m_loadMutex != NULL)
+        lock = std::unique_lock<std::mutex>(*m_loadMutex);
+    auto it = m_stringTables.find(name);
+    if (it == m_stringTables.end())
+        return NULL;
+    if (it->second == NULL) {
+        m_reader->seek(m_stringTableOffsets.at(name));
+        it->second = new StringTable(*m_reader, true);
     }
+    return it->second;
+}
+
+// Return the table with the given name, loading it if necessary, or NULL if
+// it does not exist.
+Table *Index::findTable(const std::string &name) const
+{
+    std::unique_lock<std::mutex> lock;
+    if (m_loadMutex != NULL)
+        lock = std::unique_lock<std::mutex>(*m_loadMutex);
+    auto it = m_tables.find(name);
+    if (it == m_tables.end())
+        return NULL;
+    if (it->second == NULL) {
+        m_reader->seek(m_tableOffsets.at(name));
+        it->second = new Table(const_cast<Index*>(this), *m_reader, m_version);
+    }
+    return it->second;
 }
 
 Index::~Index()
@@ -380,27 +920,54 @@ Index::~Index()
     }
 
     delete m_reader;
+    delete m_loadMutex;
 }
 
-void Index::write(const std::string &path)
+void Index::write(const std::string &path, bool compressed)
 {
     Writer writer(path);
+    writer.setCompressed(compressed);
     write(writer);
 }
 
+// Write the index.  The string tables and tables are followed by a directory
+// of their offsets from the start of the index, and the index ends with the
+// directory's offset.  Everything is written in a single forward pass.
 void Index::write(Writer &writer)
 {
+    loadAllTables();
+    const uint64_t start = writer.tell();
+    std::vector<uint64_t> stringTableOffsets;
+    std::vector<uint64_t> tableOffsets;
+
     writer.writeSignature(kIndexSignature);
+    writer.writeUInt32(kIndexVersionFlag | kIndexVersion);
+    for (const auto &pair : m_stringTables) {
+        writer.align(kMaxAlign);
+        stringTableOffsets.push_back(writer.tell() - start);
+        pair.second->write(writer);
+    }
+    for (const auto &pair : m_tables) {
+        writer.align(kMaxAlign);
+        tableOffsets.push_back(writer.tell() - start);
+        pair.second->write(writer);
+    }
+
+    writer.align(kMaxAlign);
+    const uint64_t directoryOffset = writer.tell() - start;
+    size_t i = 0;
     writer.writeUInt32(m_stringTables.size());
     for (const auto &pair : m_stringTables) {
         writer.writeString(pair.first);
-        pair.second->write(writer);
+        writer.writeUInt64(stringTableOffsets[i++]);
     }
+    i = 0;
     writer.writeUInt32(m_tables.size());
     for (const auto &pair : m_tables) {
         writer.writeString(pair.first);
-        pair.second->write(writer);
+        writer.writeUInt64(tableOffsets[i++]);
     }
+    writer.writeUInt64(directoryOffset);
 }
 
 // Merge all of the string tables and tables from the other index into the
@@ -409,6 +976,7 @@ void Index::write(Writer &writer)
 void Index::merge(const Index &other)
 {
     std::map<std::string, std::vector<ID> > idMap;
+    other.loadAllTables();
 
     // For each string table in "other", add all of the strings to the
     // corresponding string table in "this", while also building a table
@@ -481,9 +1049,8 @@ std::string Index::stringTableName(size_t index) const
 // not exist.  The index must be writable to call this method.
 StringTable *Index::addStringTable(const std::string &name)
 {
-    auto it = m_stringTables.find(name);
-    if (it != m_stringTables.end())
-        return it->second;
+    if (StringTable *stringTable = findStringTable(name))
+        return stringTable;
     m_stringTables[name] = new StringTable();
     return m_stringTables[name];
 }
@@ -491,15 +1058,13 @@ StringTable *Index::addStringTable(const std::string &name)
 // Returns the string table with the given name or NULL if it does not exist.
 StringTable *Index::stringTable(const std::string &name)
 {
-    auto it = m_stringTables.find(name);
-    return (it != m_stringTables.end()) ? it->second : NULL;
+    return findStringTable(name);
 }
 
 // Returns the string table with the given name or NULL if it does not exist.
 const StringTable *Index::stringTable(const std::string &name) const
 {
-    auto it = m_stringTables.find(name);
-    return (it != m_stringTables.end()) ? it->second : NULL;
+    return findStringTable(name);
 }
 
 size_t Index::tableCount() const
@@ -522,12 +1087,10 @@ std::string Index::tableName(size_t index) const
 // index must be writable to call this method.
 Table *Index::addTable(const std::string &name, const std::vector<std::string> &names)
 {
-    auto it = m_tables.find(name);
-    if (it != m_tables.end()) {
-        assert(it->second->m_columnNames == names);
-        return it->second;
+    if (Table *table = findTable(name)) {
+        assert(table->m_columnNames == names);
+        return table;
     }
-    assert(m_tables.find(name) == m_tables.end());
     m_tables[name] = new Table(this, names);
     return m_tables[name];
 }
@@ -535,15 +1098,13 @@ Table *Index::addTable(const std::string &name, const std::vector<std::string> &
 // Return the table with the given name or NULL if it does not exist.
 const Table *Index::table(const std::string &name) const
 {
-    auto it = m_tables.find(name);
-    return (it != m_tables.end()) ? it->second : NULL;
+    return findTable(name);
 }
 
 // Return the table with the given name or NULL if it does not exist.
 Table *Index::table(const std::string &name)
 {
-    auto it = m_tables.find(name);
-    return (it != m_tables.end()) ? it->second : NULL;
+    return findTable(name);
 }
 
 // Finalize string and non-string tables.  After calling this routine, the
@@ -554,6 +1115,8 @@ Table *Index::table(const std::string &name)
 // finalize the new tables.
 void Index::finalizeTables()
 {
+    loadAllTables();
+
     // Sort the string tables.
     std::map<std::string, std::vector<ID> > idMap;
     for (const auto &table : m_stringTables) {
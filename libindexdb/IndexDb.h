@@ -12,6 +12,7 @@
 #include <utility>
 #include <vector>
 
+#include "FramedBuffer.h"
 #include "StringTable.h"
 
 namespace indexdb {
@@ -19,6 +20,7 @@ namespace indexdb {
 class Writer;
 class Reader;
 class Index;
+class IndexLoadMutex;
 class Table;
 
 
@@ -28,6 +30,49 @@ class Table;
 const char kIndexSignature[]        = "\x7fIDX";
 const char kIndexArchiveSignature[] = "\x7fIAR";
 
+// Index files written before the format was versioned follow the signature
+// with the string table count.  Newer files follow it with a version word
+// whose high bit is set, which a real table count never has.
+const uint32_t kIndexVersionFlag              = 0x80000000u;
+const uint32_t kIndexVersionLegacy            = 0;
+const uint32_t kIndexVersionBlockTables       = 1;
+const uint32_t kIndexVersionDeltaRows         = 2;
+const uint32_t kIndexVersionStringIndexLayout = 3;
+const uint32_t kIndexVersionTableDirectory    = 4;
+const uint32_t kIndexVersionFramedRows        = 5;
+const uint32_t kIndexVersionWideSizes         = 6;
+const uint32_t kIndexVersion                  = kIndexVersionWideSizes;
+
+// Archives are versioned the same way.  Unversioned archives have 32-bit entry
+// offsets and lengths.  Since kIndexArchiveVersionHashTag, the version is
+// followed by the ArchiveHash that hashed the entries.  Older archives use
+// SHA-256.
+const uint32_t kIndexArchiveVersionWideSizes  = 1;
+const uint32_t kIndexArchiveVersionHashTag    = 2;
+const uint32_t kIndexArchiveVersion           = kIndexArchiveVersionHashTag;
+
+// The hash of an archive entry only identifies identical entries when merging,
+// so it need not be cryptographic.  The first two hash the entry's bytes,
+// which depend on the IDs its strings were assigned.  A fingerprint (see
+// indexFingerprint) is the same for any two entries with the same content.
+enum ArchiveHash : uint32_t {
+    ArchiveHashSha256       = 0,    // 32 bytes
+    ArchiveHashMurmur3_128  = 1,    // 16 bytes, MurmurHash3_x64_128
+    ArchiveHashFingerprint  = 2,    // 16 bytes
+    ArchiveHashMax
+};
+
+// Read-only tables store their rows in blocks of this many bytes.  A row never
+// straddles two blocks.
+const uint32_t kTableBlockSize = 4096;
+
+// When compressed, a table's rows are split into frames of this many bytes,
+// which are compressed separately.  A frame holds a whole number of blocks.
+const uint32_t kTableFrameSize = 16 * kTableBlockSize;
+
+// The maximum number of columns in a table.
+const int kMaxTableColumns = 8;
+
 
 ///////////////////////////////////////////////////////////////////////////////
 // Row
@@ -55,6 +100,21 @@ private:
     int m_count;
 };
 
+// A row with a fixed number of columns, held in place rather than on the heap.
+// Use it to add many rows to a table, e.g. one per reference.
+template <int N>
+class FixedRow {
+public:
+    static_assert(N > 0 && N <= kMaxTableColumns, "Invalid column count");
+    int count() const { return N; }
+    uint32_t &operator[](size_t i) { return m_data[i]; }
+    const uint32_t &operator[](size_t i) const { return m_data[i]; }
+    const uint32_t *data() const { return m_data; }
+
+private:
+    uint32_t m_data[N];
+};
+
 // A shorter row comes before a larger row if the common columns' values are
 // equal.
 inline bool operator<(const Row &x, const Row &y) {
@@ -74,22 +134,63 @@ inline bool operator<(const Row &x, const Row &y) {
 ///////////////////////////////////////////////////////////////////////////////
 // TableIterator
 
+// An iterator holds the decoded values of its current row, because rows in
+// the block layout are encoded relative to the previous row in the block.
 class TableIterator {
 public:
-    explicit TableIterator(const Table *table, const char *string) : m_table(table), m_string(string) {}
-    TableIterator &operator++() { m_string += strlen(m_string) + 1; return *this; }
+    TableIterator &operator++();
     TableIterator &operator--();
-    bool operator!=(const TableIterator &other) { return m_string != other.m_string; }
-    bool operator==(const TableIterator &other) { return m_string == other.m_string; }
-    bool operator<(const TableIterator &other) { return m_string < other.m_string; }
-    bool operator<=(const TableIterator &other) { return m_string <= other.m_string; }
-    bool operator>(const TableIterator &other) { return m_string > other.m_string; }
-    bool operator>=(const TableIterator &other) { return m_string >= other.m_string; }
+    bool operator!=(const TableIterator &other) const { return m_offset != other.m_offset; }
+    bool operator==(const TableIterator &other) const { return m_offset == other.m_offset; }
+    bool operator<(const TableIterator &other) const { return m_offset < other.m_offset; }
+    bool operator<=(const TableIterator &other) const { return m_offset <= other.m_offset; }
+    bool operator>(const TableIterator &other) const { return m_offset > other.m_offset; }
+    bool operator>=(const TableIterator &other) const { return m_offset >= other.m_offset; }
     void value(Row &row);
 
 private:
+    TableIterator(const Table *table, uint64_t offset);
+    void clearRow() { memset(m_row, 0, sizeof(m_row)); }
+    void decode();
+    inline const char *dataAt(uint64_t offset);
+
     const Table *m_table;
-    const char *m_string;
+    uint64_t m_offset;
+    uint64_t m_nextOffset;
+
+    // The frame of the table's rows that was last read, covering
+    // [m_frameStart, m_frameEnd).
+    const char *m_frame;
+    uint64_t m_frameStart;
+    uint64_t m_frameEnd;
+    FramePin m_framePin;
+
+    ID m_row[kMaxTableColumns];
+
+    friend class Table;
+    friend class TableRange;
+};
+
+
+///////////////////////////////////////////////////////////////////////////////
+// TableRange
+
+// A half-open range of rows, [begin, end).  Besides exposing the iterators,
+// it can decode its rows in batches, which avoids re-checking the bounds of
+// the range on every row.
+class TableRange {
+public:
+    TableIterator begin() const { return m_begin; }
+    TableIterator end() const { return m_end; }
+    bool empty() const { return m_begin == m_end; }
+    size_t read(ID *output, size_t maxRows);
+
+private:
+    TableRange(const TableIterator &begin, const TableIterator &end) :
+        m_begin(begin), m_end(end) {}
+
+    TableIterator m_begin;
+    TableIterator m_end;
 
     friend class Table;
 };
@@ -103,33 +204,35 @@ public:
     typedef TableIterator iterator;
 
     void add(const Row &row);
+    template <int N>
+    void add(const FixedRow<N> &row) { addValues(row.data(), N); }
     int columnCount() const;
 
     TableIterator begin() const {
         assert(m_readonly);
-        return TableIterator(this, static_cast<const char*>(
-                                 m_stringSetBuffer.data()) + 1);
+        return TableIterator(this, rowsBegin());
     }
 
     TableIterator end() const {
         assert(m_readonly);
-        return TableIterator(this, static_cast<const char*>(
-                                 m_stringSetBuffer.data()) +
-                                 m_stringSetBuffer.size());
+        return TableIterator(this, rowsEnd());
     }
 
     std::string columnName(int i) const {
         return m_columnNames[i];
     }
 
-    TableIterator lowerBound(const Row &row);
+    TableIterator lowerBound(const Row &row) const;
+    TableIterator upperBound(const Row &row) const;
+    TableRange range(const Row &lower, const Row &upper) const;
+    TableRange equalRange(const Row &prefix) const;
     void dumpStats() const;
 
     uint32_t size() const {
         return m_readonly ? m_readonlySize : m_stringSetHash.size();
     }
 
-    uint32_t bufferSize() const {
+    uint64_t bufferSize() const {
         assert(m_readonly);
         return m_stringSetBuffer.size();
     }
@@ -137,21 +240,61 @@ public:
     bool isReadOnly() const { return m_readonly; }
 
 private:
-    Table(Index *index, Reader &reader);
+    void addValues(const ID *values, int count);
+    Table(Index *index, Reader &reader, uint32_t version);
     void write(Writer &writer);
     Table(Index *index, const std::vector<std::string> &columns);
     std::vector<const std::vector<ID>*> createTableSpecificIdMap(
             const std::map<std::string, std::vector<ID> > &idMap);
     void setReadOnly(const std::map<std::string, std::vector<ID> > &idMap);
+    void encodeBlocks(const std::vector<ID> &tableData,
+                      const std::vector<uint32_t> &sortedRows);
+    TableIterator bound(const Row &row, bool upper) const;
+    TableIterator legacyBound(const Row &row, bool upper) const;
+    uint32_t searchBlocks(const Row &row, bool upper,
+                          uint32_t blockMin, uint32_t blockMax) const;
+    TableIterator scanBlock(uint32_t block, const Row &row, bool upper) const;
+    bool blockPrecedes(uint32_t block, const Row &row, bool upper) const;
+
+    static bool isBlockStart(uint64_t offset) {
+        return offset % kTableBlockSize == 0;
+    }
+
+    uint64_t rowsBegin() const {
+        // The legacy layout prepends a NUL character to simplify iterator
+        // decrement.
+        return m_blockLayout ? 0 : 1;
+    }
+
+    uint64_t rowsEnd() const {
+        return m_stringSetBuffer.size();
+    }
+
+    uint64_t nextBlockStart(uint64_t offset) const;
+
+    uint32_t blockCount() const {
+        return m_blockDirectory.size() / (columnCount() * sizeof(uint32_t));
+    }
+
+    // The directory stores the first row of each block, unencoded, as
+    // little-endian integers.
+    const uint32_t *blockFirstRow(uint32_t block) const {
+        return static_cast<const uint32_t*>(m_blockDirectory.data()) +
+                block * columnCount();
+    }
 
     bool m_readonly;
+    bool m_blockLayout;
     std::vector<std::string> m_columnNames;
-    Buffer m_stringSetBuffer;
+    FramedBuffer m_stringSetBuffer;
+    Buffer m_blockDirectory;
     StringTable m_stringSetHash;
     uint32_t m_readonlySize;
     std::vector<char> m_tempEncodedRow;
 
     friend class Index;
+    friend class TableIterator;
+    friend class TableRange;
 };
 
 
@@ -166,7 +309,7 @@ public:
     explicit Index(const std::string &path);
     explicit Index(Reader *reader);
     ~Index();
-    void write(const std::string &path);
+    void write(const std::string &path, bool compressed=false);
     void write(Writer &writer);
     void merge(const Index &other);
 
@@ -189,16 +332,32 @@ public:
 
 private:
     void init(Reader *reader);
+    void readTableDirectory();
+    void loadAllTables() const;
+    bool hasStringTable(const std::string &name) const;
+    StringTable *findStringTable(const std::string &name) const;
+    Table *findTable(const std::string &name) const;
     void mergeTable(
             Table *destTable,
             Table *srcTable,
             std::map<std::string, std::vector<indexdb::ID> > &idMap);
 
     Reader *m_reader;
-
-    std::map<std::string, StringTable*> m_stringTables;
-    std::map<std::string, Table*> m_tables;
+    uint32_t m_version;
+
+    // In an index with a table directory, the string tables and tables are
+    // loaded on first use.  Until then, the maps hold NULL pointers and the
+    // offset maps hold each table's offset from the start of the index.
+    // Loading is serialized by m_loadMutex, which is NULL for indices that
+    // were not read from a table directory.
+    mutable std::map<std::string, StringTable*> m_stringTables;
+    mutable std::map<std::string, Table*> m_tables;
+    std::map<std::string, uint64_t> m_stringTableOffsets;
+    std::map<std::string, uint64_t> m_tableOffsets;
+    IndexLoadMutex *m_loadMutex;
     std::unordered_set<std::string> m_finalizedStringTables;
+
+    friend class Table;
 };
 
 } // namespace indexdb
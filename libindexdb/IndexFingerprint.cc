@@ -0,0 +1,137 @@
+#include "IndexFingerprint.h"
+
+#include <cassert>
+#include <climits>
+#include <cstring>
+#include <map>
+#include <vector>
+
+#include <MurmurHash3.h>
+
+#include "IndexDb.h"
+#include "StringTable.h"
+
+namespace indexdb {
+
+// A 128-bit hash, as computed by MurmurHash3_x64_128.
+struct FingerprintHash {
+    uint64_t lo;
+    uint64_t hi;
+};
+
+static FingerprintHash fingerprintHash(const void *data, size_t size)
+{
+    assert(size <= INT_MAX);
+    uint64_t out[2];
+    MurmurHash3_x64_128(data, static_cast<int>(size), 0, out);
+    FingerprintHash ret = { out[0], out[1] };
+    return ret;
+}
+
+static FingerprintHash fingerprintHash(const std::string &string)
+{
+    return fingerprintHash(string.data(), string.size());
+}
+
+// The strings of a string table, and the rows of a table, are distinct, so a
+// set of them is hashed by summing the hashes of its members, along with the
+// member count.  The sum does not depend on the order of the members, so
+// nothing needs to be sorted.  It is an additive set hash, not a hash of the
+// sorted members: equal sets always hash equal, but since the sum is linear,
+// colliding sets are easier to construct than colliding member lists.  It is
+// only meant to detect identical entries, not to resist tampering.
+class FingerprintSet {
+public:
+    FingerprintSet() : m_count(0) { m_sum.lo = m_sum.hi = 0; }
+    void add(const FingerprintHash &hash) {
+        m_sum.lo += hash.lo;
+        m_sum.hi += hash.hi;
+        m_count++;
+    }
+    void appendTo(std::vector<uint64_t> &output) const {
+        output.push_back(m_count);
+        output.push_back(m_sum.lo);
+        output.push_back(m_sum.hi);
+    }
+
+private:
+    FingerprintHash m_sum;
+    uint64_t m_count;
+};
+
+std::string indexFingerprint(const Index &index)
+{
+    // The fingerprint is the hash of a summary listing each string table and
+    // table, in name order, with the hash of its content.
+    std::vector<uint64_t> summary;
+    auto appendName = [&](const std::string &name) {
+        const FingerprintHash hash = fingerprintHash(name);
+        summary.push_back(hash.lo);
+        summary.push_back(hash.hi);
+    };
+
+    // The hash of each string, by string table.
+    std::map<std::string, std::vector<FingerprintHash> > stringHashes;
+    for (size_t i = 0; i < index.stringTableCount(); ++i) {
+        const std::string name = index.stringTableName(i);
+        const StringTable *stringTable = index.stringTable(name);
+        std::vector<FingerprintHash> &hashes = stringHashes[name];
+        hashes.resize(stringTable->size());
+        FingerprintSet setHash;
+        for (ID id = 0; id < stringTable->size(); ++id) {
+            hashes[id] = fingerprintHash(stringTable->item(id),
+                                 stringTable->itemSize(id));
+            setHash.add(hashes[id]);
+        }
+        appendName(name);
+        setHash.appendTo(summary);
+    }
+
+    // A row is hashed with each string column replaced by its string's hash.
+    // As in Index::merge, a column refers to the string table of the same
+    // name, if there is one.
+    for (size_t i = 0; i < index.tableCount(); ++i) {
+        const std::string name = index.tableName(i);
+        const Table *table = index.table(name);
+        const int columnCount = table->columnCount();
+        std::vector<const std::vector<FingerprintHash>*> columnStrings(columnCount);
+        appendName(name);
+        for (int column = 0; column < columnCount; ++column) {
+            const std::string columnName = table->columnName(column);
+            auto it = stringHashes.find(columnName);
+            if (it != stringHashes.end())
+                columnStrings[column] = &it->second;
+            appendName(columnName);
+        }
+
+        FingerprintSet setHash;
+        Row row(columnCount);
+        std::vector<FingerprintHash> rowData(columnCount);
+        for (TableIterator it = table->begin(), itEnd = table->end();
+                it != itEnd;
+                ++it) {
+            it.value(row);
+            for (int column = 0; column < columnCount; ++column) {
+                const std::vector<FingerprintHash> *strings = columnStrings[column];
+                if (strings != NULL) {
+                    assert(row[column] < strings->size());
+                    rowData[column] = (*strings)[row[column]];
+                } else {
+                    rowData[column].lo = row[column];
+                    rowData[column].hi = 0;
+                }
+            }
+            setHash.add(fingerprintHash(rowData.data(),
+                                columnCount * sizeof(FingerprintHash)));
+        }
+        setHash.appendTo(summary);
+    }
+
+    const FingerprintHash fingerprint =
+            fingerprintHash(summary.data(), summary.size() * sizeof(uint64_t));
+    char bytes[sizeof(FingerprintHash)];
+    memcpy(bytes, &fingerprint, sizeof(bytes));
+    return std::string(bytes, sizeof(bytes));
+}
+
+} // namespace indexdb
@@ -0,0 +1,19 @@
+#ifndef INDEXDB_INDEXFINGERPRINT_H
+#define INDEXDB_INDEXFINGERPRINT_H
+
+#include <string>
+
+namespace indexdb {
+
+class Index;
+
+// Returns a 128-bit fingerprint of a finalized index's content: the strings of
+// each string table, and the rows of each table with their IDs resolved to
+// strings.  Unlike a hash of the serialized index, the fingerprint does not
+// depend on the IDs assigned to the strings, so two indexes have the same
+// fingerprint if merging either of them inserts the same strings and rows.
+std::string indexFingerprint(const Index &index);
+
+} // namespace indexdb
+
+#endif // INDEXDB_INDEXFINGERPRINT_H
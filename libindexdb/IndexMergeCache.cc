@@ -0,0 +1,88 @@
+#include "IndexMergeCache.h"
+
+#include <cassert>
+#include <cstdio>
+
+#include "FileIo.h"
+#include "IndexArchiveReader.h"
+#include "IndexDb.h"
+#include "IndexMerger.h"
+
+namespace indexdb {
+
+IndexMergeCache::IndexMergeCache(const std::string &path) : m_archive(NULL)
+{
+    FILE *fp = fopen(path.c_str(), "rb");
+    if (fp == NULL)
+        return;
+    fclose(fp);
+    m_archive = new IndexArchiveReader(path);
+    for (int i = 0; i < m_archive->size(); ++i) {
+        const IndexArchiveReader::Entry &entry = m_archive->entry(i);
+        m_keys.insert(Key(entry.name, entry.hash));
+    }
+}
+
+IndexMergeCache::~IndexMergeCache()
+{
+    delete m_archive;
+}
+
+bool IndexMergeCache::contains(
+        const std::string &name,
+        const std::string &hash) const
+{
+    return m_keys.find(Key(name, hash)) != m_keys.end();
+}
+
+// Open the merged index of all of the cached entries.  Returns NULL if the
+// cache is empty.
+Index *IndexMergeCache::open()
+{
+    if (m_keys.empty())
+        return NULL;
+    return m_archive->openEntry(0);
+}
+
+// Write a cache holding the given entries.  The merger must have merged
+// exactly those entries.  The keys' hashes are copied from the entries'
+// archives, which used the given hash.
+void IndexMergeCache::write(
+        const std::string &path,
+        const std::vector<Key> &keys,
+        IndexMerger &merger,
+        ArchiveHash hash,
+        bool compressed)
+{
+    Writer writer(path);
+    writer.writeSignature(kIndexArchiveSignature);
+    writer.writeUInt32(kIndexVersionFlag | kIndexArchiveVersion);
+    writer.writeUInt32(hash);
+    writer.writeUInt32(keys.size());
+    writer.setCompressed(compressed);
+
+    // Write the table-of-contents, and then rewrite it once the index's
+    // offset and length are known.
+    const uint64_t tocOffset = writer.tell();
+    for (const Key &key : keys) {
+        writer.writeString(key.first);
+        writer.writeString(key.second);
+        writer.writeUInt64(0); // Entry offset
+        writer.writeUInt64(0); // Entry length
+    }
+
+    writer.align(kMaxAlign);
+    const uint64_t indexOffset = writer.tell();
+    merger.write(writer);
+    const uint64_t indexLength = writer.tell() - indexOffset;
+
+    writer.seek(tocOffset);
+    for (const Key &key : keys) {
+        writer.writeString(key.first);
+        writer.writeString(key.second);
+        writer.writeUInt64(indexOffset);
+        writer.writeUInt64(indexLength);
+    }
+}
+
+} // namespace indexdb
@@ -0,0 +1,55 @@
+#ifndef INDEXDB_INDEXMERGECACHE_H
+#define INDEXDB_INDEXMERGECACHE_H
+
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "IndexDb.h"
+
+namespace indexdb {
+
+class IndexArchiveReader;
+class IndexMerger;
+
+// A cache of index archive entries that were merged by a previous merge.
+//
+// The cache file is an index archive.  Its table of contents lists the name
+// and hash of each cached entry, and every entry refers to the same index,
+// which is the merge of all of the cached entries.  Merging that index is
+// equivalent to merging each of the cached entries, but each distinct string
+// and row is inserted only once, and the entries themselves are never opened.
+//
+// The cache can stand in for its entries only if every one of them is still
+// being merged.
+class IndexMergeCache
+{
+public:
+    typedef std::pair<std::string, std::string> Key;
+
+    // If the file does not exist, the cache is empty.
+    explicit IndexMergeCache(const std::string &path);
+    ~IndexMergeCache();
+    size_t size() const { return m_keys.size(); }
+    bool contains(const std::string &name, const std::string &hash) const;
+    Index *open();
+
+    static void write(const std::string &path,
+                      const std::vector<Key> &keys,
+                      IndexMerger &merger,
+                      ArchiveHash hash,
+                      bool compressed=false);
+
+    // Disable copying.
+    IndexMergeCache(const IndexMergeCache &other) = delete;
+    IndexMergeCache &operator=(const IndexMergeCache &other) = delete;
+
+private:
+    IndexArchiveReader *m_archive;
+    std::set<Key> m_keys;
+};
+
+} // namespace indexdb
+
+#endif // INDEXDB_INDEXMERGECACHE_H
@@ -0,0 +1,1175 @@
+#include "IndexMerger.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <utility>
+
+#include "Buffer.h"
+#include "FileIo.h"
+#include "FileIo64BitSupport.h"
+#include "IndexDb.h"
+#include "Parallel.h"
+#include "RowEncoding.h"
+#include "Util.h"
+
+namespace indexdb {
+
+// Each sorted run being merged reads at least this many rows at a time.
+const uint64_t kMinRunBufferRows = 1024;
+
+// The number of shards in each merged string table.  It must be a power of
+// two.
+const uint32_t kStringShardCount = 64;
+
+// The owners file written next to an updatable index.
+const char kIndexOwnersSignature[] = "\x7fIOW";
+const uint32_t kIndexOwnersVersion = 1;
+
+class IndexMergerMutex : public std::mutex {};
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Owner count runs
+
+class OwnerCountWriter {
+public:
+    void add(uint32_t count) {
+        if (m_runLength > 0 && count == m_count) {
+            m_runLength++;
+        } else {
+            flush();
+            m_count = count;
+            m_runLength = 1;
+        }
+    }
+
+    Buffer finish() {
+        flush();
+        return std::move(m_runs);
+    }
+
+private:
+    void flush() {
+        if (m_runLength == 0)
+            return;
+        char encoded[10];
+        char *end = encoded;
+        writeVleUInt32(end, m_count);
+        writeVleUInt32(end, m_runLength);
+        m_runs.append(encoded, end - encoded);
+        m_runLength = 0;
+    }
+
+    Buffer m_runs;
+    uint32_t m_count = 0;
+    uint32_t m_runLength = 0;
+};
+
+class OwnerCountReader {
+public:
+    explicit OwnerCountReader(const Buffer &runs) :
+        m_next(static_cast<const char*>(runs.data())),
+        m_end(m_next + runs.size()) {}
+
+    uint32_t next() {
+        if (m_runLength == 0) {
+            assert(m_next < m_end && "Owner counts are truncated");
+            m_count = readVleUInt32(m_next);
+            m_runLength = readVleUInt32(m_next);
+        }
+        m_runLength--;
+        return m_count;
+    }
+
+private:
+    const char *m_next;
+    const char *m_end;
+    uint32_t m_count = 0;
+    uint32_t m_runLength = 0;
+};
+
+static bool ownerCountsMatch(const Buffer &runs, uint64_t size)
+{
+    const char *next = static_cast<const char*>(runs.data());
+    const char *end = next + runs.size();
+    uint64_t total = 0;
+    while (next < end) {
+        readVleUInt32(next);
+        total += readVleUInt32(next);
+    }
+    return next == end && total == size;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// IndexMerger::TempFile
+
+// An anonymous temporary file, which is deleted when it is closed.  Data is
+// appended to the end of the file and read back at arbitrary offsets.
+class IndexMerger::TempFile {
+public:
+    TempFile() : m_fp(tmpfile()), m_size(0) {
+        checkIo(m_fp != NULL, "tmpfile");
+    }
+
+    ~TempFile() {
+        fclose(m_fp);
+    }
+
+    uint64_t size() const { return m_size; }
+
+    void append(const void *data, size_t size) {
+        if (size == 0)
+            return;
+        if (!m_appending) {
+            Seek64(m_fp, m_size, SEEK_SET);
+            m_appending = true;
+        }
+        checkIo(fwrite(data, 1, size, m_fp) == size, "temporary file write");
+        m_size += size;
+    }
+
+    void read(uint64_t offset, void *output, size_t size) {
+        assert(offset + size <= m_size);
+        Seek64(m_fp, offset, SEEK_SET);
+        m_appending = false;
+        checkIo(fread(output, 1, size, m_fp) == size, "temporary file read");
+    }
+
+    // Position the file at the given offset and return it for reading.
+    FILE *fileAt(uint64_t offset) {
+        Seek64(m_fp, offset, SEEK_SET);
+        m_appending = false;
+        return m_fp;
+    }
+
+private:
+    FILE *m_fp;
+    uint64_t m_size;
+    bool m_appending = false;
+};
+
+
+///////////////////////////////////////////////////////////////////////////////
+// IndexMerger::MergeStringTable
+
+// A merged string table that several threads can add strings to at once.  Its
+// strings are distributed among kStringShardCount shards by hash, and each
+// shard has its own lock.  A string's merged ID is its ID within its shard
+// times kStringShardCount plus the shard number.
+//
+// When owners are counted, each string's count is adjusted by ownerDelta
+// every time a merged table contains it.
+class IndexMerger::MergeStringTable {
+public:
+    void insert(const StringTable &source, std::vector<ID> &idMap,
+                ID ownerDelta);
+    std::pair<StringTable, std::vector<ID> > finalized(std::vector<ID> *owners);
+
+private:
+    struct Shard {
+        std::mutex mutex;
+        StringTable strings;
+        std::vector<ID> owners;
+    };
+
+    static uint32_t shardOf(uint32_t hash) {
+        return (hash >> 24) & (kStringShardCount - 1);
+    }
+
+    Shard m_shards[kStringShardCount];
+};
+
+// Add the strings of a table to the merged table, and set idMap to the
+// merged ID of each of its strings.  Each shard is locked once.
+void IndexMerger::MergeStringTable::insert(
+        const StringTable &source,
+        std::vector<ID> &idMap,
+        ID ownerDelta)
+{
+    const uint32_t size = source.size();
+    std::vector<uint32_t> shardStart(kStringShardCount + 1);
+    for (ID id = 0; id < size; ++id)
+        shardStart[shardOf(source.itemHash(id)) + 1]++;
+    for (uint32_t shard = 0; shard < kStringShardCount; ++shard)
+        shardStart[shard + 1] += shardStart[shard];
+    std::vector<ID> byShard(size);
+    {
+        std::vector<uint32_t> next(shardStart.begin(), shardStart.end() - 1);
+        for (ID id = 0; id < size; ++id)
+            byShard[next[shardOf(source.itemHash(id))]++] = id;
+    }
+
+    idMap.resize(size);
+    for (uint32_t shard = 0; shard < kStringShardCount; ++shard) {
+        if (shardStart[shard] == shardStart[shard + 1])
+            continue;
+        std::lock_guard<std::mutex> lock(m_shards[shard].mutex);
+        StringTable &strings = m_shards[shard].strings;
+        for (uint32_t i = shardStart[shard]; i < shardStart[shard + 1]; ++i) {
+            const ID id = byShard[i];
+            const ID shardID = strings.insert(
+                        source.item(id), source.itemSize(id),
+                        source.itemHash(id));
+            assert(shardID < (kInvalidID - shard) / kStringShardCount);
+            idMap[id] = shardID * kStringShardCount + shard;
+            if (ownerDelta != 0) {
+                std::vector<ID> &owners = m_shards[shard].owners;
+                if (shardID == owners.size())
+                    owners.push_back(0);
+                owners[shardID] += ownerDelta;
+            }
+        }
+    }
+}
+
+// Combine the shards into a sorted string table.  The returned vector maps
+// each merged ID to its sorted ID.  If owners is not NULL, it is set to the
+// owner count of each sorted string.  No other thread may use the table.
+std::pair<StringTable, std::vector<ID> >
+IndexMerger::MergeStringTable::finalized(std::vector<ID> *owners)
+{
+    std::vector<StringTable*> shards;
+    std::vector<ID> shardOffset(kStringShardCount);
+    uint32_t maxShardSize = 0;
+    ID offset = 0;
+    for (uint32_t shard = 0; shard < kStringShardCount; ++shard) {
+        StringTable &strings = m_shards[shard].strings;
+        shards.push_back(&strings);
+        shardOffset[shard] = offset;
+        offset += strings.size();
+        maxShardSize = std::max(maxShardSize, strings.size());
+    }
+
+    StringTable combined;
+    combined.appendDistinct(shards);
+    std::pair<StringTable, std::vector<ID> > ret = combined.finalized();
+    const std::vector<ID> &combinedMap = ret.second;
+
+    std::vector<ID> idMap(static_cast<size_t>(maxShardSize) * kStringShardCount,
+                          kInvalidID);
+    if (owners != NULL)
+        owners->assign(combinedMap.size(), 0);
+    for (uint32_t shard = 0; shard < kStringShardCount; ++shard) {
+        const ID end = (shard + 1 < kStringShardCount) ?
+                    shardOffset[shard + 1] : combinedMap.size();
+        for (ID id = shardOffset[shard]; id < end; ++id) {
+            const ID shardID = id - shardOffset[shard];
+            idMap[shardID * kStringShardCount + shard] = combinedMap[id];
+            if (owners != NULL)
+                (*owners)[combinedMap[id]] = m_shards[shard].owners[shardID];
+        }
+        m_shards[shard].owners = std::vector<ID>();
+    }
+    ret.second = std::move(idMap);
+    return ret;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// IndexMerger::MergeTable
+
+struct IndexMerger::MergeTable {
+    explicit MergeTable(int workerCount) :
+        rows(workerCount), spills(workerCount) {}
+
+    std::vector<std::string> columnNames;
+
+    // A derived table's rows are produced from its source table's merged
+    // rows.  Column i of a derived row is column sourceColumns[i] of the
+    // source row.
+    std::string sourceName;
+    std::vector<int> sourceColumns;
+    std::vector<MergeTable*> derivedTables;
+
+    // Rows that have not been encoded yet, buffered and spilled separately
+    // by each worker.  They are in merged string IDs (or sorted string IDs,
+    // for a derived table), in no particular order.  When owners are counted,
+    // each row ends with an extra column holding the change to its count.
+    bool counted = false;
+    std::vector<std::vector<ID> > rows;
+    std::vector<std::unique_ptr<TempFile> > spills;
+
+    // The encoded rows and their block directory, in the read-only table
+    // format.
+    uint32_t rowCount = 0;
+    std::unique_ptr<TempFile> encodedRows;
+    std::vector<uint32_t> blockDirectory;
+
+    uint32_t columnCount() const { return columnNames.size(); }
+    uint32_t rowWidth() const { return columnCount() + (counted ? 1 : 0); }
+    bool isDerived() const { return !sourceName.empty(); }
+};
+
+
+// The string ID mappings used while the merged index is written.  Without a
+// base index, the merged IDs are mapped directly to the IDs of the written
+// string tables, and the other maps are empty.
+struct IndexMerger::StringIdMaps {
+    std::map<std::string, std::vector<ID> > merged;
+    std::map<std::string, std::vector<ID> > base;
+    std::map<std::string, std::vector<ID> > output;
+};
+
+
+///////////////////////////////////////////////////////////////////////////////
+// IndexMerger
+
+IndexMerger::IndexMerger(uint64_t memoryBudget, int workerCount) :
+    m_memoryBudget(memoryBudget),
+    m_workerCount(workerCount),
+    m_workerBufferLimit(memoryBudget / workerCount),
+    m_workerBufferedBytes(workerCount),
+    m_mutex(new IndexMergerMutex),
+    m_countOwners(false),
+    m_base(NULL)
+{
+    assert(memoryBudget > 0);
+    assert(workerCount >= 1);
+}
+
+IndexMerger::~IndexMerger()
+{
+    for (const auto &pair : m_stringTables)
+        delete pair.second;
+    for (const auto &pair : m_tables)
+        delete pair.second;
+    delete m_mutex;
+    delete m_base;
+}
+
+// Count the owners of each string and row, so that the merged index can be
+// updated later.  It must be called before anything is merged.
+void IndexMerger::countOwners()
+{
+    assert(m_stringTables.empty() && m_tables.empty());
+    m_countOwners = true;
+}
+
+// Start from an index written by an earlier merge that counted owners.  The
+// indices it contains must not be merged again, but they may be unmerged.
+// Returns false, leaving the merger unchanged, if the owners file is missing
+// or does not match the index.
+bool IndexMerger::setBase(
+        const std::string &indexPath,
+        const std::string &ownersPath)
+{
+    assert(m_countOwners && m_base == NULL);
+    assert(m_stringTables.empty() && m_tables.empty());
+
+    FILE *fp = fopen(ownersPath.c_str(), "rb");
+    if (fp == NULL)
+        return false;
+    fclose(fp);
+    fp = fopen(indexPath.c_str(), "rb");
+    if (fp == NULL)
+        return false;
+    fclose(fp);
+
+    std::map<std::string, OwnerCounts> stringOwners;
+    std::map<std::string, OwnerCounts> tableOwners;
+    {
+        UnmappedReader reader(ownersPath);
+        if (!reader.peekSignature(kIndexOwnersSignature))
+            return false;
+        reader.readSignature(kIndexOwnersSignature);
+        if (reader.readUInt32() != kIndexOwnersVersion)
+            return false;
+        for (auto *owners : { &stringOwners, &tableOwners }) {
+            const uint32_t count = reader.readUInt32();
+            for (uint32_t i = 0; i < count; ++i) {
+                OwnerCounts &counts = (*owners)[reader.readString()];
+                counts.size = reader.readUInt32();
+                counts.runs = reader.readBuffer();
+            }
+        }
+    }
+
+    std::unique_ptr<Index> base(new Index(indexPath));
+    for (const auto &pair : stringOwners) {
+        const StringTable *strings = base->stringTable(pair.first);
+        if (strings == NULL || strings->size() != pair.second.size ||
+                !ownerCountsMatch(pair.second.runs, pair.second.size))
+            return false;
+    }
+    for (const auto &pair : tableOwners) {
+        const Table *table = base->table(pair.first);
+        if (table == NULL || table->size() != pair.second.size ||
+                !ownerCountsMatch(pair.second.runs, pair.second.size))
+            return false;
+    }
+    if (stringOwners.size() != base->stringTableCount())
+        return false;
+
+    // Every base table is merged again.  The base tables without owner
+    // counts must be declared as derived tables.
+    for (size_t i = 0; i < base->stringTableCount(); ++i)
+        addStringTable(base->stringTableName(i));
+    for (size_t i = 0; i < base->tableCount(); ++i) {
+        const std::string name = base->tableName(i);
+        const Table *table = base->table(name);
+        std::vector<std::string> columnNames;
+        for (int column = 0; column < table->columnCount(); ++column)
+            columnNames.push_back(table->columnName(column));
+        addTable(name, columnNames);
+    }
+    m_base = base.release();
+    m_baseStringOwners = std::move(stringOwners);
+    m_baseTableOwners = std::move(tableOwners);
+    return true;
+}
+
+// Return the merged string table with the given name, creating it if it does
+// not exist.
+IndexMerger::MergeStringTable *IndexMerger::addStringTable(
+        const std::string &name)
+{
+    std::lock_guard<std::mutex> lock(*m_mutex);
+    MergeStringTable *&stringTable = m_stringTables[name];
+    if (stringTable == NULL)
+        stringTable = new MergeStringTable;
+    return stringTable;
+}
+
+IndexMerger::MergeTable *IndexMerger::addTable(
+        const std::string &name,
+        const std::vector<std::string> &columnNames)
+{
+    for (const std::string &columnName : columnNames) {
+        if (!columnName.empty())
+            addStringTable(columnName);
+    }
+    std::lock_guard<std::mutex> lock(*m_mutex);
+    auto it = m_tables.find(name);
+    if (it != m_tables.end()) {
+        assert(it->second->columnNames == columnNames);
+        return it->second;
+    }
+    assert(columnNames.size() >= 1);
+    assert(columnNames.size() <= static_cast<size_t>(kMaxTableColumns));
+    MergeTable *table = new MergeTable(m_workerCount);
+    table->columnNames = columnNames;
+    table->counted = m_countOwners;
+    m_tables[name] = table;
+    return table;
+}
+
+// Merge the string tables and tables of another index, which must have been
+// finalized.  As with Index::merge, tables are created if they do not exist,
+// and a table must have the same columns in every merged index.  Different
+// workers may call this method at the same time.
+void IndexMerger::merge(const Index &other, int worker)
+{
+    mergeIndex(other, worker, 1);
+}
+
+// Remove an index that the base index contains.  Its strings and rows are
+// kept if another merged index still contains them.
+void IndexMerger::unmerge(const Index &other, int worker)
+{
+    assert(m_base != NULL);
+    mergeIndex(other, worker, static_cast<ID>(-1));
+}
+
+// Add the strings and rows of an index, adjusting their owner counts by
+// ownerDelta if owners are counted.
+void IndexMerger::mergeIndex(const Index &other, int worker, ID ownerDelta)
+{
+    assert(worker >= 0 && worker < m_workerCount);
+    if (!m_countOwners)
+        ownerDelta = 0;
+    std::map<std::string, std::vector<ID> > idMap;
+    for (size_t i = 0; i < other.stringTableCount(); ++i) {
+        const std::string name = other.stringTableName(i);
+        addStringTable(name)->insert(*other.stringTable(name), idMap[name],
+                                     ownerDelta);
+    }
+
+    for (size_t i = 0; i < other.tableCount(); ++i) {
+        const std::string name = other.tableName(i);
+        const Table *srcTable = other.table(name);
+        std::vector<std::string> columnNames;
+        for (int column = 0; column < srcTable->columnCount(); ++column)
+            columnNames.push_back(srcTable->columnName(column));
+        MergeTable *destTable = addTable(name, columnNames);
+        assert(!destTable->isDerived());
+
+        const int columnCount = srcTable->columnCount();
+        std::vector<const std::vector<ID>*> tableIdMap(columnCount);
+        for (int column = 0; column < columnCount; ++column) {
+            if (!columnNames[column].empty())
+                tableIdMap[column] = &idMap.at(columnNames[column]);
+        }
+
+        Row row(columnCount);
+        std::vector<ID> values(destTable->rowWidth(), ownerDelta);
+        for (TableIterator it = srcTable->begin(), itEnd = srcTable->end();
+                it != itEnd;
+                ++it) {
+            it.value(row);
+            for (int column = 0; column < columnCount; ++column) {
+                const std::vector<ID> *map = tableIdMap[column];
+                values[column] = (map != NULL) ? (*map)[row[column]] :
+                                                 row[column];
+            }
+            addRows(destTable, worker, values.data(), 1);
+        }
+    }
+}
+
+// Add a table whose rows are the merged rows of another table with their
+// columns rearranged, such as an inverted index of the source table.  The
+// source table must already exist, and no merged index may have a table with
+// the derived table's name.  The base index may have it, and its rows are
+// updated along with the source table's rows.
+void IndexMerger::addDerivedTable(
+        const std::string &name,
+        const std::string &sourceName,
+        const std::vector<int> &sourceColumns)
+{
+    const MergeTable *source;
+    {
+        std::lock_guard<std::mutex> lock(*m_mutex);
+        assert(m_tables.find(name) == m_tables.end() ||
+               (m_base != NULL && m_base->table(name) != NULL &&
+                m_baseTableOwners.find(name) == m_baseTableOwners.end()));
+        auto it = m_tables.find(sourceName);
+        assert(it != m_tables.end() && !it->second->isDerived());
+        source = it->second;
+    }
+    std::vector<std::string> columnNames;
+    for (int column : sourceColumns) {
+        assert(column >= 0 &&
+               column < static_cast<int>(source->columnCount()));
+        columnNames.push_back(source->columnNames[column]);
+    }
+    MergeTable *table = addTable(name, columnNames);
+    table->sourceName = sourceName;
+    table->sourceColumns = sourceColumns;
+}
+
+void IndexMerger::addRows(
+        MergeTable *table,
+        int worker,
+        const ID *rows,
+        uint64_t rowCount)
+{
+    const uint64_t count = rowCount * table->rowWidth();
+    std::vector<ID> &buffer = table->rows[worker];
+    buffer.insert(buffer.end(), rows, rows + count);
+    m_workerBufferedBytes[worker] += count * sizeof(ID);
+    if (m_workerBufferedBytes[worker] > m_workerBufferLimit)
+        spillRows(worker);
+}
+
+// Move a worker's buffered rows to its spill files.
+void IndexMerger::spillRows(int worker)
+{
+    std::vector<MergeTable*> tables;
+    {
+        std::lock_guard<std::mutex> lock(*m_mutex);
+        for (const auto &pair : m_tables)
+            tables.push_back(pair.second);
+    }
+    for (MergeTable *table : tables) {
+        std::vector<ID> &buffer = table->rows[worker];
+        if (buffer.empty())
+            continue;
+        std::unique_ptr<TempFile> &spill = table->spills[worker];
+        if (spill == NULL)
+            spill.reset(new TempFile);
+        spill->append(buffer.data(), buffer.size() * sizeof(ID));
+        buffer = std::vector<ID>();
+    }
+    m_workerBufferedBytes[worker] = 0;
+}
+
+// Write the merged index.  The string tables are sorted, and then each
+// table's rows are remapped to the sorted string IDs, sorted, deduplicated,
+// and encoded into a temporary file.  Finally, the index is written with the
+// same layout as Index::write.  No merges may be in progress.
+void IndexMerger::write(const std::string &path, bool compressed)
+{
+    Writer writer(path);
+    writer.setCompressed(compressed);
+    write(writer);
+}
+
+// Write the merged index in the same layout as Index::write.
+void IndexMerger::write(Writer &writer)
+{
+    // Sort the string tables.  With a base index, the sorted changes are
+    // combined with the base index's strings.
+    StringIdMaps idMaps;
+    std::map<std::string, StringTable> stringTables;
+    for (const auto &pair : m_stringTables) {
+        std::vector<ID> owners;
+        std::pair<StringTable, std::vector<ID> > finalized =
+                pair.second->finalized(m_countOwners ? &owners : NULL);
+        std::vector<ID> &idMap = idMaps.merged[pair.first];
+        idMap = std::move(finalized.second);
+        if (m_base != NULL) {
+            finalized.first = rebaseStringTable(
+                        pair.first, finalized.first, owners, idMap,
+                        idMaps.base[pair.first], idMaps.output[pair.first]);
+        } else if (m_countOwners) {
+            OwnerCountWriter counts;
+            for (ID count : owners)
+                counts.add(count);
+            OwnerCounts &stringOwners = m_stringOwners[pair.first];
+            stringOwners.size = owners.size();
+            stringOwners.runs = counts.finish();
+        }
+        stringTables.insert(std::make_pair(pair.first,
+                                           std::move(finalized.first)));
+    }
+
+    // Half of the budget is used to sort and merge the rows, and the other
+    // half buffers the rows of the derived tables, which are all added by
+    // worker 0.  Buffered rows that do not fit are spilled first.
+    uint64_t bufferedBytes = 0;
+    for (int worker = 0; worker < m_workerCount; ++worker)
+        bufferedBytes += m_workerBufferedBytes[worker];
+    m_workerBufferLimit = m_memoryBudget / 2;
+    if (bufferedBytes > m_workerBufferLimit) {
+        for (int worker = 0; worker < m_workerCount; ++worker)
+            spillRows(worker);
+    }
+
+    for (const auto &pair : m_tables) {
+        MergeTable *table = pair.second;
+        if (table->isDerived())
+            m_tables.at(table->sourceName)->derivedTables.push_back(table);
+    }
+    for (const auto &pair : m_tables) {
+        if (!pair.second->isDerived())
+            encodeTable(pair.first, pair.second, idMaps);
+    }
+    for (const auto &pair : m_tables) {
+        if (pair.second->isDerived())
+            encodeTable(pair.first, pair.second, idMaps);
+    }
+
+    const uint64_t start = writer.tell();
+    std::vector<uint64_t> stringTableOffsets;
+    std::vector<uint64_t> tableOffsets;
+
+    writer.writeSignature(kIndexSignature);
+    writer.writeUInt32(kIndexVersionFlag | kIndexVersion);
+    for (auto &pair : stringTables) {
+        writer.align(kMaxAlign);
+        stringTableOffsets.push_back(writer.tell() - start);
+        pair.second.write(writer);
+    }
+    for (const auto &pair : m_tables) {
+        writer.align(kMaxAlign);
+        tableOffsets.push_back(writer.tell() - start);
+        writeTable(writer, pair.second);
+    }
+
+    writer.align(kMaxAlign);
+    const uint64_t directoryOffset = writer.tell() - start;
+    size_t i = 0;
+    writer.writeUInt32(stringTables.size());
+    for (const auto &pair : stringTables) {
+        writer.writeString(pair.first);
+        writer.writeUInt64(stringTableOffsets[i++]);
+    }
+    i = 0;
+    writer.writeUInt32(m_tables.size());
+    for (const auto &pair : m_tables) {
+        writer.writeString(pair.first);
+        writer.writeUInt64(tableOffsets[i++]);
+    }
+    writer.writeUInt64(directoryOffset);
+}
+
+// Combine the sorted changes to a string table with the base index's strings.
+// Each base string's owner count is adjusted by the change's count, and the
+// strings whose count drops to zero are removed.  The rows are joined using
+// the IDs of the union of the base and changed strings, which sort the same
+// way as the IDs of both, and then they are written using the IDs of the
+// returned table.
+//
+// Both tables are already sorted, so the union is found with one linear
+// merge of the two, which also drops the removed strings.  The strings are
+// neither hashed nor sorted again.
+//
+// On return, changeIdMap maps merged IDs to union IDs, baseIdMap maps base IDs
+// to union IDs, and outputIdMap maps union IDs to the returned table's IDs.
+// outputIdMap is left empty if no string was removed.
+StringTable IndexMerger::rebaseStringTable(
+        const std::string &name,
+        const StringTable &changes,
+        const std::vector<ID> &changeOwners,
+        std::vector<ID> &changeIdMap,
+        std::vector<ID> &baseIdMap,
+        std::vector<ID> &outputIdMap)
+{
+    const StringTable *base = m_base->stringTable(name);
+    const uint32_t baseSize = (base != NULL) ? base->size() : 0;
+    const uint32_t changeSize = changes.size();
+    const Buffer noOwners;
+    OwnerCountReader baseOwners(
+                (baseSize > 0) ? m_baseStringOwners.at(name).runs : noOwners);
+
+    std::vector<std::pair<const StringTable*, ID> > kept;
+    std::vector<ID> changeToUnion(changeSize);
+    OwnerCountWriter counts;
+    baseIdMap.resize(baseSize);
+    outputIdMap.clear();
+    ID baseID = 0;
+    ID changeID = 0;
+    for (ID unionID = 0; baseID < baseSize || changeID < changeSize;
+            ++unionID) {
+        int cmp;
+        if (baseID == baseSize)
+            cmp = 1;
+        else if (changeID == changeSize)
+            cmp = -1;
+        else
+            cmp = strcmp(base->item(baseID), changes.item(changeID));
+
+        std::pair<const StringTable*, ID> item;
+        ID count = 0;
+        if (cmp <= 0) {
+            item = std::make_pair(base, baseID);
+            count += baseOwners.next();
+            baseIdMap[baseID++] = unionID;
+        }
+        if (cmp >= 0) {
+            item = std::make_pair(&changes, changeID);
+            count += changeOwners[changeID];
+            changeToUnion[changeID++] = unionID;
+        }
+        assert(static_cast<int32_t>(count) >= 0 &&
+               "A string was unmerged more often than it was merged");
+        outputIdMap.push_back((count != 0) ? kept.size() : kInvalidID);
+        if (count != 0) {
+            kept.push_back(item);
+            counts.add(count);
+        }
+    }
+    if (kept.size() == outputIdMap.size())
+        outputIdMap.clear();
+
+    for (ID &id : changeIdMap) {
+        if (id != kInvalidID)
+            id = changeToUnion[id];
+    }
+
+    OwnerCounts &stringOwners = m_stringOwners[name];
+    stringOwners.size = kept.size();
+    stringOwners.runs = counts.finish();
+    return StringTable::fromSortedItems(kept);
+}
+
+// Encode a table's rows in the read-only table format.
+//
+// The unencoded rows are read in chunks that fit in half of the memory
+// budget.  Each chunk is remapped to the sorted string IDs, sorted, and
+// deduplicated.  If there is more than one chunk, each is written to a
+// temporary file as a sorted run, and the runs are k-way merged.  The merged
+// rows are packed into blocks exactly as Table::encodeBlocks packs them, and
+// they are also passed to the table's derived tables.
+//
+// When owners are counted, equal rows are combined by adding up their count
+// changes.  With a base index, the sorted changes are joined with the base
+// table's rows, which are already sorted once they are remapped to the union
+// string IDs.  A row is written if its count is positive, and a derived table
+// receives a change whenever a row appears or disappears.
+void IndexMerger::encodeTable(
+        const std::string &name,
+        MergeTable *table,
+        const StringIdMaps &idMaps)
+{
+    const uint32_t columnCount = table->columnCount();
+    const uint32_t rowWidth = table->rowWidth();
+    const uint64_t rowBytes = rowWidth * sizeof(ID);
+    const uint64_t workingBytes = m_memoryBudget - m_workerBufferLimit;
+
+    // A derived table's rows already use the sorted (or union) string IDs.
+    std::vector<const std::vector<ID>*> tableIdMap(columnCount);
+    std::vector<const std::vector<ID>*> baseIdMap(columnCount);
+    std::vector<const std::vector<ID>*> outputIdMap(columnCount);
+    for (uint32_t column = 0; column < columnCount; ++column) {
+        const std::string &columnName = table->columnNames[column];
+        if (columnName.empty())
+            continue;
+        if (!table->isDerived())
+            tableIdMap[column] = &idMaps.merged.at(columnName);
+        if (m_base != NULL) {
+            baseIdMap[column] = &idMaps.base.at(columnName);
+            const std::vector<ID> &map = idMaps.output.at(columnName);
+            if (!map.empty())
+                outputIdMap[column] = &map;
+        }
+    }
+
+    // Encode the merged rows into blocks.
+    table->encodedRows.reset(new TempFile);
+    const std::vector<ID> zeroRow(columnCount);
+    std::vector<ID> previousRow(columnCount);
+    std::vector<char> encodedRow(maxEncodedRowSize(columnCount) + 1);
+    const std::vector<char> padding(kTableBlockSize);
+    uint64_t encodedSize = 0;
+    uint64_t rowCount = 0;
+    auto emitRow = [&](const ID *row) -> bool {
+        if (rowCount > 0 &&
+                std::equal(row, row + columnCount, previousRow.begin()))
+            return false;
+        uint32_t blockOffset = encodedSize % kTableBlockSize;
+        size_t encodedLength = encodeDeltaRow(
+                    row, previousRow.data(), columnCount, encodedRow.data());
+        if (blockOffset != 0 && blockOffset + encodedLength > kTableBlockSize) {
+            table->encodedRows->append(padding.data(),
+                                       kTableBlockSize - blockOffset);
+            encodedSize += kTableBlockSize - blockOffset;
+            blockOffset = 0;
+        }
+        if (blockOffset == 0) {
+            // The first row of a block is encoded against a row of zeros.
+            encodedLength = encodeDeltaRow(
+                        row, zeroRow.data(), columnCount, encodedRow.data());
+            for (uint32_t column = 0; column < columnCount; ++column)
+                table->blockDirectory.push_back(HostToLE32(row[column]));
+        }
+        table->encodedRows->append(encodedRow.data(), encodedLength);
+        encodedSize += encodedLength;
+        std::copy(row, row + columnCount, previousRow.begin());
+        rowCount++;
+        return true;
+    };
+
+    std::vector<ID> derivedRow;
+    auto addDerivedRows = [&](const ID *row, ID ownerDelta) {
+        for (MergeTable *derived : table->derivedTables) {
+            derivedRow.resize(derived->rowWidth());
+            for (uint32_t column = 0; column < derived->columnCount();
+                    ++column) {
+                derivedRow[column] = row[derived->sourceColumns[column]];
+            }
+            if (derived->counted)
+                derivedRow[derived->columnCount()] = ownerDelta;
+            addRows(derived, 0, derivedRow.data(), 1);
+        }
+    };
+
+    // The base table's rows, remapped to the union string IDs, are read in
+    // batches along with their owner counts.  A derived table's rows each
+    // have one owner, the source row.
+    const Table *baseTable = (m_base != NULL) ? m_base->table(name) : NULL;
+    std::unique_ptr<OwnerCountReader> baseOwners;
+    if (baseTable != NULL && !table->isDerived()) {
+        assert(m_baseTableOwners.find(name) != m_baseTableOwners.end() &&
+               "A base table without owner counts must be a derived table");
+        baseOwners.reset(new OwnerCountReader(
+                             m_baseTableOwners.at(name).runs));
+    }
+    std::unique_ptr<TableIterator> baseIt;
+    std::unique_ptr<TableIterator> baseEnd;
+    if (baseTable != NULL) {
+        baseIt.reset(new TableIterator(baseTable->begin()));
+        baseEnd.reset(new TableIterator(baseTable->end()));
+    }
+    Row baseValues(columnCount);
+    std::vector<ID> baseRow(columnCount);
+    uint32_t baseCount = 0;
+    bool hasBaseRow = false;
+    auto nextBaseRow = [&]() {
+        hasBaseRow = baseIt != NULL && *baseIt != *baseEnd;
+        if (!hasBaseRow)
+            return;
+        baseIt->value(baseValues);
+        ++*baseIt;
+        for (uint32_t column = 0; column < columnCount; ++column) {
+            const std::vector<ID> *map = baseIdMap[column];
+            baseRow[column] = (map != NULL) ? (*map)[baseValues[column]] :
+                                              baseValues[column];
+        }
+        baseCount = (baseOwners != NULL) ? baseOwners->next() : 1;
+    };
+    nextBaseRow();
+
+    OwnerCountWriter owners;
+    std::vector<ID> outputRow(columnCount);
+    auto keepRow = [&](const ID *row, uint32_t oldCount, uint32_t newCount) {
+        assert(static_cast<int32_t>(newCount) >= 0 &&
+               "A row was unmerged more often than it was merged");
+        if (newCount > 0) {
+            for (uint32_t column = 0; column < columnCount; ++column) {
+                const std::vector<ID> *map = outputIdMap[column];
+                outputRow[column] = (map != NULL) ? (*map)[row[column]] :
+                                                    row[column];
+            }
+            emitRow(outputRow.data());
+            owners.add(newCount);
+        }
+        const int change = (newCount > 0) - (oldCount > 0);
+        if (change != 0)
+            addDerivedRows(row, static_cast<ID>(change));
+    };
+
+    // Take the sorted rows.  Without owner counts, duplicates are dropped.
+    // Otherwise, a row is held until the next different row arrives, and then
+    // it is joined with the base rows.
+    std::vector<ID> pendingRow(columnCount);
+    ID pendingCount = 0;
+    bool hasPendingRow = false;
+    auto flushPendingRow = [&]() {
+        if (!hasPendingRow)
+            return;
+        hasPendingRow = false;
+        while (hasBaseRow && std::lexicographical_compare(
+                   baseRow.begin(), baseRow.end(),
+                   pendingRow.begin(), pendingRow.end())) {
+            keepRow(baseRow.data(), baseCount, baseCount);
+            nextBaseRow();
+        }
+        uint32_t oldCount = 0;
+        if (hasBaseRow && baseRow == pendingRow) {
+            oldCount = baseCount;
+            nextBaseRow();
+        }
+        keepRow(pendingRow.data(), oldCount, oldCount + pendingCount);
+    };
+    auto takeRow = [&](const ID *row) {
+        if (!table->counted) {
+            if (emitRow(row))
+                addDerivedRows(row, 0);
+            return;
+        }
+        if (hasPendingRow &&
+                std::equal(row, row + columnCount, pendingRow.begin())) {
+            pendingCount += row[columnCount];
+            return;
+        }
+        flushPendingRow();
+        std::copy(row, row + columnCount, pendingRow.begin());
+        pendingCount = row[columnCount];
+        hasPendingRow = true;
+    };
+
+    // Split the rows into chunks, and sort each chunk.  The buffered rows
+    // start the first chunk, unless there are too many of them.
+    const uint64_t chunkRows = std::min<uint64_t>(
+                0xFFFFFFFFu,
+                std::max<uint64_t>(1, workingBytes / (rowBytes + sizeof(uint32_t))));
+    uint64_t bufferedRows = 0;
+    for (const std::vector<ID> &buffer : table->rows)
+        bufferedRows += buffer.size() / rowWidth;
+    if (bufferedRows > chunkRows) {
+        for (int worker = 0; worker < m_workerCount; ++worker)
+            spillRows(worker);
+    }
+    std::vector<ID> chunk;
+    for (int worker = 0; worker < m_workerCount; ++worker) {
+        std::vector<ID> &buffer = table->rows[worker];
+        m_workerBufferedBytes[worker] -= buffer.size() * sizeof(ID);
+        if (chunk.empty())
+            chunk.swap(buffer);
+        else
+            chunk.insert(chunk.end(), buffer.begin(), buffer.end());
+        buffer = std::vector<ID>();
+    }
+
+    // The spilled rows are read from each worker's spill file in turn.
+    std::vector<TempFile*> spills;
+    uint64_t spilledRows = 0;
+    for (const std::unique_ptr<TempFile> &spill : table->spills) {
+        if (spill != NULL) {
+            spills.push_back(spill.get());
+            spilledRows += spill->size() / rowBytes;
+        }
+    }
+    size_t spillIndex = 0;
+    uint64_t spillRow = 0;
+
+    std::unique_ptr<TempFile> runs;
+    std::vector<uint64_t> runStarts;
+    uint64_t nextSpilledRow = 0;
+    bool firstChunk = true;
+    while (firstChunk || nextSpilledRow < spilledRows) {
+        if (!firstChunk)
+            chunk.clear();
+        firstChunk = false;
+        uint64_t chunkRowCount = chunk.size() / rowWidth;
+        while (chunkRowCount < chunkRows && nextSpilledRow < spilledRows) {
+            TempFile *spill = spills[spillIndex];
+            const uint64_t readRows = std::min<uint64_t>(
+                        chunkRows - chunkRowCount,
+                        spill->size() / rowBytes - spillRow);
+            chunk.resize((chunkRowCount + readRows) * rowWidth);
+            spill->read(spillRow * rowBytes, &chunk[chunkRowCount * rowWidth],
+                        readRows * rowBytes);
+            chunkRowCount += readRows;
+            nextSpilledRow += readRows;
+            spillRow += readRows;
+            if (spillRow == spill->size() / rowBytes) {
+                spillIndex++;
+                spillRow = 0;
+            }
+        }
+
+        parallelFor(chunkRowCount, [&](size_t begin, size_t end, int worker) {
+            for (size_t row = begin; row < end; ++row) {
+                ID *values = &chunk[row * rowWidth];
+                for (uint32_t column = 0; column < columnCount; ++column) {
+                    const std::vector<ID> *map = tableIdMap[column];
+                    if (map != NULL)
+                        values[column] = (*map)[values[column]];
+                }
+            }
+        });
+        const std::vector<uint32_t> sortedRows =
+                sortRows(chunk, chunkRowCount, rowWidth);
+
+        if (runs == NULL && nextSpilledRow == spilledRows) {
+            // The rows fit in a single chunk, so they need not be merged.
+            for (uint32_t row : sortedRows)
+                takeRow(&chunk[static_cast<uint64_t>(row) * rowWidth]);
+            break;
+        }
+
+        // Equal rows are written to the run once, with their count changes
+        // added up.
+        if (runs == NULL)
+            runs.reset(new TempFile);
+        runStarts.push_back(runs->size() / rowBytes);
+        ID *previous = NULL;
+        for (uint32_t row : sortedRows) {
+            ID *values = &chunk[static_cast<uint64_t>(row) * rowWidth];
+            if (previous != NULL &&
+                    std::equal(values, values + columnCount, previous)) {
+                if (table->counted)
+                    previous[columnCount] += values[columnCount];
+                continue;
+            }
+            if (previous != NULL)
+                runs->append(previous, rowBytes);
+            previous = values;
+        }
+        if (previous != NULL)
+            runs->append(previous, rowBytes);
+    }
+    chunk = std::vector<ID>();
+    for (std::unique_ptr<TempFile> &spill : table->spills)
+        spill.reset();
+
+    if (runs != NULL) {
+        // Merge the sorted runs.  Each run reads its rows through a buffer
+        // holding an equal share of the working memory.
+        struct RunCursor {
+            uint64_t next;
+            uint64_t end;
+            std::vector<ID> buffer;
+            size_t position;
+        };
+        const size_t runCount = runStarts.size();
+        runStarts.push_back(runs->size() / rowBytes);
+        const uint64_t bufferRows = std::max<uint64_t>(
+                    kMinRunBufferRows, workingBytes / (rowBytes * runCount));
+        std::vector<RunCursor> cursors(runCount);
+        auto fillCursor = [&](RunCursor &cursor) -> bool {
+            const uint64_t count = std::min(bufferRows, cursor.end - cursor.next);
+            cursor.buffer.resize(count * rowWidth);
+            cursor.position = 0;
+            if (count == 0)
+                return false;
+            runs->read(cursor.next * rowBytes, cursor.buffer.data(),
+                       count * rowBytes);
+            cursor.next += count;
+            return true;
+        };
+        auto cursorRow = [&](size_t run) -> const ID* {
+            return &cursors[run].buffer[cursors[run].position];
+        };
+        auto compareRuns = [&](size_t x, size_t y) -> bool {
+            // The queue puts the greatest element first, so this comparison
+            // is reversed.
+            const ID *rowX = cursorRow(x);
+            const ID *rowY = cursorRow(y);
+            for (uint32_t column = 0; column < columnCount; ++column) {
+                if (rowX[column] != rowY[column])
+                    return rowX[column] > rowY[column];
+            }
+            return x > y;
+        };
+        std::priority_queue<size_t, std::vector<size_t>, decltype(compareRuns)>
+                queue(compareRuns);
+        for (size_t run = 0; run < runCount; ++run) {
+            cursors[run].next = runStarts[run];
+            cursors[run].end = runStarts[run + 1];
+            if (fillCursor(cursors[run]))
+                queue.push(run);
+        }
+        while (!queue.empty()) {
+            const size_t run = queue.top();
+            queue.pop();
+            takeRow(cursorRow(run));
+            RunCursor &cursor = cursors[run];
+            cursor.position += rowWidth;
+            if (cursor.position < cursor.buffer.size() || fillCursor(cursor))
+                queue.push(run);
+        }
+    }
+
+    // Keep the base rows that follow the last changed row.
+    flushPendingRow();
+    while (hasBaseRow) {
+        keepRow(baseRow.data(), baseCount, baseCount);
+        nextBaseRow();
+    }
+    if (table->counted && !table->isDerived()) {
+        OwnerCounts &tableOwners = m_tableOwners[name];
+        tableOwners.size = rowCount;
+        tableOwners.runs = owners.finish();
+    }
+
+    assert(rowCount <= 0xFFFFFFFFu);
+    table->rowCount = rowCount;
+}
+
+// Write a table in the format of Table::write.
+void IndexMerger::writeTable(Writer &writer, MergeTable *table)
+{
+    writer.writeUInt32(table->rowCount);
+    writer.writeUInt32(table->columnCount());
+    for (const auto &name : table->columnNames) {
+        writer.writeString(name);
+    }
+    writer.writeFramedBuffer(table->encodedRows->fileAt(0),
+                             table->encodedRows->size(), kTableFrameSize);
+    table->encodedRows.reset();
+    Buffer blockDirectory(table->blockDirectory.size() * sizeof(uint32_t));
+    if (blockDirectory.size() > 0) {
+        memcpy(blockDirectory.data(), table->blockDirectory.data(),
+               blockDirectory.size());
+    }
+    writer.writeBuffer(blockDirectory);
+}
+
+// Write the owner counts of the merged strings and rows.  It must be called
+// after the index is written.  Derived tables have no counts of their own.
+void IndexMerger::writeOwners(const std::string &path)
+{
+    assert(m_countOwners);
+    Writer writer(path);
+    writer.writeSignature(kIndexOwnersSignature);
+    writer.writeUInt32(kIndexOwnersVersion);
+    for (auto *owners : { &m_stringOwners, &m_tableOwners }) {
+        writer.writeUInt32(owners->size());
+        for (const auto &pair : *owners) {
+            writer.writeString(pair.first);
+            writer.writeUInt32(pair.second.size);
+            writer.writeBuffer(pair.second.runs);
+        }
+    }
+}
+
+} // namespace indexdb
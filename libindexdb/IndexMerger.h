@@ -0,0 +1,120 @@
+#ifndef INDEXDB_INDEXMERGER_H
+#define INDEXDB_INDEXMERGER_H
+
+#include <stdint.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "StringTable.h"
+
+namespace indexdb {
+
+class Index;
+class IndexMergerMutex;
+class Writer;
+
+// The default bound on the memory the merger uses for table rows.
+const uint64_t kDefaultMergeMemoryBudget = 1024ull * 1024 * 1024;
+
+// Merges many indices into a single index file without building the merged
+// tables in memory.
+//
+// As each index is merged, its strings are added to the merged string tables
+// and its rows are remapped to the merged string IDs.  The rows are buffered
+// until the buffers exceed the memory budget, and then they are spilled to
+// temporary files.  When the index is written, the string tables are sorted,
+// and each table's rows are remapped again, sorted in runs that fit within
+// the budget, and k-way merged directly into the read-only table format.
+//
+// Up to workerCount threads may merge indices at once.  Each thread passes its
+// own worker number to merge, and each worker has its own row buffers and
+// spill files.  The merged string tables are split into shards that are
+// locked separately.
+//
+// The string tables are still held in memory, and the budget does not cover
+// them.  The output is identical to merging the indices into an Index and
+// calling finalizeTables, regardless of the number of workers or the order of
+// the merges.
+//
+// An updatable merge also counts the owners of each string and row, i.e. the
+// number of merged indices containing it, and writeOwners saves the counts
+// next to the index.  A later merge can start from that index with setBase,
+// then merge the indices that were added since and unmerge the ones that were
+// removed.  When it is written, the base index's rows are streamed through
+// once, already in order, and joined with the sorted changes.  Strings and
+// rows whose count drops to zero are dropped.  The output is identical to
+// merging the current indices from scratch.
+class IndexMerger {
+public:
+    explicit IndexMerger(uint64_t memoryBudget=kDefaultMergeMemoryBudget,
+                         int workerCount=1);
+    ~IndexMerger();
+    void countOwners();
+    bool setBase(const std::string &indexPath, const std::string &ownersPath);
+    void merge(const Index &other, int worker=0);
+    void unmerge(const Index &other, int worker=0);
+    void addDerivedTable(const std::string &name,
+                         const std::string &sourceName,
+                         const std::vector<int> &sourceColumns);
+    void write(const std::string &path, bool compressed=false);
+    void write(Writer &writer);
+    void writeOwners(const std::string &path);
+
+    // Disable copying.
+    IndexMerger(const IndexMerger &other) = delete;
+    IndexMerger &operator=(const IndexMerger &other) = delete;
+
+private:
+    class TempFile;
+    class MergeStringTable;
+    struct MergeTable;
+    struct StringIdMaps;
+
+    // Owner counts are stored as runs.  Each run is a count followed by the
+    // number of consecutive strings or rows that have it, both VLE-encoded.
+    struct OwnerCounts {
+        uint32_t size = 0;
+        Buffer runs;
+    };
+
+    MergeStringTable *addStringTable(const std::string &name);
+    MergeTable *addTable(const std::string &name,
+                         const std::vector<std::string> &columnNames);
+    void mergeIndex(const Index &other, int worker, ID ownerDelta);
+    void addRows(MergeTable *table, int worker, const ID *rows,
+                 uint64_t rowCount);
+    void spillRows(int worker);
+    StringTable rebaseStringTable(const std::string &name,
+                                  const StringTable &changes,
+                                  const std::vector<ID> &changeOwners,
+                                  std::vector<ID> &changeIdMap,
+                                  std::vector<ID> &baseIdMap,
+                                  std::vector<ID> &outputIdMap);
+    void encodeTable(const std::string &name, MergeTable *table,
+                     const StringIdMaps &idMaps);
+    void writeTable(Writer &writer, MergeTable *table);
+
+    uint64_t m_memoryBudget;
+    int m_workerCount;
+    uint64_t m_workerBufferLimit;
+    std::vector<uint64_t> m_workerBufferedBytes;
+
+    // The maps are guarded by m_mutex.  Their values are never removed.
+    IndexMergerMutex *m_mutex;
+    std::map<std::string, MergeStringTable*> m_stringTables;
+    std::map<std::string, MergeTable*> m_tables;
+
+    // The owner counts of the base index, and of the index that was written.
+    bool m_countOwners;
+    Index *m_base;
+    std::map<std::string, OwnerCounts> m_baseStringOwners;
+    std::map<std::string, OwnerCounts> m_baseTableOwners;
+    std::map<std::string, OwnerCounts> m_stringOwners;
+    std::map<std::string, OwnerCounts> m_tableOwners;
+};
+
+} // namespace indexdb
+
+#endif // INDEXDB_INDEXMERGER_H
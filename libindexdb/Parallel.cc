@@ -0,0 +1,60 @@
+#include "Parallel.h"
+
+#include <atomic>
+#include <cassert>
+#include <thread>
+#include <vector>
+
+namespace indexdb {
+
+// Zero means "use the hardware concurrency".
+static std::atomic<int> g_workerThreadCount(0);
+
+// The number of active SerialScopes on this thread.
+static thread_local int t_serialScopeDepth = 0;
+
+// Returns the number of threads used for parallel work, such as finalizing
+// tables.
+int workerThreadCount()
+{
+    if (t_serialScopeDepth > 0)
+        return 1;
+    int count = g_workerThreadCount;
+    if (count == 0)
+        count = std::thread::hardware_concurrency();
+    return std::max(1, count);
+}
+
+// Set the number of threads used for parallel work.  A count of zero restores
+// the default, which is one thread per hardware thread.
+void setWorkerThreadCount(int count)
+{
+    assert(count >= 0);
+    g_workerThreadCount = count;
+}
+
+// Call func(worker) for each worker in [0, workers) on its own thread, and
+// wait for the calls to finish.  The calling thread runs worker 0.  The
+// threads are started here rather than in Parallel.h, so clients need not
+// include the thread header.
+void runWorkers(int workers, const std::function<void(int)> &func)
+{
+    std::vector<std::thread> threads;
+    for (int worker = 1; worker < workers; ++worker)
+        threads.push_back(std::thread(func, worker));
+    func(0);
+    for (std::thread &thread : threads)
+        thread.join();
+}
+
+SerialScope::SerialScope()
+{
+    t_serialScopeDepth++;
+}
+
+SerialScope::~SerialScope()
+{
+    t_serialScopeDepth--;
+}
+
+} // namespace indexdb
@@ -0,0 +1,59 @@
+#ifndef INDEXDB_PARALLEL_H
+#define INDEXDB_PARALLEL_H
+
+#include <stddef.h>
+
+#include <algorithm>
+#include <functional>
+
+namespace indexdb {
+
+int workerThreadCount();
+void setWorkerThreadCount(int count);
+void runWorkers(int workers, const std::function<void(int)> &func);
+
+// While a SerialScope is active on a thread, workerThreadCount returns 1 on
+// that thread, so parallel work started there runs on it alone.  Use it when
+// the work is already spread across threads at a coarser grain.
+class SerialScope {
+public:
+    SerialScope();
+    ~SerialScope();
+    SerialScope(const SerialScope &other) = delete;
+    SerialScope &operator=(const SerialScope &other) = delete;
+};
+
+// The fewest items worth starting a thread for.  Smaller inputs are split
+// among fewer workers, and an input smaller than this runs on the calling
+// thread alone.
+const size_t kMinItemsPerWorker = 4096;
+
+// Returns the number of workers that parallelFor uses for count items by
+// default.  Passes that keep per-worker state size it with this count and pass
+// it to parallelFor explicitly.
+inline int parallelWorkerCount(size_t count)
+{
+    return std::max<size_t>(
+                1, std::min<size_t>(workerThreadCount(),
+                                    count / kMinItemsPerWorker));
+}
+
+// Split [0, count) into contiguous chunks and call func(begin, end, worker)
+// for each chunk on its own thread.  The calling thread runs the first chunk.
+// For a given count and worker count, the chunks are always the same, so
+// several passes over the same data can share per-worker state.  By default,
+// the worker count is parallelWorkerCount(count).
+template <typename Func>
+void parallelFor(size_t count, Func func, int workers = -1)
+{
+    if (workers < 0)
+        workers = parallelWorkerCount(count);
+    workers = std::max<size_t>(1, std::min<size_t>(workers, count));
+    runWorkers(workers, [&](int worker) {
+        func(count * worker / workers, count * (worker + 1) / workers, worker);
+    });
+}
+
+} // namespace indexdb
+
+#endif // INDEXDB_PARALLEL_H
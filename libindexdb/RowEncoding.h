@@ -0,0 +1,127 @@
+#ifndef INDEXDB_ROWENCODING_H
+#define INDEXDB_ROWENCODING_H
+
+#include <cassert>
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#include "StringTable.h"
+
+namespace indexdb {
+
+// The encodings of table rows, shared by Table and IndexMerger.
+
+inline uint32_t readVleUInt32(const char *&buffer)
+{
+    uint32_t result = 0;
+    unsigned char nibble;
+    int bit = 0;
+    do {
+        nibble = static_cast<unsigned char>(*(buffer++));
+        result |= (nibble & 0x7F) << bit;
+        bit += 7;
+    } while ((nibble & 0x80) == 0x80);
+    return result;
+}
+
+// This encoding of a uint32 is guaranteed not to contain NUL bytes unless the
+// value is zero.
+inline void writeVleUInt32(char *&buffer, uint32_t value)
+{
+    do {
+        unsigned char nibble = value & 0x7F;
+        value >>= 7;
+        if (value != 0)
+            nibble |= 0x80;
+        *buffer++ = nibble;
+    } while (value != 0);
+}
+
+// Maximum number of bytes used by an encoded row of a given number of columns.
+// This return value does not include the NUL terminator.  It is large enough
+// for both the plain and the delta encodings.
+inline size_t maxEncodedRowSize(int columnCount)
+{
+    return (columnCount + 1) * 5;
+}
+
+inline void encodeRow(const ID *input, int columnCount, char *output)
+{
+    for (int i = 0; i < columnCount; ++i) {
+        uint32_t temp = input[i] + 1;
+        assert(temp != 0);
+        writeVleUInt32(output, temp);
+    }
+    *output++ = '\0';
+}
+
+// Returns a pointer just past the row's NUL terminator.
+inline const char *decodeRow(
+        ID *output, int columnCount, const char *input)
+{
+    const char *pinput = input;
+    for (int i = 0; i < columnCount; ++i) {
+        uint32_t temp = readVleUInt32(pinput);
+        assert(temp != 0);
+        output[i] = temp - 1;
+    }
+    assert(*pinput == '\0');
+    return pinput + 1;
+}
+
+// The delta encoding stores a row relative to the previous row in its block.
+// It starts with the number of leading columns shared with the previous row.
+// The first differing column is stored as the (positive) difference from the
+// previous row's value, and the remaining columns are stored as-is.  The first
+// row of a block is encoded relative to a row of zeros.  As with encodeRow,
+// the encoding contains no NUL bytes other than its terminator.  Returns the
+// encoded size, including the NUL terminator.
+inline size_t encodeDeltaRow(
+        const ID *input, const ID *previous, int columnCount, char *output)
+{
+    char *const start = output;
+    int shared = 0;
+    while (shared < columnCount && input[shared] == previous[shared])
+        shared++;
+    writeVleUInt32(output, shared + 1);
+    if (shared < columnCount) {
+        assert(input[shared] > previous[shared]);
+        writeVleUInt32(output, input[shared] - previous[shared]);
+        for (int i = shared + 1; i < columnCount; ++i) {
+            uint32_t temp = input[i] + 1;
+            assert(temp != 0);
+            writeVleUInt32(output, temp);
+        }
+    }
+    *output++ = '\0';
+    return output - start;
+}
+
+// On input, row holds the previous row.  On output, it holds the decoded row.
+// Returns a pointer just past the row's NUL terminator.
+inline const char *decodeDeltaRow(
+        ID *row, int columnCount, const char *input)
+{
+    const char *pinput = input;
+    const uint32_t shared = readVleUInt32(pinput) - 1;
+    assert(shared <= static_cast<uint32_t>(columnCount));
+    if (shared < static_cast<uint32_t>(columnCount)) {
+        row[shared] += readVleUInt32(pinput);
+        for (int i = shared + 1; i < columnCount; ++i) {
+            uint32_t temp = readVleUInt32(pinput);
+            assert(temp != 0);
+            row[i] = temp - 1;
+        }
+    }
+    assert(*pinput == '\0');
+    return pinput + 1;
+}
+
+std::vector<uint32_t> sortRows(const std::vector<ID> &tableData,
+                               uint32_t rowCount,
+                               uint32_t columnCount);
+
+} // namespace indexdb
+
+#endif // INDEXDB_ROWENCODING_H
@@ -7,8 +7,15 @@
 
 #include <MurmurHash3.h>
 
+#if defined(__SSE2__) || defined(_M_X64) || \
+        (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define STRING_TABLE_SSE2 1
+#include <emmintrin.h>
+#endif
+
 #include "Buffer.h"
 #include "FileIo.h"
+#include "Parallel.h"
 #include "Util.h"
 
 namespace indexdb {
@@ -55,6 +62,7 @@ static uint32_t nextPrimeSize(uint32_t size)
 
 StringTable::StringTable(bool nullTerminateStrings) :
     m_index(32, 0xFF),
+    m_indexLayout(IndexChained),
     m_nullTerminateStrings(nullTerminateStrings)
 {
 #if STRING_TABLE_STATS
@@ -67,6 +75,7 @@ StringTable::StringTable(StringTable &&other) :
     m_data(std::move(other.m_data)),
     m_table(std::move(other.m_table)),
     m_index(std::move(other.m_index)),
+    m_indexLayout(other.m_indexLayout),
     m_nullTerminateStrings(other.m_nullTerminateStrings)
 {
 #if STRING_TABLE_STATS
@@ -75,9 +84,17 @@ StringTable::StringTable(StringTable &&other) :
 #endif
 }
 
-StringTable::StringTable(Reader &reader) :
+// Indexes older than kIndexVersionStringIndexLayout have no layout word and
+// always use the chained layout.
+StringTable::StringTable(Reader &reader, bool hasIndexLayout) :
+    m_indexLayout(IndexChained),
     m_nullTerminateStrings(true)
 {
+    if (hasIndexLayout) {
+        uint32_t layout = reader.readUInt32();
+        assert(layout == IndexChained || layout == IndexOpen);
+        m_indexLayout = static_cast<IndexLayout>(layout);
+    }
     m_data = reader.readBuffer();
     m_table = reader.readBuffer();
     m_index = reader.readBuffer();
@@ -89,11 +106,68 @@ StringTable::StringTable(Reader &reader) :
 
 void StringTable::write(Writer &writer)
 {
+    writer.writeUInt32(m_indexLayout);
     writer.writeBuffer(m_data);
     writer.writeBuffer(m_table);
     writer.writeBuffer(m_index);
 }
 
+// Compare the control bytes of a group of kGroupSize slots against a tag.
+// Bit i of matches is set if control byte i equals the tag, and bit i of
+// empties is set if control byte i is kControlEmpty.
+static inline void matchGroup(
+        const uint8_t *control,
+        uint8_t tag,
+        uint32_t &matches,
+        uint32_t &empties)
+{
+#if STRING_TABLE_SSE2
+    const __m128i group =
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(control));
+    matches = _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(tag)));
+    // Tags never have the high bit set.
+    empties = _mm_movemask_epi8(group);
+#else
+    matches = 0;
+    empties = 0;
+    for (int i = 0; i < 16; ++i) {
+        matches |= static_cast<uint32_t>(control[i] == tag) << i;
+        empties |= static_cast<uint32_t>(control[i] >> 7) << i;
+    }
+#endif
+}
+
+static inline int lowestBitIndex(uint32_t value)
+{
+    assert(value != 0);
+#if defined(__GNUC__)
+    return __builtin_ctz(value);
+#else
+    int ret = 0;
+    while ((value & 1) == 0) {
+        value >>= 1;
+        ret++;
+    }
+    return ret;
+#endif
+}
+
+static inline uint8_t hashTag(uint32_t hash)
+{
+    return hash >> 25;
+}
+
+inline bool StringTable::nodeMatches(
+        ID id,
+        const char *data,
+        uint32_t dataSize,
+        uint32_t hash) const
+{
+    const TableNode *n = &tablePtr()[id];
+    return n->hash == hash && n->size == dataSize &&
+            memcmp(dataPtr() + n->offset, data, dataSize) == 0;
+}
+
 inline ID StringTable::lookup(
         const char *data,
         uint32_t dataSize,
@@ -101,19 +175,27 @@ inline ID StringTable::lookup(
 {
 #if STRING_TABLE_STATS
     m_accesses++;
+#endif
+    if (m_indexLayout == IndexOpen)
+        return lookupOpen(data, dataSize, hash);
+    else
+        return lookupChained(data, dataSize, hash);
+}
+
+inline ID StringTable::lookupChained(
+        const char *data,
+        uint32_t dataSize,
+        uint32_t hash) const
+{
+#if STRING_TABLE_STATS
     m_probes++;
 #endif
     uint32_t index = hash % indexSize();
     for (ID tableIndex = indexPtr()[index];
             tableIndex != kInvalidID;
             tableIndex = tablePtr()[tableIndex].indexNext) {
-        const TableNode *n = &tablePtr()[tableIndex];
-        if (n->hash == hash && n->size == dataSize &&
-                memcmp(dataPtr() + n->offset,
-                       data,
-                       dataSize) == 0) {
+        if (nodeMatches(tableIndex, data, dataSize, hash))
             return tableIndex;
-        }
 #if STRING_TABLE_STATS
         m_probes++;
 #endif
@@ -121,6 +203,37 @@ inline ID StringTable::lookup(
     return kInvalidID;
 }
 
+// Probe the groups starting at the one selected by the hash's low bits.  The
+// probe sequence is triangular, which visits every group of a power-of-two
+// sized table.  The table always has an empty slot, so the probe terminates.
+inline ID StringTable::lookupOpen(
+        const char *data,
+        uint32_t dataSize,
+        uint32_t hash) const
+{
+    const uint32_t groupMask = openIndexCapacity() / kGroupSize - 1;
+    const uint8_t tag = hashTag(hash);
+    uint32_t group = hash & groupMask;
+    for (uint32_t step = 1; ; ++step) {
+#if STRING_TABLE_STATS
+        m_probes++;
+#endif
+        uint32_t matches;
+        uint32_t empties;
+        matchGroup(controlPtr() + group * kGroupSize, tag, matches, empties);
+        while (matches != 0) {
+            const ID id = slotPtr()[group * kGroupSize +
+                                    lowestBitIndex(matches)];
+            if (nodeMatches(id, data, dataSize, hash))
+                return id;
+            matches &= matches - 1;
+        }
+        if (empties != 0)
+            return kInvalidID;
+        group = (group + step) & groupMask;
+    }
+}
+
 ID StringTable::insert(const char *data, uint32_t dataSize, uint32_t hash)
 {
     // If the string table was loaded from a file, then the buffers will be
@@ -133,11 +246,20 @@ ID StringTable::insert(const char *data, uint32_t dataSize, uint32_t hash)
     if (result != kInvalidID)
         return result;
 
+    // The open-addressed index is only built for finalized tables.  Go back
+    // to the chained index to keep inserting.
+    if (m_indexLayout == IndexOpen)
+        resizeHashTable(nextPrimeSize(this->size() * 2));
+
     if (this->size() * 2 > indexSize())
         resizeHashTable(nextPrimeSize(this->indexSize() * 2));
 
     uint32_t index = hash % indexSize();
 
+    // Nodes hold 32-bit offsets into the string data.
+    assert(m_data.size() + dataSize + 1 <= 0xFFFFFFFFu &&
+           "StringTable is too big.");
+
     ID newNodeID = size();
     TableNode newNode;
     newNode.offset = m_data.size();
@@ -153,43 +275,234 @@ ID StringTable::insert(const char *data, uint32_t dataSize, uint32_t hash)
     return newNodeID;
 }
 
+// A string being sorted, along with a cached big-endian copy of its next 8
+// bytes.  Comparing the cached prefixes orders the strings the same way strcmp
+// would, up to the end of the prefix, without touching the string data.
+struct SortKey {
+    uint64_t prefix;
+    ID id;
+};
+
+static inline uint64_t loadPrefix(const char *string)
+{
+    uint64_t ret = 0;
+    int i = 0;
+    for (; i < 8 && string[i] != '\0'; ++i)
+        ret = (ret << 8) | static_cast<unsigned char>(string[i]);
+    return ret << (8 * (8 - i));
+}
+
+// The prefix covers the whole rest of the string when its last byte is NUL.
+static inline bool prefixEndsString(uint64_t prefix)
+{
+    return (prefix & 0xFF) == 0;
+}
+
+// Sort keys whose strings are equal before the given depth.  This is a
+// multikey sort: sort by the cached prefixes, then sort each run of equal
+// prefixes by the next 8 bytes.
+static void sortKeys(
+        const StringTable &table,
+        SortKey *begin,
+        SortKey *end,
+        uint32_t depth)
+{
+    std::sort(begin, end, [](const SortKey &x, const SortKey &y) {
+        return x.prefix < y.prefix;
+    });
+    while (begin != end) {
+        SortKey *runEnd = begin + 1;
+        while (runEnd != end && runEnd->prefix == begin->prefix)
+            ++runEnd;
+        if (runEnd - begin > 1 && !prefixEndsString(begin->prefix)) {
+            for (SortKey *key = begin; key != runEnd; ++key)
+                key->prefix = loadPrefix(table.item(key->id) + depth + 8);
+            sortKeys(table, begin, runEnd, depth + 8);
+        }
+        begin = runEnd;
+    }
+}
+
+// Return the IDs of the table's strings in strcmp order.  Each worker sorts a
+// slice of the strings, then the slices are merged pairwise in parallel.  A
+// small table, such as one file's, is sorted on the calling thread alone.
+static std::vector<ID> sortedStringIDs(const StringTable &table)
+{
+    const uint32_t stringCount = table.size();
+    const int workers = parallelWorkerCount(stringCount);
+
+    std::vector<SortKey> keys(stringCount);
+    std::vector<uint32_t> sliceStart(workers + 1);
+    parallelFor(stringCount, [&](size_t begin, size_t end, int worker) {
+        for (size_t i = begin; i < end; ++i) {
+            keys[i].prefix = loadPrefix(table.item(i));
+            keys[i].id = i;
+        }
+        sortKeys(table, keys.data() + begin, keys.data() + end, 0);
+        sliceStart[worker] = begin;
+    }, workers);
+    sliceStart[workers] = stringCount;
+
+    // Merge adjacent sorted slices until one remains.  The keys' prefixes
+    // are no longer all at the same depth, so reload the first 8 bytes.
+    if (workers > 1) {
+        parallelFor(stringCount, [&](size_t begin, size_t end, int worker) {
+            for (size_t i = begin; i < end; ++i)
+                keys[i].prefix = loadPrefix(table.item(keys[i].id));
+        }, workers);
+    }
+    auto compareKeys = [&](const SortKey &x, const SortKey &y) {
+        if (x.prefix != y.prefix)
+            return x.prefix < y.prefix;
+        if (prefixEndsString(x.prefix))
+            return false;
+        return strcmp(table.item(x.id) + 8, table.item(y.id) + 8) < 0;
+    };
+    std::vector<SortKey> merged(stringCount);
+    for (size_t width = 1; width < static_cast<size_t>(workers); width *= 2) {
+        const size_t pairCount = (workers + 2 * width - 1) / (2 * width);
+        parallelFor(pairCount, [&](size_t begin, size_t end, int worker) {
+            for (size_t pair = begin; pair < end; ++pair) {
+                const size_t first = pair * 2 * width;
+                const uint32_t start = sliceStart[first];
+                const uint32_t middle =
+                        sliceStart[std::min<size_t>(first + width, workers)];
+                const uint32_t stop =
+                        sliceStart[std::min<size_t>(first + 2 * width, workers)];
+                std::merge(keys.begin() + start, keys.begin() + middle,
+                           keys.begin() + middle, keys.begin() + stop,
+                           merged.begin() + start, compareKeys);
+            }
+        }, workers);
+        keys.swap(merged);
+    }
+
+    std::vector<ID> ret(stringCount);
+    for (uint32_t i = 0; i < stringCount; ++i)
+        ret[i] = keys[i].id;
+    return ret;
+}
+
 // Finalize the string table.  Return a sorted string table and a vector
 // mapping from indices in the original string table to indices in the new
 // sorted table.
+//
+// The new table is built in one step rather than by inserting each string,
+// and it gets an open-addressed index.
 std::pair<StringTable, std::vector<ID> >
 StringTable::finalized()
 {
     const uint32_t stringCount = size();
+    const std::vector<ID> sortedStrings = sortedStringIDs(*this);
 
-    // Construct a table of sorted indexes to original indexes.
-    std::vector<uint32_t> sortedStrings(stringCount);
-    for (uint32_t i = 0; i < stringCount; ++i)
-        sortedStrings[i] = i;
-    struct CompareFunc {
-        const StringTable *input;
-        bool operator()(uint32_t x, uint32_t y) {
-            return strcmp(input->item(x), input->item(y)) < 0;
-        }
-    };
-    CompareFunc func;
-    func.input = this;
-    std::sort(&sortedStrings[0], &sortedStrings[stringCount], func);
+    // Lay out the new string data.  Each worker sums the sizes of its slice
+    // of strings, then copies the strings into place.
+    const int workers = parallelWorkerCount(stringCount);
+    std::vector<uint32_t> sliceOffset(workers);
+    parallelFor(stringCount, [&](size_t begin, size_t end, int worker) {
+        uint32_t total = 0;
+        for (size_t i = begin; i < end; ++i)
+            total += itemSize(sortedStrings[i]) + 1;
+        sliceOffset[worker] = total;
+    }, workers);
+    uint32_t dataSize = 0;
+    for (int worker = 0; worker < workers; ++worker) {
+        const uint32_t sliceSize = sliceOffset[worker];
+        sliceOffset[worker] = dataSize;
+        dataSize += sliceSize;
+    }
 
-    // Copy each string into the new StringTable.
     StringTable newTable;
     std::vector<ID> idMap(stringCount);
-    for (uint32_t newIndex = 0; newIndex < stringCount; ++newIndex) {
-        uint32_t oldIndex = sortedStrings[newIndex];
-        idMap[oldIndex] = newIndex;
-        newTable.insert(
-                    item(oldIndex),
-                    itemSize(oldIndex),
-                    itemHash(oldIndex));
-    }
+    newTable.m_data = Buffer(dataSize);
+    newTable.m_table = Buffer(stringCount * sizeof(TableNode));
+    parallelFor(stringCount, [&](size_t begin, size_t end, int worker) {
+        uint32_t offset = sliceOffset[worker];
+        for (size_t newIndex = begin; newIndex < end; ++newIndex) {
+            const ID oldIndex = sortedStrings[newIndex];
+            const uint32_t itemSize = this->itemSize(oldIndex);
+            idMap[oldIndex] = newIndex;
+            TableNode &node = newTable.tablePtr()[newIndex];
+            node.offset = offset;
+            node.size = itemSize;
+            node.hash = itemHash(oldIndex);
+            memcpy(newTable.dataPtr() + offset, item(oldIndex), itemSize);
+            offset += itemSize + 1; // Leave the NUL-terminator.
+        }
+    }, workers);
+
+    newTable.buildOpenIndex();
 
     return std::make_pair(std::move(newTable), std::move(idMap));
 }
 
+// Build a table holding the given strings, which must be distinct and already
+// in strcmp order, e.g. the strings of two finalized tables merged in order.
+// Each item is a table and the ID of a string in it.  Like a finalized table,
+// the new table gets an open-addressed index, and nothing is sorted.
+StringTable StringTable::fromSortedItems(
+        const std::vector<std::pair<const StringTable*, ID> > &items)
+{
+    const uint32_t stringCount = items.size();
+    const int workers = parallelWorkerCount(stringCount);
+    std::vector<uint32_t> sliceOffset(workers);
+    parallelFor(stringCount, [&](size_t begin, size_t end, int worker) {
+        uint32_t total = 0;
+        for (size_t i = begin; i < end; ++i)
+            total += items[i].first->itemSize(items[i].second) + 1;
+        sliceOffset[worker] = total;
+    }, workers);
+    uint64_t dataSize = 0;
+    for (int worker = 0; worker < workers; ++worker) {
+        const uint32_t sliceSize = sliceOffset[worker];
+        sliceOffset[worker] = dataSize;
+        dataSize += sliceSize;
+    }
+    assert(dataSize <= 0xFFFFFFFFu && "StringTable is too big.");
+
+    StringTable newTable;
+    newTable.m_data = Buffer(dataSize);
+    newTable.m_table = Buffer(stringCount * sizeof(TableNode));
+    parallelFor(stringCount, [&](size_t begin, size_t end, int worker) {
+        uint32_t offset = sliceOffset[worker];
+        for (size_t newIndex = begin; newIndex < end; ++newIndex) {
+            const StringTable &table = *items[newIndex].first;
+            const ID oldIndex = items[newIndex].second;
+            const uint32_t itemSize = table.itemSize(oldIndex);
+            TableNode &node = newTable.tablePtr()[newIndex];
+            node.offset = offset;
+            node.size = itemSize;
+            node.hash = table.itemHash(oldIndex);
+            memcpy(newTable.dataPtr() + offset, table.item(oldIndex), itemSize);
+            offset += itemSize + 1; // Leave the NUL-terminator.
+        }
+    }, workers);
+
+    newTable.buildOpenIndex();
+    return newTable;
+}
+
+// Move the strings of other tables to the end of this table, emptying the
+// other tables.  No string may be in more than one of the tables.  Each
+// table's strings keep their order, so a string's new ID is its old ID plus
+// the number of strings that precede its table.
+void StringTable::appendDistinct(const std::vector<StringTable*> &others)
+{
+    for (StringTable *other : others) {
+        assert(m_nullTerminateStrings == other->m_nullTerminateStrings);
+        assert(m_data.size() + other->m_data.size() <= 0xFFFFFFFFu &&
+               "StringTable is too big.");
+        const uint32_t dataOffset = m_data.size();
+        const ID firstID = size();
+        m_data.append(other->m_data.data(), other->m_data.size());
+        m_table.append(other->m_table.data(), other->m_table.size());
+        for (ID i = firstID; i < size(); ++i)
+            tablePtr()[i].offset = tablePtr()[i].offset + dataOffset;
+        *other = StringTable(m_nullTerminateStrings);
+    }
+    resizeHashTable(nextPrimeSize(size() * 2));
+}
+
 ID StringTable::id(const char *string) const
 {
     size_t size = strlen(string);
@@ -219,6 +532,7 @@ ID StringTable::insert(const char *string, uint32_t size)
 void StringTable::resizeHashTable(uint32_t newIndexSize)
 {
     m_index = Buffer(newIndexSize * sizeof(ID), 0xFF);
+    m_indexLayout = IndexChained;
     for (ID i = 0; i < size(); ++i) {
         tablePtr()[i].indexNext = kInvalidID;
     }
@@ -230,18 +544,61 @@ void StringTable::resizeHashTable(uint32_t newIndexSize)
     }
 }
 
+// Replace the index with an open-addressed index that is at most 7/8 full.
+void StringTable::buildOpenIndex()
+{
+    uint32_t capacity = kGroupSize;
+    while (size() > capacity / 8 * 7)
+        capacity *= 2;
+    Buffer index(capacity * (1 + sizeof(ID)), kControlEmpty);
+    uint8_t *const control = static_cast<uint8_t*>(index.data());
+    EncodedID *const slots = reinterpret_cast<EncodedID*>(control + capacity);
+    const uint32_t groupMask = capacity / kGroupSize - 1;
+    for (ID i = 0; i < size(); ++i) {
+        TableNode *n = &tablePtr()[i];
+        n->indexNext = kInvalidID;
+        const uint32_t hash = n->hash;
+        uint32_t group = hash & groupMask;
+        for (uint32_t step = 1; ; ++step) {
+            uint32_t matches;
+            uint32_t empties;
+            matchGroup(control + group * kGroupSize, 0, matches, empties);
+            if (empties != 0) {
+                const uint32_t slot =
+                        group * kGroupSize + lowestBitIndex(empties);
+                control[slot] = hashTag(hash);
+                slots[slot] = i;
+                break;
+            }
+            group = (group + step) & groupMask;
+        }
+    }
+    m_index = std::move(index);
+    m_indexLayout = IndexOpen;
+}
+
 #if STRING_TABLE_STATS
 void StringTable::dumpStats() const
 {
+    uint32_t indexSize;
     uint32_t emptyCells = 0;
-    for (uint32_t i = 0; i < indexSize(); ++i) {
-         if (indexPtr()[i] == kInvalidID)
-             emptyCells++;
+    if (m_indexLayout == IndexOpen) {
+        indexSize = openIndexCapacity();
+        for (uint32_t i = 0; i < indexSize; ++i) {
+            if (controlPtr()[i] == kControlEmpty)
+                emptyCells++;
+        }
+    } else {
+        indexSize = this->indexSize();
+        for (uint32_t i = 0; i < indexSize; ++i) {
+            if (indexPtr()[i] == kInvalidID)
+                emptyCells++;
+        }
     }
     printf("size=%d indexSize=%d emptyCells=%d accesses=%llu "
            "(probes=%llu collisions=%llu)\n",
            size(),
-           indexSize(),
+           indexSize,
            emptyCells,
            static_cast<unsigned long long>(m_accesses),
            static_cast<unsigned long long>(m_probes),
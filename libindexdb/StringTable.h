@@ -49,10 +49,29 @@ private:
         EncodedID indexNext;
     };
 
+    // The layout of m_index.
+    //
+    // IndexChained: a prime-sized array of IDs, each heading a chain of
+    // TableNodes linked through indexNext.
+    //
+    // IndexOpen: a power-of-two sized open-addressed table.  The buffer holds
+    // one control byte per slot followed by one ID per slot.  A control byte
+    // is either kControlEmpty or the top 7 bits of the slot's hash.  Slots are
+    // probed in aligned groups of kGroupSize, so a group's control bytes can
+    // be compared to a hash's tag with a single SSE2 compare.  The indexNext
+    // fields are unused.
+    enum IndexLayout {
+        IndexChained = 0,
+        IndexOpen = 1
+    };
+    static const uint32_t kGroupSize = 16;
+    static const uint8_t kControlEmpty = 0x80;
+
 private:
     Buffer m_data;
     Buffer m_table;
     Buffer m_index;
+    IndexLayout m_indexLayout;
     bool m_nullTerminateStrings;
 #if STRING_TABLE_STATS
     mutable uint64_t m_accesses;
@@ -70,15 +89,32 @@ private:
 
     uint32_t indexSize() const { return m_index.size() / sizeof(ID); }
     void resizeHashTable(uint32_t newIndexSize);
+
+    uint32_t openIndexCapacity() const { return m_index.size() / (1 + sizeof(ID)); }
+    const uint8_t *controlPtr() const { return static_cast<const uint8_t*>(m_index.data()); }
+    const EncodedID *slotPtr() const {
+        return reinterpret_cast<const EncodedID*>(controlPtr() + openIndexCapacity());
+    }
+    void buildOpenIndex();
+
+    inline bool nodeMatches(ID id, const char *data, uint32_t dataSize,
+                            uint32_t hash) const;
     inline ID lookup(const char *data, uint32_t dataSize, uint32_t hash) const;
+    inline ID lookupChained(const char *data, uint32_t dataSize,
+                            uint32_t hash) const;
+    inline ID lookupOpen(const char *data, uint32_t dataSize,
+                         uint32_t hash) const;
     ID insert(const char *data, uint32_t dataSize, uint32_t hash);
     std::pair<StringTable, std::vector<ID> > finalized();
+    static StringTable fromSortedItems(
+            const std::vector<std::pair<const StringTable*, ID> > &items);
+    void appendDistinct(const std::vector<StringTable*> &others);
 
 public:
     explicit StringTable(bool nullTerminateStrings=true);
     StringTable(StringTable &&other);
     StringTable &operator=(StringTable &&other) = default;
-    explicit StringTable(Reader &reader);
+    StringTable(Reader &reader, bool hasIndexLayout);
     void write(Writer &writer);
 
     ID id(const char *string) const;
@@ -106,6 +142,7 @@ public:
     Buffer pillageContent() { return std::move(m_data); }
 
     friend class Index;
+    friend class IndexMerger;
 };
 
 } // namespace indexdb
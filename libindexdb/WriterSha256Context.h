@@ -1,12 +1,28 @@
 #ifndef INDEXDB_WRITERSHA256CONTEXT_H
 #define INDEXDB_WRITERSHA256CONTEXT_H
 
+#include <climits>
+#include <stdint.h>
+
+#include <algorithm>
+
 #include <sha2.h>
 
 namespace indexdb {
 
 struct WriterSha256Context {
     sha256_ctx ctx;
+
+    // sha256_update takes an unsigned int length, so a larger update is split.
+    void update(const void *data, uint64_t size) {
+        const unsigned char *bytes = static_cast<const unsigned char*>(data);
+        do {
+            const unsigned int length = std::min<uint64_t>(UINT_MAX, size);
+            sha256_update(&ctx, bytes, length);
+            bytes += length;
+            size -= length;
+        } while (size > 0);
+    }
 };
 
 } // namespace indexdb
@@ -5,22 +5,35 @@ TARGET = indexdb
 TEMPLATE = lib
 
 SOURCES += \
+    Arena.cc \
     Buffer.cc \
     FileIo.cc \
     FileIo64BitSupport.cc \
+    FramedBuffer.cc \
     IndexArchiveBuilder.cc \
     IndexArchiveReader.cc \
     IndexDb.cc \
+    IndexFingerprint.cc \
+    IndexMergeCache.cc \
+    IndexMerger.cc \
+    Parallel.cc \
     StringTable.cc
 
 HEADERS += \
+    Arena.h \
     Buffer.h \
     Endian.h \
     FileIo.h \
     FileIo64BitSupport.h \
+    FramedBuffer.h \
     IndexArchiveBuilder.h \
     IndexArchiveReader.h \
     IndexDb.h \
+    IndexFingerprint.h \
+    IndexMergeCache.h \
+    IndexMerger.h \
+    Parallel.h \
+    RowEncoding.h \
     StringTable.h \
     Util.h \
     WriterSha256Context.h
@@ -17,34 +17,29 @@ void Project::queryFileRefs(
         uint32_t firstLine,
         uint32_t lastLine)
 {
-    indexdb::Row rowLookup(2);
+    indexdb::Row rowLower(2);
+    indexdb::Row rowUpper(2);
     assert(RC_File == 0);
     assert(RC_Line == 1);
-    rowLookup[RC_File] = fileID(file.path());
-    rowLookup[RC_Line] = firstLine;
-    // TODO: Add a class named TableIteratorRange (or TableRange) and a method
-    // that accepts a lower bound and an upper bound.  It should do a single
-    // O(log n) binary search, but produce two iterators.  This will
-    // drastically simplify all of the querying code in this class.
-    indexdb::TableIterator it = m_refTable->lowerBound(rowLookup);
+    rowLower[RC_File] = rowUpper[RC_File] = fileID(file.path());
+    rowLower[RC_Line] = firstLine;
+    rowUpper[RC_Line] = lastLine;
+    indexdb::TableRange range = m_refTable->range(rowLower, rowUpper);
 
-    indexdb::TableIterator itEnd = m_refTable->end();
-    indexdb::Row rowItem(RC_Count);
-    for (; it != itEnd; ++it) {
-        it.value(rowItem);
-        // TODO: See above comment regarding TableIteratorRange.  This ought to
-        // be removed.
-        if (rowItem[RC_File] != rowLookup[RC_File] ||
-                rowItem[RC_Line] > lastLine)
-            break;
-        Ref ref(*this,
-                rowItem[RC_Symbol],
-                rowItem[RC_File],
-                rowItem[RC_Line],
-                rowItem[RC_StartColumn],
-                rowItem[RC_EndColumn],
-                rowItem[RC_RefType]);
-        callback(ref);
+    indexdb::ID rows[kQueryBatchRows * RC_Count];
+    size_t count;
+    while ((count = range.read(rows, kQueryBatchRows)) > 0) {
+        for (size_t i = 0; i < count; ++i) {
+            const indexdb::ID *rowItem = &rows[i * RC_Count];
+            Ref ref(*this,
+                    rowItem[RC_Symbol],
+                    rowItem[RC_File],
+                    rowItem[RC_Line],
+                    rowItem[RC_StartColumn],
+                    rowItem[RC_EndColumn],
+                    rowItem[RC_RefType]);
+            callback(ref);
+        }
     }
 }
 
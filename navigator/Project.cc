@@ -77,28 +77,27 @@ QList<Ref> Project::queryReferencesOfSymbol(const QString &symbol)
     indexdb::Row rowLookup(1);
     assert(RIC_Symbol == 0);
     rowLookup[RIC_Symbol] = symbolID;
+    indexdb::TableRange range = m_refIndexTable->equalRange(rowLookup);
 
-    indexdb::Row rowItem(RIC_Count);
-    indexdb::TableIterator itEnd = m_refIndexTable->end();
-    indexdb::TableIterator it = m_refIndexTable->lowerBound(rowLookup);
-    for (; it != itEnd; ++it) {
-        it.value(rowItem);
-        if (rowLookup[RIC_Symbol] != rowItem[RIC_Symbol])
-            break;
-
-        indexdb::ID fileID = rowItem[RIC_File];
-        int line = rowItem[RIC_Line];
-        int startColumn = rowItem[RIC_StartColumn];
-        int endColumn = rowItem[RIC_EndColumn];
-        indexdb::ID kindID = rowItem[RIC_RefType];
-
-        result << Ref(*this,
-                      symbolID,
-                      fileID,
-                      line,
-                      startColumn,
-                      endColumn,
-                      kindID);
+    indexdb::ID rows[kQueryBatchRows * RIC_Count];
+    size_t count;
+    while ((count = range.read(rows, kQueryBatchRows)) > 0) {
+        for (size_t i = 0; i < count; ++i) {
+            const indexdb::ID *rowItem = &rows[i * RIC_Count];
+            indexdb::ID fileID = rowItem[RIC_File];
+            int line = rowItem[RIC_Line];
+            int startColumn = rowItem[RIC_StartColumn];
+            int endColumn = rowItem[RIC_EndColumn];
+            indexdb::ID kindID = rowItem[RIC_RefType];
+
+            result << Ref(*this,
+                          symbolID,
+                          fileID,
+                          line,
+                          startColumn,
+                          endColumn,
+                          kindID);
+        }
     }
 
     return result;
@@ -118,19 +117,20 @@ QStringList Project::queryAllPaths()
     const indexdb::ID pathTypeID = m_symbolTypeStringTable->id("Path");
     if (pathTypeID == indexdb::kInvalidID)
         return QStringList();
-    indexdb::Row row(2);
-    row[0] = pathTypeID;
-    row[1] = 0;
-    indexdb::TableIterator itEnd = m_symbolTypeIndexTable->end();
-    indexdb::TableIterator it = m_symbolTypeIndexTable->lowerBound(row);
+    indexdb::Row rowLookup(1);
+    assert(STIC_SymbolType == 0);
+    rowLookup[STIC_SymbolType] = pathTypeID;
+    indexdb::TableRange range = m_symbolTypeIndexTable->equalRange(rowLookup);
     QStringList result;
-    for (; it != itEnd; ++it) {
-        it.value(row);
-        if (row[0] != pathTypeID)
-            break;
-        const char *path = m_symbolStringTable->item(row[1]);
-        assert(path[0] == kPathSymbolPrefix);
-        result.append(path + 1);
+    indexdb::ID rows[kQueryBatchRows * STIC_Count];
+    size_t count;
+    while ((count = range.read(rows, kQueryBatchRows)) > 0) {
+        for (size_t i = 0; i < count; ++i) {
+            const indexdb::ID *rowItem = &rows[i * STIC_Count];
+            const char *path = m_symbolStringTable->item(rowItem[STIC_Symbol]);
+            assert(path[0] == kPathSymbolPrefix);
+            result.append(path + 1);
+        }
     }
     return result;
 }
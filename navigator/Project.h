@@ -73,6 +73,9 @@ private:
     std::vector<indexdb::ID> m_symbolType;
 };
 
+// The number of rows the queries decode from a table at a time.
+const size_t kQueryBatchRows = 256;
+
 // Reference table
 enum RefColumn {
     RC_File         = 0,
@@ -102,6 +105,13 @@ enum SymbolColumn {
     SC_Count        = 2
 };
 
+// SymbolTypeIndex table
+enum SymbolTypeIndexColumn {
+    STIC_SymbolType = 0,
+    STIC_Symbol     = 1,
+    STIC_Count      = 2
+};
+
 } // namespace Nav
 
 #endif // NAV_PROJECT_H